@@ -79,13 +79,14 @@ static int disasm_exec(spn_uword *bc, size_t textlen)
 		}
 
 		switch (opcode) {
-		case SPN_INS_CALL: {
+		case SPN_INS_CALL:
+		case SPN_INS_TAILCALL: {
 			int retv = OPA(ins);
 			int func = OPB(ins);
 			int argc = OPC(ins);
 			int i;
 
-			printf("call\tr%d = r%d(", retv, func);
+			printf("%s\tr%d = r%d(", opcode == SPN_INS_CALL ? "call" : "tailcall", retv, func);
 
 			for (i = 0; i < argc; i++) {
 				if (i > 0) {
@@ -278,13 +279,13 @@ static int disasm_exec(spn_uword *bc, size_t textlen)
 			break;
 		}
 		case SPN_INS_NEWARR: {
-			int opa = OPA(ins);
-			printf("ld\tr%d, new array\n", opa);
+			int opa = OPA(ins), opmid = OPMID(ins);
+			printf("ld\tr%d, new array\t# capacity %d\n", opa, opmid);
 			break;
 		}
 		case SPN_INS_NEWHASH: {
-			int opa = OPA(ins);
-			printf("ld\tr%d, new hashmap\n", opa);
+			int opa = OPA(ins), opmid = OPMID(ins);
+			printf("ld\tr%d, new hashmap\t# capacity %d\n", opa, opmid);
 			break;
 		}
 		case SPN_INS_IDX_GET: {
@@ -425,6 +426,95 @@ static int disasm_exec(spn_uword *bc, size_t textlen)
 				opa, opb, opc, opa, opb, opc);
 			break;
 		}
+		case SPN_INS_JEQ:
+		case SPN_INS_JNE:
+		case SPN_INS_JLT:
+		case SPN_INS_JLE:
+		case SPN_INS_JGT:
+		case SPN_INS_JGE: {
+			/* same order as in the enum, as always */
+			static const char *const opnames[] = {
+				"jeq",
+				"jne",
+				"jlt",
+				"jle",
+				"jgt",
+				"jge"
+			};
+
+			spn_sword offset = *ip++;
+			unsigned long dstaddr = ip + offset - bc;
+			int opidx = opcode - SPN_INS_JEQ;
+			int opa = OPA(ins), opb = OPB(ins);
+
+			printf("%s\tr%d, r%d, %+" SPN_SWORD_FMT "\t# target: %#08lx\n",
+				opnames[opidx],
+				opa,
+				opb,
+				offset,
+				dstaddr
+			);
+
+			break;
+		}
+		case SPN_INS_LENGTH: {
+			int opa = OPA(ins), opb = OPB(ins);
+			printf("length\tr%d, r%d\n", opa, opb);
+			break;
+		}
+		case SPN_INS_CONCATN: {
+			int opa = OPA(ins), n = OPB(ins);
+			int i;
+
+			printf("concatn\tr%d", opa);
+
+			for (i = 0; i < n; i++) {
+				printf(", r%d", nth_arg_idx(ip, i));
+			}
+
+			printf("\n");
+
+			/* skip operand register indices */
+			ip += ROUNDUP(n, SPN_WORD_OCTETS);
+
+			break;
+		}
+		case SPN_INS_FORLT:
+		case SPN_INS_FORLE:
+		case SPN_INS_FORGT:
+		case SPN_INS_FORGE: {
+			static const char *const opnames[] = {
+				"forlt",
+				"forle",
+				"forgt",
+				"forge"
+			};
+
+			spn_sword offset = *ip++;
+			unsigned long dstaddr = ip + offset - bc;
+			int opidx = opcode - SPN_INS_FORLT;
+			int opa = OPA(ins), opb = OPB(ins), opc = OPC(ins);
+			int step = opc < 0x80 ? opc : opc - 0x100;
+
+			printf("%s\tr%d, r%d, %+d, %+" SPN_SWORD_FMT "\t# target: %#08lx\n",
+				opnames[opidx],
+				opa,
+				opb,
+				step,
+				offset,
+				dstaddr
+			);
+
+			break;
+		}
+		case SPN_INS_ADDI:
+		case SPN_INS_SUBI: {
+			int opa = OPA(ins), opb = OPB(ins), opc = OPC(ins);
+			printf("%s\tr%d, r%d, %d\n",
+				opcode == SPN_INS_ADDI ? "addi" : "subi",
+				opa, opb, opc);
+			break;
+		}
 		default:
 			spn_die(
 				"error disassembling bytecode: "
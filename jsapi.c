@@ -110,7 +110,7 @@ extern int jspn_compile(const char *src)
 		return ERROR_INDEX;
 	}
 
-	return add_to_values((SpnValue){ .type = SPN_TYPE_FUNC, .v.o = fn });
+	return add_to_values(spn_makeobject(SPN_TYPE_FUNC, fn));
 }
 
 extern int jspn_compileExpr(const char *src)
@@ -120,7 +120,7 @@ extern int jspn_compileExpr(const char *src)
 		return ERROR_INDEX;
 	}
 
-	return add_to_values((SpnValue){ .type = SPN_TYPE_FUNC, .v.o = fn });
+	return add_to_values(spn_makeobject(SPN_TYPE_FUNC, fn));
 }
 
 extern int jspn_parse(const char *src)
@@ -130,7 +130,7 @@ extern int jspn_parse(const char *src)
 		return ERROR_INDEX;
 	}
 
-	SpnValue val = { .type = SPN_TYPE_HASHMAP, .v.o = ast };
+	SpnValue val = spn_makeobject(SPN_TYPE_HASHMAP, ast);
 	int index = add_to_values(val);
 	spn_object_release(ast);
 	return index;
@@ -143,7 +143,7 @@ extern int jspn_parseExpr(const char *src)
 		return ERROR_INDEX;
 	}
 
-	SpnValue val = { .type = SPN_TYPE_HASHMAP, .v.o = ast };
+	SpnValue val = spn_makeobject(SPN_TYPE_HASHMAP, ast);
 	int index = add_to_values(val);
 	spn_object_release(ast);
 	return index;
@@ -160,14 +160,14 @@ extern int jspn_compileAST(int astIndex)
 		return ERROR_INDEX;
 	}
 
-	return add_to_values((SpnValue){ .type = SPN_TYPE_FUNC, .v.o = fn });
+	return add_to_values(spn_makeobject(SPN_TYPE_FUNC, fn));
 }
 
 extern int jspn_call(int func_index, int argv_index)
 {
 	SpnValue func_val = value_by_index(func_index);
 	if (!isfunc(&func_val)) {
-		const void *args[] = { spn_type_name(func_val.type) };
+		const void *args[] = { spn_type_name(valtype(&func_val)) };
 		spn_ctx_runtime_error(get_global_context(), "attempt to call value of non-function type %s", args);
 		return ERROR_INDEX;
 	}
@@ -313,7 +313,7 @@ extern int jspn_addArrayWithIndexBuffer(int32_t *indexBuffer, size_t n_objects)
 		spn_array_push(array, &val);
 	}
 
-	int result_index = add_to_values((SpnValue){ .type = SPN_TYPE_ARRAY, .v.o = array });
+	int result_index = add_to_values(spn_makeobject(SPN_TYPE_ARRAY, array));
 	spn_object_release(array);
 	return result_index;
 }
@@ -330,7 +330,7 @@ extern int jspn_addDictionaryWithIndexBuffer(int32_t *indexBuffer, size_t n_key_
 		spn_hashmap_set(dict, &key, &val);
 	}
 
-	int result_index = add_to_values((SpnValue){ .type = SPN_TYPE_HASHMAP, .v.o = dict });
+	int result_index = add_to_values(spn_makeobject(SPN_TYPE_HASHMAP, dict));
 	spn_object_release(dict);
 	return result_index;
 }
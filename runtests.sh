@@ -1,4 +1,4 @@
-#!/bin/sh
+#!/bin/bash
 
 CLR_ERR="\x1b[1;31m"
 CLR_SUC="\x1b[1;32m"
@@ -44,15 +44,31 @@ function test_invalid {
 	}
 }
 
+function run_api_tests {
+	for f in $1/test_*; do
+		printf "Testing %s... " $f
+
+		$VALGRIND $f && {
+			echo "OK"
+			PASSED=$((PASSED+1))
+		} || {
+			echo "${CLR_ERR}failed$CLR_RST";
+			FAILED=$((FAILED+1))
+		}
+	done
+}
+
 function run_tests_in_directory {
 	TESTDIR=$1
 	SPARKLING=$2
 
 	for f in $TESTDIR/p_*; do
+		[ -e "$f" ] || continue;
 		test_valid "$SPARKLING" "$f";
 	done
 
 	for f in $TESTDIR/f_*; do
+		[ -e "$f" ] || continue;
 		test_invalid "$SPARKLING" "$f";
 	done
 }
@@ -72,12 +88,15 @@ run_tests_in_directory parser "$WORKDIR/bld/spn --dump-ast";
 # run_tests_in_directory compiler "$WORKDIR/bld/spn --compile";
 
 # Run unit tests for VM/runtime
-# run_tests_in_directory runtime "$WORKDIR/bld/spn";
+run_tests_in_directory runtime "$WORKDIR/bld/spn";
 
 # Run unit tests for library functions
 # run_tests_in_directory stdlib "$WORKDIR/bld/spn";
 
 popd
 
+# Run tests of the C API (built by 'make test')
+run_api_tests bld;
+
 echo "$CLR_BLD$((PASSED+FAILED)) total, $CLR_SUC$PASSED passed, $CLR_ERR$FAILED failed$CLR_RST"
 
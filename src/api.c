@@ -10,9 +10,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 #include <float.h>
 #include <assert.h>
+#include <time.h>
 
 #include "api.h"
 #include "parser.h"
@@ -65,9 +67,209 @@ int spn_object_cmp(void *lp, void *rp)
 	return lhs->isa->compare(lhs, rhs);
 }
 
+/* Slab allocator.
+ * Each size class (multiples of SLAB_GRANULE, up to SLAB_MAX_CHUNK bytes)
+ * has its own free list of chunks. When a free list runs out, a new slab
+ * of SLAB_BYTES bytes is allocated and cut up into chunks of that size.
+ * Larger objects are allocated using malloc() directly. All slabs are kept
+ * in a linked list, so that they are still reachable even if all of their
+ * chunks are in use. (The first granule of each slab holds the link.)
+ *
+ * The free lists, the statistics and the allocator hook are shared by all
+ * contexts, which may be used from different threads, so they are only
+ * accessed with 'object_lock' held. This includes calls to the allocator
+ * hook, but not calls to destructors, which release other objects.
+ */
+#define SLAB_GRANULE   16
+#define SLAB_MAX_CHUNK 256
+#define SLAB_BYTES     8192
+#define SLAB_NCLASSES  (SLAB_MAX_CHUNK / SLAB_GRANULE)
+
+typedef struct SlabChunk {
+	struct SlabChunk *next;
+} SlabChunk;
+
+static SlabChunk *slab_free_lists[SLAB_NCLASSES];
+static SlabChunk *slab_list = NULL;
+
+/* per-class statistics. Core classes are indexed by their UID,
+ * user-defined classes are searched for linearly.
+ */
+typedef struct ClassStats {
+	unsigned long UID;
+	size_t live;
+	size_t bytes;
+} ClassStats;
+
+static ClassStats core_class_stats[SPN_CLASS_UID_SYMBOLSTUB + 1];
+static ClassStats *user_class_stats = NULL;
+static size_t n_user_class_stats = 0;
+
+static SpnObjectStats object_stats;
+
+static SpnSpinLock object_lock = 0;
+
+static void *slab_alloc(size_t size, void *ctx)
+{
+	size_t idx;
+	SlabChunk *chunk;
+
+	if (size > SLAB_MAX_CHUNK) {
+		return malloc(size);
+	}
+
+	idx = (size - 1) / SLAB_GRANULE;
+
+	/* free list is empty, so allocate and cut up a new slab */
+	if (slab_free_lists[idx] == NULL) {
+		size_t chunksize = (idx + 1) * SLAB_GRANULE;
+		char *slab = malloc(SLAB_BYTES);
+		char *p;
+
+		if (slab == NULL) {
+			return NULL;
+		}
+
+		((SlabChunk *)(slab))->next = slab_list;
+		slab_list = (SlabChunk *)(slab);
+
+		for (p = slab + SLAB_GRANULE; p + chunksize <= slab + SLAB_BYTES; p += chunksize) {
+			chunk = (SlabChunk *)(p);
+			chunk->next = slab_free_lists[idx];
+			slab_free_lists[idx] = chunk;
+		}
+
+		object_stats.slab_bytes += SLAB_BYTES;
+	}
+
+	chunk = slab_free_lists[idx];
+	slab_free_lists[idx] = chunk->next;
+	object_stats.slab_used += (idx + 1) * SLAB_GRANULE;
+
+	return chunk;
+}
+
+static void slab_dealloc(void *ptr, size_t size, void *ctx)
+{
+	size_t idx;
+	SlabChunk *chunk = ptr;
+
+	if (size > SLAB_MAX_CHUNK) {
+		free(ptr);
+		return;
+	}
+
+	idx = (size - 1) / SLAB_GRANULE;
+	chunk->next = slab_free_lists[idx];
+	slab_free_lists[idx] = chunk;
+	object_stats.slab_used -= (idx + 1) * SLAB_GRANULE;
+}
+
+static const SpnAllocator default_allocator = {
+	slab_alloc,
+	slab_dealloc,
+	NULL
+};
+
+static SpnAllocator object_allocator = {
+	slab_alloc,
+	slab_dealloc,
+	NULL
+};
+
+int spn_object_set_allocator(const SpnAllocator *allocator)
+{
+	int status = -1;
+
+	SPN_SPIN_LOCK(&object_lock);
+
+	if (object_stats.live_objects == 0) {
+		object_allocator = allocator ? *allocator : default_allocator;
+		status = 0;
+	}
+
+	SPN_SPIN_UNLOCK(&object_lock);
+
+	return status;
+}
+
+static ClassStats *class_stats(unsigned long UID, int create)
+{
+	size_t i;
+
+	if (UID < COUNT(core_class_stats)) {
+		return &core_class_stats[UID];
+	}
+
+	for (i = 0; i < n_user_class_stats; i++) {
+		if (user_class_stats[i].UID == UID) {
+			return &user_class_stats[i];
+		}
+	}
+
+	if (!create) {
+		return NULL;
+	}
+
+	user_class_stats = spn_realloc(
+		user_class_stats,
+		(n_user_class_stats + 1) * sizeof user_class_stats[0]
+	);
+
+	user_class_stats[n_user_class_stats].UID = UID;
+	user_class_stats[n_user_class_stats].live = 0;
+	user_class_stats[n_user_class_stats].bytes = 0;
+
+	return &user_class_stats[n_user_class_stats++];
+}
+
+void spn_object_stats(SpnObjectStats *stats)
+{
+	SPN_SPIN_LOCK(&object_lock);
+	*stats = object_stats;
+	SPN_SPIN_UNLOCK(&object_lock);
+}
+
+size_t spn_object_class_stats(unsigned long UID, size_t *bytes)
+{
+	ClassStats *cs;
+	size_t live;
+
+	SPN_SPIN_LOCK(&object_lock);
+
+	cs = class_stats(UID, 0);
+	live = cs ? cs->live : 0;
+
+	if (bytes != NULL) {
+		*bytes = cs ? cs->bytes : 0;
+	}
+
+	SPN_SPIN_UNLOCK(&object_lock);
+
+	return live;
+}
+
 void *spn_object_new(const SpnClass *isa)
 {
-	SpnObject *obj = spn_malloc(isa->instsz);
+	SpnObject *obj;
+	ClassStats *cs;
+
+	SPN_SPIN_LOCK(&object_lock);
+
+	obj = object_allocator.alloc(isa->instsz, object_allocator.ctx);
+
+	if (obj == NULL) {
+		unsigned long uln = isa->instsz;
+		spn_die("allocation of object of size %lu failed", uln);
+	}
+
+	cs = class_stats(isa->UID, 1);
+	cs->live++;
+	cs->bytes += isa->instsz;
+	object_stats.live_objects++;
+	object_stats.live_bytes += isa->instsz;
+
+	SPN_SPIN_UNLOCK(&object_lock);
 
 	obj->isa = isa;
 	obj->refcnt = 1;
@@ -85,11 +287,25 @@ void spn_object_release(void *o)
 {
 	SpnObject *obj = o;
 	if (--obj->refcnt == 0) {
-		if (obj->isa->destructor) {
-			obj->isa->destructor(obj);
+		const SpnClass *isa = obj->isa;
+		ClassStats *cs;
+
+		if (isa->destructor) {
+			isa->destructor(obj);
 		}
 
-		free(obj);
+		SPN_SPIN_LOCK(&object_lock);
+
+		cs = class_stats(isa->UID, 0);
+		assert(cs != NULL && cs->live > 0);
+		cs->live--;
+		cs->bytes -= isa->instsz;
+		object_stats.live_objects--;
+		object_stats.live_bytes -= isa->instsz;
+
+		object_allocator.dealloc(obj, isa->instsz, object_allocator.ctx);
+
+		SPN_SPIN_UNLOCK(&object_lock);
 	}
 }
 
@@ -114,6 +330,72 @@ double spn_floatvalue_f(SpnValue *val)
 	return spn_intvalue(val);
 }
 
+#if USE_NAN_BOXING
+
+/* pointers must fit into the 48-bit payload */
+static unsigned long box_pointer(int type, void *p)
+{
+	unsigned long bits = (unsigned long)(p);
+	assert((bits & ~SPN_NB_PAYLOAD_MASK) == 0);
+	return SPN_NB_BOX(type, bits);
+}
+
+SpnValue spn_makebool(int b)
+{
+	SpnValue ret;
+	ret.bits = SPN_NB_BOX(SPN_TYPE_BOOL, b != 0);
+	return ret;
+}
+
+SpnValue spn_makeint(long i)
+{
+	SpnValue ret;
+	ret.bits = SPN_NB_BOX(SPN_TYPE_INT, (unsigned long)(i) & SPN_NB_PAYLOAD_MASK);
+	return ret;
+}
+
+SpnValue spn_makefloat(double f)
+{
+	SpnValue ret;
+
+	/* all NaNs are the same, the other bit patterns encode other types */
+	if (f != f) {
+		ret.bits = SPN_NB_NAN;
+	} else {
+		ret.f = f;
+	}
+
+	return ret;
+}
+
+SpnValue spn_makeweakuserinfo(void *p)
+{
+	SpnValue ret;
+	ret.bits = box_pointer(SPN_TYPE_WEAKUSERINFO, p);
+	return ret;
+}
+
+SpnValue spn_makestrguserinfo(void *o)
+{
+	SpnValue ret;
+	ret.bits = box_pointer(SPN_TYPE_STRGUSERINFO, o);
+	return ret;
+}
+
+SpnValue spn_makeobject(int type, void *o)
+{
+	SpnValue ret;
+	assert(type & SPN_FLAG_OBJECT);
+	ret.bits = box_pointer(type, o);
+	return ret;
+}
+
+const SpnValue spn_nilval   = { SPN_NB_NIL };
+const SpnValue spn_falseval = { SPN_NB_BOX(SPN_TYPE_BOOL, 0) };
+const SpnValue spn_trueval  = { SPN_NB_BOX(SPN_TYPE_BOOL, 1) };
+
+#else /* USE_NAN_BOXING */
+
 SpnValue spn_makebool(int b)
 {
 	SpnValue ret;
@@ -154,10 +436,21 @@ SpnValue spn_makestrguserinfo(void *o)
 	return ret;
 }
 
+SpnValue spn_makeobject(int type, void *o)
+{
+	SpnValue ret;
+	assert(type & SPN_FLAG_OBJECT);
+	ret.type = type;
+	ret.v.o = o;
+	return ret;
+}
+
 const SpnValue spn_nilval   = { SPN_TYPE_NIL,  { 0 } };
 const SpnValue spn_falseval = { SPN_TYPE_BOOL, { 0 } };
 const SpnValue spn_trueval  = { SPN_TYPE_BOOL, { 1 } };
 
+#endif /* USE_NAN_BOXING */
+
 
 void spn_value_retain(const SpnValue *val)
 {
@@ -299,20 +592,233 @@ int spn_values_comparable(const SpnValue *lhs, const SpnValue *rhs)
 	return 0;
 }
 
-/* The hash function is the SMDB hash */
+/* Hashing
+ * -------
+ * All hash values depend on a random seed, so that hash collisions can't
+ * be predicted, and hash maps can't be flooded with colliding keys by
+ * whoever supplies the keys. Strings cache their hash values and hash maps
+ * may be shared between virtual machines, so there's one seed per process,
+ * not one per virtual machine. It is generated by the first call to the
+ * hash function (unless it has been set using spn_hash_set_seed() before).
+ * Once the seed has been used, it can't be changed any more, since that
+ * would invalidate every hash value computed so far.
+ */
+enum {
+	SEED_UNSET, /* not yet set nor used                 */
+	SEED_SET,   /* set by spn_hash_set_seed(), not used */
+	SEED_USED   /* read by spn_hash_seed(), now fixed   */
+};
+
+static unsigned long hash_seed = 0;
+static int hash_seed_state = SEED_UNSET;
+static SpnSpinLock hash_seed_lock;
+
+/* Gathers some entropy from the time and from (possibly randomized)
+ * stack and heap addresses. This is not cryptographic randomness, but
+ * without knowing the seed, colliding keys are hard to come by.
+ */
+static void init_hash_seed(void)
+{
+	void *heap = malloc(1);
+	unsigned long seed = (unsigned long)(time(NULL));
+
+	seed = seed * 31 + (unsigned long)(clock());
+	seed = seed * 31 + (unsigned long)(&seed);
+	seed = seed * 31 + (unsigned long)(heap);
+	seed = seed * 31 + (unsigned long)(&init_hash_seed);
+
+	free(heap);
+
+	hash_seed = seed;
+}
+
+int spn_hash_set_seed(unsigned long seed)
+{
+	int ok;
+
+	SPN_SPIN_LOCK(&hash_seed_lock);
+
+	ok = hash_seed_state != SEED_USED;
+	if (ok) {
+		hash_seed = seed;
+		hash_seed_state = SEED_SET;
+	}
+
+	SPN_SPIN_UNLOCK(&hash_seed_lock);
+
+	return ok ? 0 : -1;
+}
+
+unsigned long spn_hash_seed(void)
+{
+	/* fast path: the seed is published before the state is */
+	if (SPN_ATOMIC_LOAD(&hash_seed_state) == SEED_USED) {
+		return hash_seed;
+	}
+
+	SPN_SPIN_LOCK(&hash_seed_lock);
+
+	if (hash_seed_state == SEED_UNSET) {
+		init_hash_seed();
+	}
+
+	SPN_ATOMIC_STORE(&hash_seed_state, SEED_USED);
+	SPN_SPIN_UNLOCK(&hash_seed_lock);
+
+	return hash_seed;
+}
+
+#if ULONG_MAX > 0xffffffffu
+
+/* 64-bit: a variant of wyhash. It processes 16 bytes at a time, and
+ * combines words by multiplying them into a 128-bit product, then
+ * folding the upper half onto the lower one.
+ */
+#define HASH_P0 0xa0761d6478bd642ful
+#define HASH_P1 0xe7037ed1a0b428dbul
+#define HASH_P2 0x8ebc6af09c88c6e3ul
+
+#if defined(__GNUC__) && defined(__SIZEOF_INT128__)
+
+__extension__ typedef unsigned __int128 hash_u128;
+
+static unsigned long hash_mix(unsigned long a, unsigned long b)
+{
+	hash_u128 r = (hash_u128)(a) * b;
+	return (unsigned long)(r) ^ (unsigned long)(r >> 64);
+}
+
+#else /* __GNUC__ && __SIZEOF_INT128__ */
+
+static unsigned long hash_mix(unsigned long a, unsigned long b)
+{
+	unsigned long a0 = a & 0xffffffffu, a1 = a >> 32;
+	unsigned long b0 = b & 0xffffffffu, b1 = b >> 32;
+
+	unsigned long p00 = a0 * b0, p01 = a0 * b1;
+	unsigned long p10 = a1 * b0, p11 = a1 * b1;
+
+	unsigned long mid = (p00 >> 32) + (p01 & 0xffffffffu) + (p10 & 0xffffffffu);
+	unsigned long lo = (p00 & 0xffffffffu) | (mid << 32);
+	unsigned long hi = p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+
+	return lo ^ hi;
+}
+
+#endif /* __GNUC__ && __SIZEOF_INT128__ */
+
+static unsigned long read_word(const unsigned char *p)
+{
+	unsigned long w;
+	memcpy(&w, p, sizeof w);
+	return w;
+}
+
+static unsigned long read_half(const unsigned char *p)
+{
+	return (unsigned long)(p[0])
+	     | (unsigned long)(p[1]) << 8
+	     | (unsigned long)(p[2]) << 16
+	     | (unsigned long)(p[3]) << 24;
+}
+
+unsigned long spn_hash_bytes(const void *data, size_t n)
+{
+	const unsigned char *p = data;
+	unsigned long seed = spn_hash_seed() ^ HASH_P0;
+	unsigned long a, b;
+
+	if (n <= 16) {
+		if (n >= 4) {
+			/* two overlapping reads on both ends cover 4...16 bytes */
+			size_t off = (n >> 3) << 2;
+			a = read_half(p) << 32 | read_half(p + off);
+			b = read_half(p + n - 4) << 32 | read_half(p + n - 4 - off);
+		} else if (n > 0) {
+			a = (unsigned long)(p[0]) << 16 | (unsigned long)(p[n >> 1]) << 8 | p[n - 1];
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		size_t i = n;
+
+		while (i > 16) {
+			seed = hash_mix(read_word(p) ^ HASH_P1, read_word(p + 8) ^ seed);
+			p += 16;
+			i -= 16;
+		}
+
+		/* the last 16 bytes, possibly overlapping with the previous ones */
+		a = read_word(p + i - 16);
+		b = read_word(p + i - 8);
+	}
+
+	return hash_mix(HASH_P1 ^ n, hash_mix(a ^ HASH_P1, b ^ seed) ^ HASH_P2);
+}
+
+/* integers are mixed so that all of their bits affect all bits of the hash */
+static unsigned long hash_int(long i)
+{
+	return hash_mix((unsigned long)(i) ^ spn_hash_seed() ^ HASH_P0, HASH_P1);
+}
+
+#else /* ULONG_MAX > 0xffffffffu */
+
+/* 32-bit: MurmurHash3 (x86, 32-bit variant), 4 bytes at a time */
+static unsigned long rotl32(unsigned long x, int r)
+{
+	return (x << r | x >> (32 - r)) & 0xffffffffu;
+}
+
+static unsigned long fmix32(unsigned long h)
+{
+	h ^= h >> 16;
+	h = (h * 0x85ebca6bu) & 0xffffffffu;
+	h ^= h >> 13;
+	h = (h * 0xc2b2ae35u) & 0xffffffffu;
+	h ^= h >> 16;
+	return h;
+}
+
 unsigned long spn_hash_bytes(const void *data, size_t n)
 {
-	unsigned long hash = 0;
 	const unsigned char *p = data;
+	unsigned long h = spn_hash_seed() & 0xffffffffu;
+	unsigned long k;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		k = (unsigned long)(p[i])
+		  | (unsigned long)(p[i + 1]) << 8
+		  | (unsigned long)(p[i + 2]) << 16
+		  | (unsigned long)(p[i + 3]) << 24;
 
-	while (n--) {
-		hash *= 65599;
-		hash += *p++;
+		k = rotl32((k * 0xcc9e2d51u) & 0xffffffffu, 15);
+		h ^= (k * 0x1b873593u) & 0xffffffffu;
+		h = (rotl32(h, 13) * 5 + 0xe6546b64u) & 0xffffffffu;
 	}
 
-	return hash;
+	k = 0;
+
+	switch (n & 3) {
+	case 3: k ^= (unsigned long)(p[i + 2]) << 16; /* fallthru */
+	case 2: k ^= (unsigned long)(p[i + 1]) << 8;  /* fallthru */
+	case 1: k ^= p[i];
+		k = rotl32((k * 0xcc9e2d51u) & 0xffffffffu, 15);
+		h ^= (k * 0x1b873593u) & 0xffffffffu;
+	}
+
+	return fmix32(h ^ (unsigned long)(n));
+}
+
+static unsigned long hash_int(long i)
+{
+	return fmix32(((unsigned long)(i) ^ spn_hash_seed()) & 0xffffffffu);
 }
 
+#endif /* ULONG_MAX > 0xffffffffu */
+
 unsigned long spn_hash_value(const SpnValue *key)
 {
 	switch (valtype(key)) {
@@ -324,14 +830,13 @@ unsigned long spn_hash_value(const SpnValue *key)
 			long i = f; /* truncate */
 
 			if (f == i) {
-				return i; /* it's really an integer */
+				return hash_int(i); /* it's really an integer */
 			} else {
 				return spn_hash_bytes(&f, sizeof f);
 			}
 		}
 
-		/* the hash value of an integer is itself */
-		return intvalue(key);
+		return hash_int(intvalue(key));
 	}
 	case SPN_TTAG_STRING:
 	case SPN_TTAG_ARRAY:
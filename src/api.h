@@ -114,6 +114,50 @@ SPN_API void spn_object_retain(void *o);
  */
 SPN_API void spn_object_release(void *o);
 
+/* Object allocation.
+ * By default, instances are allocated from slabs: objects of the same
+ * (rounded up) size are carved out of larger blocks of memory, and they
+ * are put on a free list upon deallocation, so that they can be reused
+ * quickly. This saves a lot of calls to malloc() and free() for small,
+ * short-lived objects, like strings resulting from concatenation. Slab
+ * memory is never returned to the operating system.
+ *
+ * A custom allocator can be installed using spn_object_set_allocator().
+ * 'alloc' must return memory suitably aligned for any object, or NULL on
+ * failure. 'dealloc' receives the same size that was passed to 'alloc'
+ * when the object was created. The allocator can only be changed while
+ * there are no live objects (e. g. before creating the first context or
+ * after freeing the last one); otherwise it is left alone, and nonzero
+ * is returned. Passing NULL restores the default slab allocator.
+ *
+ * The allocator and the statistics are shared by all contexts. They are
+ * protected by a lock, and the allocator functions are only called with
+ * the lock held, so they needn't be thread-safe themselves; but they must
+ * not create or free Sparkling objects.
+ */
+typedef struct SpnAllocator {
+	void *(*alloc)(size_t size, void *ctx);
+	void (*dealloc)(void *ptr, size_t size, void *ctx);
+	void *ctx;
+} SpnAllocator;
+
+SPN_API int spn_object_set_allocator(const SpnAllocator *allocator);
+
+/* statistics about all objects and the default allocator */
+typedef struct SpnObjectStats {
+	size_t live_objects; /* number of objects currently alive           */
+	size_t live_bytes;   /* sum of their instance sizes                 */
+	size_t slab_bytes;   /* memory allocated for slabs                  */
+	size_t slab_used;    /* part of slab_bytes occupied by live objects */
+} SpnObjectStats;
+
+SPN_API void spn_object_stats(SpnObjectStats *stats);
+
+/* returns the number of live instances of the class with the given UID,
+ * and, if 'bytes' is not NULL, sets '*bytes' to their total size.
+ */
+SPN_API size_t spn_object_class_stats(unsigned long UID, size_t *bytes);
+
 
 /*
  * Value API
@@ -164,10 +208,74 @@ enum {
 	SPN_TYPE_STRGUSERINFO       = SPN_TTAG_USERINFO | SPN_FLAG_OBJECT
 };
 
-/* type checking */
-#define spn_isobject(val)   ((((val)->type) & SPN_FLAG_OBJECT) != 0)
 #define spn_typetag(t)      ((t) & SPN_MASK_TTAG)
 #define spn_typeflag(t)     ((t) & SPN_MASK_FLAG)
+
+#if USE_NAN_BOXING
+
+/* NaN-boxed representation (only available on platforms with a 64-bit
+ * 'unsigned long', and with at most 48 significant bits in pointers).
+ * If enabled, every user of this header must be compiled with the same
+ * value of USE_NAN_BOXING as the Sparkling engine itself.
+ *
+ * A value is 8 bytes. Floating-point numbers are stored natively; NaNs are
+ * canonicalized by spn_makefloat(), so the remaining NaN bit patterns with
+ * the upper 16 bits 0xfff1...0xffff are free to encode all the other types.
+ * These upper 16 bits are the tag: 0xfff0 | typetag for object types,
+ * and 0xfff8 | typetag for non-object types. The lower 48 bits are the
+ * payload: a pointer, a Boolean (0 or 1) or a signed 48-bit integer.
+ *
+ * Integers are thus limited to 48 bits: spn_makeint() silently truncates
+ * its argument (two's complement wraparound, just like with any other
+ * fixed-width integer arithmetic).
+ */
+#if (ULONG_MAX >> 31 >> 31) != 3
+#error "NaN-boxing requires a 64-bit 'unsigned long'"
+#endif
+
+typedef union SpnValue {
+	unsigned long bits; /* tag and payload    */
+	double        f;    /* float value        */
+} SpnValue;
+
+#define SPN_NB_PAYLOAD_MASK 0xffffffffffffUL
+#define SPN_NB_TAG(val)     ((unsigned)((val)->bits >> 48))
+#define SPN_NB_TAGOF(type)  (0xfff0u | ((type) & SPN_FLAG_OBJECT ? 0 : 8) | spn_typetag(type))
+#define SPN_NB_BOX(type, p) ((unsigned long)SPN_NB_TAGOF(type) << 48 | (p))
+#define SPN_NB_NIL          SPN_NB_BOX(SPN_TYPE_NIL, 0)
+#define SPN_NB_NAN          0x7ff8000000000000UL
+
+/* type checking */
+#define spn_isobject(val)   ((SPN_NB_TAG(val) - 0xfff3u) < 5u)
+#define spn_valtype(val)    (SPN_NB_TAG(val) > 0xfff0u ? (int)(SPN_NB_TAG(val) & 7) : SPN_TTAG_NUMBER)
+#define spn_valflag(val)    (SPN_NB_TAG(val) > 0xfff0u ? (SPN_NB_TAG(val) & 8 ? 0 : SPN_FLAG_OBJECT) : SPN_FLAG_FLOAT)
+
+#define spn_isnil(val)          ((val)->bits == SPN_NB_NIL)
+#define spn_isbool(val)         (SPN_NB_TAG(val) == SPN_NB_TAGOF(SPN_TYPE_BOOL))
+#define spn_isnumber(val)       (spn_isfloat(val) || spn_isint(val))
+#define spn_isstring(val)       (SPN_NB_TAG(val) == SPN_NB_TAGOF(SPN_TYPE_STRING))
+#define spn_isarray(val)        (SPN_NB_TAG(val) == SPN_NB_TAGOF(SPN_TYPE_ARRAY))
+#define spn_ishashmap(val)      (SPN_NB_TAG(val) == SPN_NB_TAGOF(SPN_TYPE_HASHMAP))
+#define spn_isfunc(val)         (SPN_NB_TAG(val) == SPN_NB_TAGOF(SPN_TYPE_FUNC))
+#define spn_isuserinfo(val)     ((SPN_NB_TAG(val) & 0xfff7u) == 0xfff7u)
+
+#define spn_notnil(val)         ((val)->bits != SPN_NB_NIL)
+#define spn_isint(val)          (SPN_NB_TAG(val) == SPN_NB_TAGOF(SPN_TYPE_INT))
+#define spn_isfloat(val)        (SPN_NB_TAG(val) <= 0xfff0u)
+#define spn_isweakuserinfo(val) (SPN_NB_TAG(val) == SPN_NB_TAGOF(SPN_TYPE_WEAKUSERINFO))
+#define spn_isstrguserinfo(val) (SPN_NB_TAG(val) == SPN_NB_TAGOF(SPN_TYPE_STRGUSERINFO))
+
+/* getting the payload. These do *not* check the type either. */
+#define spn_boolvalue(val)  ((int)((val)->bits & 1))
+#define spn_intvalue(val)   ((long)((val)->bits << 16) >> 16)
+#define spn_floatvalue(val) ((val)->f)
+#define spn_ptrvalue(val)   ((void *)((val)->bits & SPN_NB_PAYLOAD_MASK))
+#define spn_objvalue(val)   ((void *)((val)->bits & SPN_NB_PAYLOAD_MASK))
+
+#else /* USE_NAN_BOXING */
+
+/* type checking */
+#define spn_isobject(val)   ((((val)->type) & SPN_FLAG_OBJECT) != 0)
 #define spn_valtype(val)    (spn_typetag((val)->type))
 #define spn_valflag(val)    (spn_typeflag((val)->type))
 
@@ -207,6 +315,8 @@ typedef struct SpnValue {
 	} v;
 } SpnValue;
 
+#endif /* USE_NAN_BOXING */
+
 /* force integer or floating-point number out of an SpnValue.
  * These can potentially be unsafe: a double may not be
  * able to exactly represent all longs, and converting
@@ -226,6 +336,11 @@ SPN_API SpnValue spn_makefloat(double f);
 SPN_API SpnValue spn_makeweakuserinfo(void *p);
 SPN_API SpnValue spn_makestrguserinfo(void *o);
 
+/* wraps an existing object of type 'type' (one of the SPN_TYPE_* object
+ * types, e. g. SPN_TYPE_ARRAY) into a value. Does not retain the object.
+ */
+SPN_API SpnValue spn_makeobject(int type, void *o);
+
 /* 'nil' and Boolean constants */
 SPN_API const SpnValue spn_nilval;
 SPN_API const SpnValue spn_falseval;
@@ -252,6 +367,17 @@ SPN_API int spn_values_comparable(const SpnValue *lhs, const SpnValue *rhs);
 SPN_API unsigned long spn_hash_bytes(const void *data, size_t n);
 SPN_API unsigned long spn_hash_value(const SpnValue *obj);
 
+/* Hash values are randomized using a per-process seed, which is generated
+ * when something is hashed for the first time. spn_hash_set_seed() can be
+ * used to make hash values (and thus the iteration order of hashmaps)
+ * reproducible, but only before anything is hashed, i. e. before any
+ * context is created. Once the seed has been used, it is fixed: setting
+ * it is then refused, and spn_hash_set_seed() returns nonzero. Both
+ * functions are thread-safe.
+ */
+SPN_API int spn_hash_set_seed(unsigned long seed);
+SPN_API unsigned long spn_hash_seed(void);
+
 /* prints the user-readable representation of a value to stdout */
 SPN_API void spn_value_print(const SpnValue *val);
 SPN_API void spn_debug_print(const SpnValue *val);
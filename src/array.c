@@ -19,12 +19,17 @@
 #include "str.h"
 
 
-struct SpnArray {
-	SpnObject base;        /* for being a valid object          */
-	SpnValue *vector;      /* the actual raw array of values    */
-	size_t    count;       /* logical size                      */
-	size_t    allocsize;   /* allocation (actual) size          */
-};
+/* Slices share the elements of the array they are taken from, instead of
+ * copying them. Since both arrays may be modified later, the elements are
+ * moved into a hidden array first (the owner), which is never modified,
+ * and both the original array and the slice become views into it: they
+ * retain the owner, and point into its storage. A view gets its own copy of
+ * its elements (or takes over those of the owner, if it's the only view
+ * left) the first time it's modified, which is the only time the elements
+ * are retained one by one. Short slices are copied right away, since that's
+ * cheap, and they shouldn't keep a big owner alive.
+ */
+#define SLICE_VIEW_MIN 16
 
 static void free_array(void *obj);
 
@@ -39,11 +44,18 @@ static const SpnClass spn_class_array = {
 };
 
 SpnArray *spn_array_new(void)
+{
+	return spn_array_new_packed(SPN_ARRAY_VALUES);
+}
+
+SpnArray *spn_array_new_packed(enum spn_array_kind kind)
 {
 	SpnArray *array = spn_object_new(&spn_class_array);
-	array->vector = NULL;
+	array->vector.raw = NULL;
 	array->count = 0;
 	array->allocsize = 0;
+	array->kind = kind;
+	array->owner = NULL;
 	return array;
 }
 
@@ -52,11 +64,166 @@ static void free_array(void *obj)
 	SpnArray *arr = obj;
 	size_t i;
 
-	for (i = 0; i < arr->count; i++) {
-		spn_value_release(&arr->vector[i]);
+	if (arr->owner != NULL) {
+		spn_object_release(arr->owner);
+		return;
+	}
+
+	if (arr->kind == SPN_ARRAY_VALUES) {
+		for (i = 0; i < arr->count; i++) {
+			spn_value_release(&arr->vector.values[i]);
+		}
+	}
+
+	free(arr->vector.raw);
+}
+
+/* size of one element in the storage of 'arr' */
+static size_t elem_size(SpnArray *arr)
+{
+	switch (arr->kind) {
+	case SPN_ARRAY_VALUES:  { return sizeof arr->vector.values[0]; }
+	case SPN_ARRAY_INTS:    { return sizeof arr->vector.ints[0]; }
+	case SPN_ARRAY_FLOATS:  { return sizeof arr->vector.floats[0]; }
+	case SPN_ARRAY_BYTES:   { return sizeof arr->vector.bytes[0]; }
+	default:                { SHANT_BE_REACHED(); }
+	}
+
+	return 0;
+}
+
+/* boxes the element at 'index'. Doesn't retain it. */
+static SpnValue load(SpnArray *arr, size_t index)
+{
+	switch (arr->kind) {
+	case SPN_ARRAY_VALUES:  { return arr->vector.values[index]; }
+	case SPN_ARRAY_INTS:    { return makeint(arr->vector.ints[index]); }
+	case SPN_ARRAY_FLOATS:  { return makefloat(arr->vector.floats[index]); }
+	case SPN_ARRAY_BYTES:   { return makeint(arr->vector.bytes[index]); }
+	default:                { SHANT_BE_REACHED(); }
+	}
+
+	return spn_nilval;
+}
+
+/* unboxes and stores 'val' at 'index', which is assumed to be acceptable.
+ * Doesn't retain it, nor does it release the previous element.
+ */
+static void store(SpnArray *arr, size_t index, const SpnValue *val)
+{
+	switch (arr->kind) {
+	case SPN_ARRAY_VALUES:
+		arr->vector.values[index] = *val;
+		break;
+	case SPN_ARRAY_INTS:
+		arr->vector.ints[index] = intvalue(val);
+		break;
+	case SPN_ARRAY_FLOATS:
+		arr->vector.floats[index] = isfloat(val) ? floatvalue(val) : intvalue(val);
+		break;
+	case SPN_ARRAY_BYTES:
+		arr->vector.bytes[index] = intvalue(val);
+		break;
+	default:
+		SHANT_BE_REACHED();
+	}
+}
+
+static void check_accepts(SpnArray *arr, const SpnValue *val)
+{
+	if (!spn_array_accepts(arr, val)) {
+		spn_die("value of type %s cannot be stored in a packed array\n", spn_type_name(valtype(val)));
+	}
+}
+
+/* makes a view the sole owner of its elements, before it's modified */
+static void unshare(SpnArray *arr)
+{
+	SpnArray *owner = arr->owner;
+	size_t i, size = elem_size(arr);
+
+	if (owner == NULL) {
+		return;
+	}
+
+	if (owner->base.refcnt == 1) {
+		/* this is the last view, so it can take over the storage
+		 * of the owner, after dropping the elements outside of it
+		 */
+		char *base = owner->vector.raw;
+		size_t offset = ((char *)(arr->vector.raw) - base) / size;
+
+		if (arr->kind == SPN_ARRAY_VALUES) {
+			for (i = 0; i < owner->count; i++) {
+				if (i < offset || i >= offset + arr->count) {
+					spn_value_release(&owner->vector.values[i]);
+				}
+			}
+		}
+
+		memmove(base, arr->vector.raw, arr->count * size);
+		arr->vector.raw = base;
+		arr->allocsize = owner->allocsize;
+
+		owner->vector.raw = NULL;
+		owner->count = 0;
+	} else {
+		void *vector = spn_malloc(arr->count * size);
+		memcpy(vector, arr->vector.raw, arr->count * size);
+		arr->vector.raw = vector;
+		arr->allocsize = arr->count;
+
+		if (arr->kind == SPN_ARRAY_VALUES) {
+			for (i = 0; i < arr->count; i++) {
+				spn_value_retain(&arr->vector.values[i]);
+			}
+		}
+	}
+
+	arr->owner = NULL;
+	spn_object_release(owner);
+}
+
+SpnArray *spn_array_slice(SpnArray *arr, size_t start, size_t length)
+{
+	SpnArray *slice;
+	size_t i, size = elem_size(arr);
+
+	if (start > arr->count || length > arr->count - start) {
+		unsigned long ulstart = start, ullength = length, ulcount = arr->count;
+		spn_die("slice [%lu, %lu + %lu) is out of bounds (size = %lu)\n", ulstart, ulstart, ullength, ulcount);
+	}
+
+	slice = spn_array_new_packed(arr->kind);
+
+	if (length < SLICE_VIEW_MIN) {
+		spn_array_reserve(slice, length);
+
+		for (i = 0; i < length; i++) {
+			SpnValue val = load(arr, start + i);
+			spn_array_push(slice, &val);
+		}
+
+		return slice;
+	}
+
+	/* move the elements into an owner, if they aren't in one already */
+	if (arr->owner == NULL) {
+		SpnArray *owner = spn_array_new_packed(arr->kind);
+		owner->vector = arr->vector;
+		owner->count = arr->count;
+		owner->allocsize = arr->allocsize;
+
+		arr->owner = owner;
+		arr->allocsize = 0;
 	}
 
-	free(arr->vector);
+	spn_object_retain(arr->owner);
+	slice->owner = arr->owner;
+	slice->vector.raw = (char *)(arr->vector.raw) + start * size;
+	slice->count = length;
+
+	return slice;
 }
 
 size_t spn_array_count(SpnArray *arr)
@@ -64,6 +231,30 @@ size_t spn_array_count(SpnArray *arr)
 	return arr->count;
 }
 
+enum spn_array_kind spn_array_kind(SpnArray *arr)
+{
+	return arr->kind;
+}
+
+void *spn_array_data(SpnArray *arr)
+{
+	unshare(arr);
+	return arr->vector.raw;
+}
+
+int spn_array_accepts(SpnArray *arr, const SpnValue *val)
+{
+	switch (arr->kind) {
+	case SPN_ARRAY_VALUES:  { return 1; }
+	case SPN_ARRAY_INTS:    { return isint(val); }
+	case SPN_ARRAY_FLOATS:  { return isnum(val); }
+	case SPN_ARRAY_BYTES:   { return isint(val) && intvalue(val) >= 0 && intvalue(val) <= UCHAR_MAX; }
+	default:                { SHANT_BE_REACHED(); }
+	}
+
+	return 0;
+}
+
 SpnValue spn_array_get(SpnArray *arr, size_t index)
 {
 	if (index >= arr->count) {
@@ -71,7 +262,7 @@ SpnValue spn_array_get(SpnArray *arr, size_t index)
 		spn_die("array index %lu is too high (size = %lu)\n", ulindex, ulcount);
 	}
 
-	return arr->vector[index];
+	return load(arr, index);
 }
 
 void spn_array_set(SpnArray *arr, size_t index, const SpnValue *val)
@@ -81,14 +272,21 @@ void spn_array_set(SpnArray *arr, size_t index, const SpnValue *val)
 		spn_die("array index %lu is too high (size = %lu)\n", ulindex, ulcount);
 	}
 
-	spn_value_retain(val);
-	spn_value_release(&arr->vector[index]);
-	arr->vector[index] = *val;
+	check_accepts(arr, val);
+	unshare(arr);
+
+	if (arr->kind == SPN_ARRAY_VALUES) {
+		spn_value_retain(val);
+		spn_value_release(&arr->vector.values[index]);
+	}
+
+	store(arr, index, val);
 }
 
 void spn_array_insert(SpnArray *arr, size_t index, const SpnValue *val)
 {
-	size_t i, maxindex;
+	size_t size = elem_size(arr);
+	char *base;
 
 	/* index == arr->count is allowed (insertion at end) */
 	if (index > arr->count) {
@@ -96,65 +294,85 @@ void spn_array_insert(SpnArray *arr, size_t index, const SpnValue *val)
 		spn_die("array index %lu is too high (size = %lu)\n", ulindex, ulcount);
 	}
 
-	maxindex = arr->count++;
+	check_accepts(arr, val);
+	unshare(arr);
+
+	arr->count++;
 
 	if (arr->allocsize == 0) {
 		arr->allocsize = 8;
-		arr->vector = spn_malloc(arr->allocsize * sizeof arr->vector[0]);
+		arr->vector.raw = spn_malloc(arr->allocsize * size);
 	}
 
 	if (arr->count > arr->allocsize) {
 		arr->allocsize *= 2;
-		arr->vector = spn_realloc(arr->vector, arr->allocsize * sizeof arr->vector[0]);
+		arr->vector.raw = spn_realloc(arr->vector.raw, arr->allocsize * size);
 	}
 
-	for (i = maxindex; i > index; i--) {
-		arr->vector[i] = arr->vector[i - 1];
-	}
+	/* shift elements at positions >= index towards end of array */
+	base = arr->vector.raw;
+	memmove(base + (index + 1) * size, base + index * size, (arr->count - 1 - index) * size);
 
 	spn_value_retain(val);
-	arr->vector[index] = *val;
+	store(arr, index, val);
 }
 
 void spn_array_remove(SpnArray *arr, size_t index)
 {
-	size_t i;
+	size_t size = elem_size(arr);
+	char *base;
 
 	if (index >= arr->count) {
 		unsigned long ulindex = index, ulcount = arr->count;
 		spn_die("array index %lu is too high (size = %lu)\n", ulindex, ulcount);
 	}
 
-	spn_value_release(&arr->vector[index]);
-	arr->count--;
+	unshare(arr);
+	base = arr->vector.raw;
 
-	for (i = index; i < arr->count; i++) {
-		arr->vector[i] = arr->vector[i + 1];
+	if (arr->kind == SPN_ARRAY_VALUES) {
+		spn_value_release(&arr->vector.values[index]);
 	}
+
+	arr->count--;
+
+	memmove(base + index * size, base + (index + 1) * size, (arr->count - index) * size);
 }
 
 void spn_array_inject(SpnArray *arr, size_t index, SpnArray *other)
 {
-	size_t i, j;
+	size_t i, j, size = elem_size(arr);
 	size_t n_arr = arr->count, n_other = other->count;
+	char *base;
 
 	if (index > n_arr) {
 		unsigned long ulindex = index, ulcount = n_arr;
 		spn_die("array index %lu is too high (size = %lu)\n", ulindex, ulcount);
 	}
 
+	if (n_other == 0) {
+		return;
+	}
+
+	if (arr->kind != SPN_ARRAY_VALUES) {
+		for (j = 0; j < n_other; j++) {
+			SpnValue val = load(other, j);
+			check_accepts(arr, &val);
+		}
+	}
+
 	/* expand array */
 	spn_array_setsize(arr, n_arr + n_other);
 
 	/* shift elements at positions >= index towards end of array */
-	for (i = n_arr; i > index; i--) {
-		arr->vector[i - 1 + n_other] = arr->vector[i - 1];
-	}
+	base = arr->vector.raw;
+	memmove(base + (index + n_other) * size, base + index * size, (n_arr - index) * size);
 
 	/* take ownership of new elements, insert them at 'index' */
 	for (i = index, j = 0; j < n_other; i++, j++) {
-		spn_value_retain(&other->vector[j]);
-		arr->vector[i] = other->vector[j];
+		SpnValue val = load(other, j);
+		spn_value_retain(&val);
+		store(arr, i, &val);
 	}
 }
 
@@ -173,16 +391,37 @@ void spn_array_pop(SpnArray *arr)
 	spn_array_remove(arr, arr->count - 1);
 }
 
+void spn_array_reserve(SpnArray *arr, size_t n)
+{
+	unshare(arr);
+
+	if (n > arr->allocsize) {
+		arr->allocsize = n;
+		arr->vector.raw = spn_realloc(arr->vector.raw, arr->allocsize * elem_size(arr));
+	}
+}
+
 void spn_array_setsize(SpnArray *arr, size_t newsize)
 {
 	size_t oldsize = arr->count, i;
 
+	spn_array_reserve(arr, newsize);
+
 	/* if newsize != oldsize, then exactly one
 	 * of the loops below will be executed.
 	 */
 
-	/* if the new size is greater than the old one, then append nils */
-	for (i = oldsize; i < newsize; i++) {
+	/* if the new size is greater than the old one, then append nils,
+	 * or zeroes in the case of packed arrays (all bits zero is 0.0 too)
+	 */
+	if (arr->kind != SPN_ARRAY_VALUES && newsize > oldsize) {
+		char *base = arr->vector.raw;
+		size_t size = elem_size(arr);
+		memset(base + oldsize * size, 0, (newsize - oldsize) * size);
+		arr->count = newsize;
+	}
+
+	for (i = arr->count; i < newsize; i++) {
 		spn_array_push(arr, &spn_nilval);
 	}
 
@@ -195,8 +434,5 @@ void spn_array_setsize(SpnArray *arr, size_t newsize)
 /* convenience value constructor */
 SpnValue spn_makearray(void)
 {
-	SpnValue ret;
-	ret.type = SPN_TYPE_ARRAY;
-	ret.v.o = spn_array_new();
-	return ret;
+	return spn_makeobject(SPN_TYPE_ARRAY, spn_array_new());
 }
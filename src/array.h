@@ -18,9 +18,35 @@
 
 typedef struct SpnArray SpnArray;
 
+/* Packed arrays store their elements unboxed, in a plain C array of the
+ * given type, instead of as an array of SpnValues. They accept numbers only,
+ * and they can be indexed and modified in the same way as ordinary arrays
+ * (the getter boxes the element, the setter unboxes the value). Storing a
+ * value that is not accepted (see spn_array_accepts()) is a fatal error.
+ */
+enum spn_array_kind {
+	SPN_ARRAY_VALUES, /* an ordinary array of any values        */
+	SPN_ARRAY_INTS,   /* integers, stored as long               */
+	SPN_ARRAY_FLOATS, /* numbers, converted to double           */
+	SPN_ARRAY_BYTES   /* integers in [0, 255], as unsigned char */
+};
 
 SPN_API SpnArray *spn_array_new(void);
+SPN_API SpnArray *spn_array_new_packed(enum spn_array_kind kind);
 SPN_API size_t    spn_array_count(SpnArray *arr);
+SPN_API enum spn_array_kind spn_array_kind(SpnArray *arr);
+
+/* returns nonzero if 'val' can be stored in 'arr', 0 otherwise */
+SPN_API int spn_array_accepts(SpnArray *arr, const SpnValue *val);
+
+/* Returns the storage of the array, which is a pointer to its first
+ * element: an SpnValue *, long *, double * or unsigned char *, depending
+ * on its kind. Elements can be read and written through this pointer
+ * directly, but it is invalidated by any operation that changes the size
+ * of the array. (It may be NULL if the array is empty.) If the array
+ * shares its elements with a slice, they are copied first.
+ */
+SPN_API void *spn_array_data(SpnArray *arr);
 
 /* getter and setter.
  * the getter doesn't alter the ownership of the value, whereas the
@@ -43,14 +69,26 @@ SPN_API void spn_array_push(SpnArray *arr, const SpnValue *val);
 /* removes an element from the end */
 SPN_API void spn_array_pop(SpnArray *arr);
 
+/* Returns a new array of the same kind, containing 'length' elements of
+ * 'arr' starting at index 'start'. Unless the slice is very short, the
+ * elements are not copied: the two arrays share them until either of them
+ * is modified (copy-on-write), so this takes constant time.
+ */
+SPN_API SpnArray *spn_array_slice(SpnArray *arr, size_t start, size_t length);
+
+/* makes room for at least 'n' elements in total, so that the array can
+ * grow up to that size without reallocation. Doesn't change its size.
+ */
+SPN_API void spn_array_reserve(SpnArray *arr, size_t n);
+
 /* expand or shrink the array
- * inserts nils to/removes elements from the end
+ * inserts nils (zeroes, if the array is packed) to/removes elements from the end
  */
 SPN_API void spn_array_setsize(SpnArray *arr, size_t newsize);
 
 /* convenience value constructor and accessor */
 SPN_API SpnValue spn_makearray(void);
 
-#define spn_arrayvalue(val) ((SpnArray *)((val)->v.o))
+#define spn_arrayvalue(val) ((SpnArray *)spn_objvalue(val))
 
 #endif /* SPN_ARRAY_H */
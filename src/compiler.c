@@ -298,6 +298,18 @@ static void compile_string_literal(SpnCompiler *cmp, SpnValue str, int *dst);
  */
 static int compile_expr_toplevel(SpnCompiler *cmp, SpnHashMap *ast, int *dst);
 
+/* compiles a function call using 'opcode', which is either SPN_INS_CALL
+ * or SPN_INS_TAILCALL (the latter for calls in tail position).
+ */
+static int compile_call_ex(SpnCompiler *cmp, SpnHashMap *ast, int *dst, enum spn_vm_ins opcode);
+
+/* compiles the condition of an 'if', 'while', 'do' or 'for' statement,
+ * followed by a conditional jump which is taken if the condition evaluates
+ * to 'jmp_if' (0 or 1). The offset of the jump instruction is returned in
+ * '*off_jmp', and the jump offset itself is to be filled in by the caller.
+ */
+static int compile_cond_jump(SpnCompiler *cmp, SpnHashMap *cond, int jmp_if, spn_sword *off_jmp);
+
 /* dst is the preferred destination register index. Pass a pointer to
  * a non-negative 'int' to force the function to emit an instruction
  * of which the destination register is '*dst'. If the integer pointed
@@ -1202,7 +1214,6 @@ static void fix_and_free_jump_list(SpnCompiler *cmp, spn_sword off_end, spn_swor
 
 static int compile_while(SpnCompiler *cmp, SpnHashMap *ast)
 {
-	int cndidx = -1;
 	spn_uword ins[2] = { 0 }; /* stub */
 	spn_sword off_cond, off_cndjmp, off_body, off_jmpback, off_end;
 
@@ -1220,21 +1231,16 @@ static int compile_while(SpnCompiler *cmp, SpnHashMap *ast)
 	/* save offset of condition */
 	off_cond = cmp->bc.len;
 
-	/* compile condition
+	/* compile condition and jump over the loop body if it's false
 	 * on error, clean up, restore jumplist
 	 * no need to free it -- it's empty so far
 	 */
-	if (compile_expr_toplevel(cmp, condition, &cndidx) == 0) {
+	if (compile_cond_jump(cmp, condition, 0, &off_cndjmp) == 0) {
 		cmp->jumplist = orig_jumplist;
 		cmp->is_in_loop = is_in_loop;
 		return 0;
 	}
 
-	off_cndjmp = cmp->bc.len;
-
-	/* append jump over the loop body if condition is false (stub) */
-	bytecode_append(&cmp->bc, ins, COUNT(ins));
-
 	off_body = cmp->bc.len;
 
 	/* compile loop body */
@@ -1253,7 +1259,6 @@ static int compile_while(SpnCompiler *cmp, SpnHashMap *ast)
 
 	off_end = cmp->bc.len;
 
-	cmp->bc.insns[off_cndjmp + 0] = SPN_MKINS_A(SPN_INS_JZE, cndidx);
 	cmp->bc.insns[off_cndjmp + 1] = off_end - off_body;
 
 	cmp->bc.insns[off_jmpback + 0] = SPN_MKINS_VOID(SPN_INS_JMP);
@@ -1272,9 +1277,7 @@ static int compile_while(SpnCompiler *cmp, SpnHashMap *ast)
 static int compile_do(SpnCompiler *cmp, SpnHashMap *ast)
 {
 	spn_sword off_body = cmp->bc.len;
-	spn_sword off_jmp, off_cond, off_end, diff;
-	spn_uword ins[2];
-	int reg = -1;
+	spn_sword off_jmp, off_cond, off_end;
 
 	/* save old loop state */
 	int is_in_loop = cmp->is_in_loop;
@@ -1297,23 +1300,18 @@ static int compile_do(SpnCompiler *cmp, SpnHashMap *ast)
 
 	off_cond = cmp->bc.len;
 
-	/* compile condition, clean up jump list on error */
-	if (compile_expr_toplevel(cmp, condition, &reg) == 0) {
+	/* compile condition and jump back to body if it's true,
+	 * clean up jump list on error
+	 */
+	if (compile_cond_jump(cmp, condition, 1, &off_jmp) == 0) {
 		free_jumplist(cmp->jumplist);
 		cmp->jumplist = orig_jumplist;
 		cmp->is_in_loop = is_in_loop;
 		return 0;
 	}
 
-	off_jmp = cmp->bc.len + COUNT(ins);
-	diff = off_body - off_jmp;
-
-	/* jump back to body if condition is true */
-	ins[0] = SPN_MKINS_A(SPN_INS_JNZ, reg);
-	ins[1] = diff;
-	bytecode_append(&cmp->bc, ins, COUNT(ins));
-
 	off_end = cmp->bc.len;
+	cmp->bc.insns[off_jmp + 1] = off_body - off_end;
 
 	/* fix up continue and break statements, free jump list on the fly */
 	fix_and_free_jump_list(cmp, off_end, off_cond);
@@ -1325,10 +1323,175 @@ static int compile_do(SpnCompiler *cmp, SpnHashMap *ast)
 	return 1;
 }
 
+/* Counted loops, i. e. 'for' loops of the form
+ *
+ *	for <init>; i OP n; <step> { <body> }
+ *
+ * where 'i' is a local variable, OP is one of '<', '<=', '>' or '>=', 'n' is
+ * either a local variable or a number literal, and <step> is one of 'i++',
+ * '++i', 'i--', '--i', 'i += k' or 'i -= k' with an integer literal 'k'
+ * that fits into a signed 8-bit operand, and which moves 'i' towards 'n',
+ * are closed by an SPN_INS_FORLT...SPN_INS_FORGE instruction which steps the
+ * counter and tests the condition in one go. See Remark (XIII) in vm.h.
+ */
+typedef struct CountedLoop {
+	int counter;                  /* register of loop counter             */
+	SpnHashMap *limit;            /* 'ident' or 'literal' node            */
+	int step;                     /* -128...127, non-zero                 */
+	enum spn_vm_ins loop_opcode;  /* one of SPN_INS_FORLT...SPN_INS_FORGE */
+	enum spn_vm_ins exit_opcode;  /* negated condition: SPN_INS_JLT...JGE */
+} CountedLoop;
+
+/* returns the register index of a local variable referred to by an
+ * 'ident' node, or -1 if it is not a local variable (or not an 'ident').
+ */
+static int local_var_index(SpnCompiler *cmp, SpnHashMap *ast)
+{
+	SpnValue name;
+
+	if (!type_equal(ast_get_type(ast), "ident")) {
+		return -1;
+	}
+
+	name = spn_hashmap_get_strkey(ast, "name");
+	return rts_getidx(cmp->varstack, name);
+}
+
+static int match_counted_loop(SpnCompiler *cmp, SpnHashMap *cond, SpnHashMap *icmt, CountedLoop *loop)
+{
+	static const struct {
+		const char *type;
+		enum spn_vm_ins loop_opcode;
+		enum spn_vm_ins exit_opcode;
+		int direction;
+	} cond_map[] = {
+		{ "<",  SPN_INS_FORLT, SPN_INS_JGE, +1 },
+		{ "<=", SPN_INS_FORLE, SPN_INS_JGT, +1 },
+		{ ">",  SPN_INS_FORGT, SPN_INS_JLE, -1 },
+		{ ">=", SPN_INS_FORGE, SPN_INS_JLT, -1 }
+	};
+
+	const char *cond_type = ast_get_type(cond);
+	const char *icmt_type = ast_get_type(icmt);
+	SpnHashMap *limit, *target;
+	long step;
+	size_t i;
+
+	for (i = 0; i < COUNT(cond_map); i++) {
+		if (type_equal(cond_map[i].type, cond_type)) {
+			break;
+		}
+	}
+
+	if (i >= COUNT(cond_map)) {
+		return 0;
+	}
+
+	/* the counter must be a local variable... */
+	loop->counter = local_var_index(cmp, ast_get_child_byname(cond, "left"));
+	if (loop->counter < 0) {
+		return 0;
+	}
+
+	/* ...and so must be the limit, unless it's a number literal */
+	limit = ast_get_child_byname(cond, "right");
+
+	if (type_equal(ast_get_type(limit), "literal")) {
+		SpnValue value = spn_hashmap_get_strkey(limit, "value");
+		if (!isnum(&value)) {
+			return 0;
+		}
+	} else if (local_var_index(cmp, limit) < 0) {
+		return 0;
+	}
+
+	/* determine the step and the variable being stepped */
+	if (type_equal(icmt_type, "pre_inc") || type_equal(icmt_type, "pre_dec")) {
+		target = ast_get_child_byname(icmt, "right");
+		step = type_equal(icmt_type, "pre_inc") ? +1 : -1;
+	} else if (type_equal(icmt_type, "post_inc") || type_equal(icmt_type, "post_dec")) {
+		target = ast_get_child_byname(icmt, "left");
+		step = type_equal(icmt_type, "post_inc") ? +1 : -1;
+	} else if (type_equal(icmt_type, "+=") || type_equal(icmt_type, "-=")) {
+		SpnHashMap *rhs = ast_get_child_byname(icmt, "right");
+		SpnValue value;
+
+		if (!type_equal(ast_get_type(rhs), "literal")) {
+			return 0;
+		}
+
+		value = spn_hashmap_get_strkey(rhs, "value");
+		if (!isint(&value) || intvalue(&value) < 1 || intvalue(&value) > 0x7f) {
+			return 0;
+		}
+
+		target = ast_get_child_byname(icmt, "left");
+		step = type_equal(icmt_type, "+=") ? intvalue(&value) : -intvalue(&value);
+	} else {
+		return 0;
+	}
+
+	/* the counter must be the variable that is incremented,
+	 * and it must be moving towards the limit
+	 */
+	if (local_var_index(cmp, target) != loop->counter) {
+		return 0;
+	}
+
+	if (step * cond_map[i].direction < 0) {
+		return 0;
+	}
+
+	loop->limit = limit;
+	loop->step = step;
+	loop->loop_opcode = cond_map[i].loop_opcode;
+	loop->exit_opcode = cond_map[i].exit_opcode;
+
+	return 1;
+}
+
+/* compiles the test before the first iteration of a counted loop. This
+ * leaves a stub jump instruction behind, just like compile_cond_jump().
+ * The index of the limit register is returned in '*limit_reg'.
+ */
+static int compile_counted_loop_prep(SpnCompiler *cmp, SpnHashMap *cond, CountedLoop *loop, int *limit_reg, spn_sword *off_jmp)
+{
+	spn_uword ins[2] = { 0 }; /* the offset is a stub */
+	size_t begin;
+
+	/* A literal limit is loaded once, into a hidden variable that lives
+	 * as long as the variables declared in the loop header do (so that
+	 * temporaries in the loop body don't clobber it). Its "name" is an
+	 * integer, which can never clash with the name of a real variable.
+	 */
+	if (type_equal(ast_get_type(loop->limit), "literal")) {
+		SpnValue hidden_name = makeint(rts_count(cmp->varstack));
+		*limit_reg = rts_add(cmp->varstack, hidden_name);
+
+		if (compile_expr_toplevel(cmp, loop->limit, limit_reg) == 0) {
+			return 0;
+		}
+	} else {
+		*limit_reg = local_var_index(cmp, loop->limit);
+	}
+
+	begin = cmp->bc.len;
+
+	ins[0] = SPN_MKINS_AB(loop->exit_opcode, loop->counter, *limit_reg);
+
+	*off_jmp = cmp->bc.len;
+	bytecode_append(&cmp->bc, ins, COUNT(ins));
+
+	spn_dbg_emit_source_location(cmp->debug_info, begin, cmp->bc.len, cond, -1);
+
+	return 1;
+}
+
 static int compile_for(SpnCompiler *cmp, SpnHashMap *ast)
 {
-	int regidx = -1;
 	int old_stack_size;
+	int is_counted, limit_reg = -1;
+	CountedLoop loop;
 	spn_sword off_cond, off_incmt, off_body_begin, off_body_end, off_cond_jmp, off_uncd_jmp;
 	spn_uword jmpins[2] = { 0 }; /* dummy */
 
@@ -1361,17 +1524,28 @@ static int compile_for(SpnCompiler *cmp, SpnHashMap *ast)
 		return 0;
 	}
 
-	/* compile condition, clean up on error likewise */
-	off_cond = cmp->bc.len;
-	if (compile_expr_toplevel(cmp, cond, &regidx) == 0) {
-		cmp->jumplist = orig_jumplist;
-		cmp->is_in_loop = is_in_loop;
-		return 0;
-	}
+	/* this must be done after compiling the initialization, because
+	 * the loop counter is usually declared there
+	 */
+	is_counted = match_counted_loop(cmp, cond, icmt, &loop);
 
-	/* compile "skip body if condition is false" jump */
-	off_cond_jmp = cmp->bc.len;
-	bytecode_append(&cmp->bc, jmpins, COUNT(jmpins));
+	/* compile condition and "skip body if condition is false" jump,
+	 * clean up on error likewise
+	 */
+	if (is_counted) {
+		if (compile_counted_loop_prep(cmp, cond, &loop, &limit_reg, &off_cond_jmp) == 0) {
+			cmp->jumplist = orig_jumplist;
+			cmp->is_in_loop = is_in_loop;
+			return 0;
+		}
+	} else {
+		off_cond = cmp->bc.len;
+		if (compile_cond_jump(cmp, cond, 0, &off_cond_jmp) == 0) {
+			cmp->jumplist = orig_jumplist;
+			cmp->is_in_loop = is_in_loop;
+			return 0;
+		}
+	}
 
 	/* compile body */
 	off_body_begin = cmp->bc.len;
@@ -1384,30 +1558,39 @@ static int compile_for(SpnCompiler *cmp, SpnHashMap *ast)
 
 	/* compile incrementing expression */
 	off_incmt = cmp->bc.len;
-	if (compile_expr_toplevel(cmp, icmt, NULL) == 0) {
-		free_jumplist(cmp->jumplist);
-		cmp->jumplist = orig_jumplist;
-		cmp->is_in_loop = is_in_loop;
-		return 0;
-	}
 
-	/* compile unconditional jump back to the condition */
-	off_uncd_jmp = cmp->bc.len;
-	bytecode_append(&cmp->bc, jmpins, COUNT(jmpins));
+	if (is_counted) {
+		/* step, test and jump back to the body in one instruction */
+		jmpins[0] = SPN_MKINS_ABC(loop.loop_opcode, loop.counter, limit_reg, loop.step);
+		bytecode_append(&cmp->bc, jmpins, COUNT(jmpins));
 
-	off_body_end = cmp->bc.len;
+		spn_dbg_emit_source_location(cmp->debug_info, off_incmt, cmp->bc.len, icmt, -1);
 
-	/* fill in stub jump instructions
-	 * 1. jump over body if condition not met
-	 */
-	cmp->bc.insns[off_cond_jmp + 0] = SPN_MKINS_A(SPN_INS_JZE, regidx);
-	cmp->bc.insns[off_cond_jmp + 1] = off_body_end - off_body_begin;
+		off_body_end = cmp->bc.len;
+		cmp->bc.insns[off_incmt + 1] = off_body_begin - off_body_end;
+	} else {
+		if (compile_expr_toplevel(cmp, icmt, NULL) == 0) {
+			free_jumplist(cmp->jumplist);
+			cmp->jumplist = orig_jumplist;
+			cmp->is_in_loop = is_in_loop;
+			return 0;
+		}
+
+		/* compile unconditional jump back to the condition */
+		off_uncd_jmp = cmp->bc.len;
+		bytecode_append(&cmp->bc, jmpins, COUNT(jmpins));
 
-	/* 2. always jump back to beginning and check condition */
-	cmp->bc.insns[off_uncd_jmp + 0] = SPN_MKINS_VOID(SPN_INS_JMP);
-	cmp->bc.insns[off_uncd_jmp + 1] = off_cond - off_body_end;
+		off_body_end = cmp->bc.len;
 
-	/* 3. patch break and continue instructions */
+		/* always jump back to beginning and check condition */
+		cmp->bc.insns[off_uncd_jmp + 0] = SPN_MKINS_VOID(SPN_INS_JMP);
+		cmp->bc.insns[off_uncd_jmp + 1] = off_cond - off_body_end;
+	}
+
+	/* fill in the stub jump over body if condition not met */
+	cmp->bc.insns[off_cond_jmp + 1] = off_body_end - off_body_begin;
+
+	/* patch break and continue instructions */
 	fix_and_free_jump_list(cmp, off_body_end, off_incmt);
 
 	/* get rid of variables declared in the initialization of the loop */
@@ -1425,23 +1608,17 @@ static int compile_if(SpnCompiler *cmp, SpnHashMap *ast)
 	spn_sword off_then, off_else, off_jze_b4_then, off_jmp_b4_else;
 	spn_sword len_then, len_else;
 	spn_uword ins[2] = { 0 };
-	int condidx = -1;
 
 	/* the else-branch might not exist, hence 'ast_get_child_byname_optional' */
 	SpnHashMap *cond = ast_get_child_byname(ast, "cond");
 	SpnHashMap *br_then = ast_get_child_byname(ast, "then");
 	SpnHashMap *br_else = ast_get_child_byname_optional(ast, "else");
 
-	/* compile condition */
-	if (compile_expr_toplevel(cmp, cond, &condidx) == 0) {
+	/* compile condition and stub "jump if false" instruction */
+	if (compile_cond_jump(cmp, cond, 0, &off_jze_b4_then) == 0) {
 		return 0;
 	}
 
-	off_jze_b4_then = cmp->bc.len;
-
-	/* append stub "jump if zero" instruction */
-	bytecode_append(&cmp->bc, ins, COUNT(ins));
-
 	off_then = cmp->bc.len;
 
 	/* compile "then" branch */
@@ -1465,7 +1642,6 @@ static int compile_if(SpnCompiler *cmp, SpnHashMap *ast)
 	len_then = off_else - off_then;
 	len_else = cmp->bc.len - off_else;
 
-	cmp->bc.insns[off_jze_b4_then + 0] = SPN_MKINS_A(SPN_INS_JZE, condidx);
 	cmp->bc.insns[off_jze_b4_then + 1] = len_then;
 
 	cmp->bc.insns[off_jmp_b4_else + 0] = SPN_MKINS_VOID(SPN_INS_JMP);
@@ -1617,7 +1793,22 @@ static int compile_return(SpnCompiler *cmp, SpnHashMap *ast)
 	SpnHashMap *expression = ast_get_child_byname_optional(ast, "expr");
 	if (expression != NULL) {
 		int dst = -1;
-		if (compile_expr_toplevel(cmp, expression, &dst) == 0) {
+
+		/* 'return f(x);' is a tail call. The RET after the TAILCALL
+		 * is only reached if the callee is a native function, see
+		 * Remark (XVII) in vm.h.
+		 */
+		if (type_equal(ast_get_type(expression), "call")) {
+			size_t begin = cmp->bc.len;
+			cmp->tmpidx = rts_count(cmp->varstack);
+
+			if (compile_call_ex(cmp, expression, &dst, SPN_INS_TAILCALL) == 0) {
+				return 0;
+			}
+
+			/* the same debug info that compile_expr() would add */
+			spn_dbg_emit_source_location(cmp->debug_info, begin, cmp->bc.len, expression, dst);
+		} else if (compile_expr_toplevel(cmp, expression, &dst) == 0) {
 			return 0;
 		}
 
@@ -1661,6 +1852,85 @@ static int compile_expr_toplevel(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	return 0;
 }
 
+/* If the condition is a comparison, then instead of computing a Boolean
+ * into a temporary register and testing it using JZE or JNZ, the comparison
+ * is fused with the jump (see Remark (XI) in vm.h). The comparison
+ * instructions yield an exact 'true' or 'false' (there are no unordered
+ * results), so negating the condition is as easy as negating the operator.
+ */
+static int compile_cond_jump(SpnCompiler *cmp, SpnHashMap *cond, int jmp_if, spn_sword *off_jmp)
+{
+	static const NodeAndOpcode jmp_if_true_map[] = {
+		{ "==", SPN_INS_JEQ },
+		{ "!=", SPN_INS_JNE },
+		{ "<",  SPN_INS_JLT },
+		{ "<=", SPN_INS_JLE },
+		{ ">",  SPN_INS_JGT },
+		{ ">=", SPN_INS_JGE }
+	};
+
+	static const NodeAndOpcode jmp_if_false_map[] = {
+		{ "==", SPN_INS_JNE },
+		{ "!=", SPN_INS_JEQ },
+		{ "<",  SPN_INS_JGE },
+		{ "<=", SPN_INS_JGT },
+		{ ">",  SPN_INS_JLE },
+		{ ">=", SPN_INS_JLT }
+	};
+
+	spn_uword ins[2] = { 0 }; /* the offset is a stub */
+	const char *type = ast_get_type(cond);
+	size_t i;
+
+	for (i = 0; i < COUNT(jmp_if_true_map); i++) {
+		if (type_equal(jmp_if_true_map[i].type, type)) {
+			break;
+		}
+	}
+
+	if (i < COUNT(jmp_if_true_map)) {
+		SpnHashMap *left = ast_get_child_byname(cond, "left");
+		SpnHashMap *right = ast_get_child_byname(cond, "right");
+		int dst_left = -1, dst_right = -1;
+		size_t begin = cmp->bc.len;
+
+		enum spn_vm_ins opcode = jmp_if
+			? jmp_if_true_map[i].opcode
+			: jmp_if_false_map[i].opcode;
+
+		/* same as in compile_expr_toplevel() */
+		cmp->tmpidx = rts_count(cmp->varstack);
+
+		if (compile_expr(cmp, left,  &dst_left)  == 0
+		 || compile_expr(cmp, right, &dst_right) == 0) {
+			return 0;
+		}
+
+		ins[0] = SPN_MKINS_AB(opcode, dst_left, dst_right);
+
+		*off_jmp = cmp->bc.len;
+		bytecode_append(&cmp->bc, ins, COUNT(ins));
+
+		/* there's no result register, but runtime errors
+		 * must still be traceable back to the comparison
+		 */
+		spn_dbg_emit_source_location(cmp->debug_info, begin, cmp->bc.len, cond, -1);
+	} else {
+		int reg = -1;
+
+		if (compile_expr_toplevel(cmp, cond, &reg) == 0) {
+			return 0;
+		}
+
+		ins[0] = SPN_MKINS_A(jmp_if ? SPN_INS_JNZ : SPN_INS_JZE, reg);
+
+		*off_jmp = cmp->bc.len;
+		bytecode_append(&cmp->bc, ins, COUNT(ins));
+	}
+
+	return 1;
+}
+
 /* helper function for loading a string literal */
 static void compile_string_literal(SpnCompiler *cmp, SpnValue str, int *dst)
 {
@@ -1682,6 +1952,28 @@ static void compile_string_literal(SpnCompiler *cmp, SpnValue str, int *dst)
 	emit_ins_mid(cmp, SPN_INS_LDSYM, *dst, idx);
 }
 
+/* checks if an AST node is an integer literal that fits into the 8-bit
+ * immediate operand of SPN_INS_ADDI and SPN_INS_SUBI. If so, the value
+ * of the literal is stored in '*value'.
+ */
+static int is_small_int_literal(SpnHashMap *ast, long *value)
+{
+	SpnValue literal;
+
+	if (!type_equal(ast_get_type(ast), "literal")) {
+		return 0;
+	}
+
+	literal = spn_hashmap_get_strkey(ast, "value");
+
+	if (!isint(&literal) || intvalue(&literal) < 0 || intvalue(&literal) > 0xff) {
+		return 0;
+	}
+
+	*value = intvalue(&literal);
+	return 1;
+}
+
 /* simple (non short-circuiting) binary operators: arithmetic, bitwise ops,
  * comparison and equality tests, string concatenation
  */
@@ -1718,6 +2010,34 @@ static int compile_simple_binop(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	const char *type = ast_get_type(ast);
 	enum spn_vm_ins opcode = node_to_opcode(opcode_map, COUNT(opcode_map), type);
 
+	/* adding or subtracting a small non-negative integer literal
+	 * is very common (think 'n - 1'), so it is compiled into a
+	 * single instruction with an immediate operand instead of
+	 * loading the constant into a register first (Remark (XII), vm.h)
+	 */
+	if (opcode == SPN_INS_ADD || opcode == SPN_INS_SUB) {
+		long imm;
+
+		if (is_small_int_literal(right, &imm)) {
+			if (compile_expr(cmp, left, &dst_left) == 0) {
+				return 0;
+			}
+
+			/* if result of LHS went into a temporary, then "pop" */
+			if (dst_left >= rts_count(cmp->varstack)) {
+				tmp_pop(cmp);
+			}
+
+			if (*dst < 0) {
+				*dst = tmp_push(cmp);
+			}
+
+			opcode = opcode == SPN_INS_ADD ? SPN_INS_ADDI : SPN_INS_SUBI;
+			emit_ins_ABC(cmp, opcode, *dst, dst_left, imm);
+			return 1;
+		}
+	}
+
 	/* compile children */
 	if (compile_expr(cmp, left,  &dst_left)  == 0
 	 || compile_expr(cmp, right, &dst_right) == 0) {
@@ -1744,6 +2064,81 @@ static int compile_simple_binop(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	return 1;
 }
 
+/* maximal number of operands of a CONCATN instruction */
+#define CONCATN_MAX_OPERANDS 0xff
+
+/* A chain of concatenations, such as 'a .. b .. c', is compiled into one
+ * CONCATN instruction (Remark (XV), vm.h), so that no intermediate strings
+ * are created. Since '..' is left-associative, the operands are the right
+ * children along the left edge of the tree (in reverse order), and the
+ * leftmost operand is the left child at the bottom.
+ */
+static int compile_concat(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+{
+	SpnHashMap *operands[CONCATN_MAX_OPERANDS];
+	int regs[CONCATN_MAX_OPERANDS];
+	SpnHashMap *node = ast, *first = ast;
+	spn_uword *indices;
+	size_t begin;
+	int n = 0, i, nvars;
+
+	/* if the chain is too long, its remaining part is one operand */
+	while (type_equal(ast_get_type(node), "concat") && n < CONCATN_MAX_OPERANDS - 1) {
+		operands[n++] = ast_get_child_byname(node, "right");
+		first = node;
+		node = ast_get_child_byname(node, "left");
+	}
+
+	operands[n++] = node;
+
+	/* a single '..' is just a binary operator */
+	if (n == 2) {
+		return compile_simple_binop(cmp, ast, dst);
+	}
+
+	indices = spn_calloc(ROUNDUP(n, SPN_WORD_OCTETS), sizeof indices[0]);
+
+	/* compile operands from left to right */
+	for (i = 0; i < n; i++) {
+		size_t wordidx = i / SPN_WORD_OCTETS;
+		size_t shift = 8 * (i % SPN_WORD_OCTETS);
+
+		regs[i] = -1;
+
+		if (compile_expr(cmp, operands[n - 1 - i], &regs[i]) == 0) {
+			free(indices);
+			return 0;
+		}
+
+		indices[wordidx] |= (spn_uword)(regs[i]) << shift;
+	}
+
+	/* "pop" the temporaries holding the operands, if any */
+	nvars = rts_count(cmp->varstack);
+
+	for (i = n - 1; i >= 0; i--) {
+		if (regs[i] >= nvars) {
+			tmp_pop(cmp);
+		}
+	}
+
+	if (*dst < 0) {
+		*dst = tmp_push(cmp);
+	}
+
+	begin = cmp->bc.len;
+	emit_ins_AB(cmp, SPN_INS_CONCATN, *dst, n);
+	bytecode_append(&cmp->bc, indices, ROUNDUP(n, SPN_WORD_OCTETS));
+	free(indices);
+
+	/* errors are reported at the first operator of the chain, like
+	 * they were if the leftmost concatenation (performed first) failed
+	 */
+	spn_dbg_emit_source_location(cmp->debug_info, begin, cmp->bc.len, first, *dst);
+
+	return 1;
+}
+
 static int compile_assignment_var(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 {
 	SpnHashMap *left  = ast_get_child_byname(ast, "left");
@@ -2363,8 +2758,8 @@ static int compile_array_literal(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	/* obtain temporary index for values */
 	validx = tmp_push(cmp);
 
-	/* create array instance */
-	emit_ins_A(cmp, SPN_INS_NEWARR, *dst);
+	/* create array instance, with room for the elements (XVI) */
+	emit_ins_mid(cmp, SPN_INS_NEWARR, *dst, n < 0xffff ? n : 0xffff);
 
 	for (i = 0; i < n; i++) {
 		SpnHashMap *expr = ast_get_nth_child(children, i);
@@ -2399,8 +2794,8 @@ static int compile_hashmap_literal(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	keyidx = tmp_push(cmp);
 	validx = tmp_push(cmp);
 
-	/* first, create the hashmap */
-	emit_ins_A(cmp, SPN_INS_NEWHASH, *dst);
+	/* first, create the hashmap, with room for the keys (XVI) */
+	emit_ins_mid(cmp, SPN_INS_NEWHASH, *dst, n < 0xffff ? n : 0xffff);
 
 	/* then, compile keys and values */
 	for (i = 0; i < n; i++) {
@@ -2454,6 +2849,22 @@ static int compile_subscript_ex(SpnCompiler *cmp, SpnHashMap *ast, int *dst,
 		return 0;
 	}
 
+	/* the built-in '.length' property is resolved right here,
+	 * so no property name needs to be loaded and compared at runtime
+	 */
+	if (is_memberof && !is_method_call) {
+		SpnValue nameval = spn_hashmap_get_strkey(ast, "name");
+
+		if (strcmp(stringvalue(&nameval)->cstr, "length") == 0) {
+			if (arridx >= rts_count(cmp->varstack)) {
+				tmp_pop(cmp);
+			}
+
+			emit_ins_AB(cmp, SPN_INS_LENGTH, *dst, arridx);
+			return 1;
+		}
+	}
+
 	/* compile subscripting expression */
 	if (is_subscript) {
 		/* normal subscripting with brackets */
@@ -2580,6 +2991,11 @@ static spn_uword *compile_callargs(SpnCompiler *cmp, SpnArray *arguments, int is
 }
 
 static int compile_call(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+{
+	return compile_call_ex(cmp, ast, dst, SPN_INS_CALL);
+}
+
+static int compile_call_ex(SpnCompiler *cmp, SpnHashMap *ast, int *dst, enum spn_vm_ins opcode)
 {
 	int fnreg = -1, self_reg = -1, method_name_reg = -1;
 	spn_uword *arg_register_indices;
@@ -2628,7 +3044,7 @@ static int compile_call(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	}
 
 	/* actually emit call instruction */
-	emit_ins_ABC(cmp, SPN_INS_CALL, *dst, fnreg, argc);
+	emit_ins_ABC(cmp, opcode, *dst, fnreg, argc);
 	bytecode_append(&cmp->bc, arg_register_indices, ROUNDUP(argc, SPN_WORD_OCTETS));
 
 	/* 'arg_register_indices' has been 'malloc()'ed, so free it */
@@ -2920,7 +3336,7 @@ static int compile_expr(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 		{ "assign",    compile_assignment          },
 		{ "or",        compile_logical             },
 		{ "and",       compile_logical             },
-		{ "concat",    compile_simple_binop        },
+		{ "concat",    compile_concat              },
 
 		/* the rest of the binary operators (mostly arithmetic) */
 		{ "+",         compile_simple_binop        },
@@ -121,9 +121,7 @@ void spn_ctx_setuserinfo(SpnContext *ctx, void *info)
  */
 static void add_to_programs(SpnContext *ctx, SpnFunction *fn)
 {
-	SpnValue val;
-	val.type = SPN_TYPE_FUNC;
-	val.v.o = fn;
+	SpnValue val = spn_makeobject(SPN_TYPE_FUNC, fn);
 	spn_array_push(ctx->programs, &val);
 }
 
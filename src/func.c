@@ -74,6 +74,15 @@ static void free_func(void *obj)
 	if (func->topprg) {
 		free(func->repr.bc);
 		spn_object_release(func->symtab);
+
+		if (func->icache) {
+			size_t i;
+			for (i = 0; i < func->nwords; i++) {
+				free(func->icache[i]);
+			}
+
+			free(func->icache);
+		}
 	}
 
 	if (func->debug_info) {
@@ -119,6 +128,7 @@ SpnFunction *spn_func_new_script(const char *name, spn_uword *bc, SpnFunction *e
 	func->upvalues = NULL;      /* unused       */
 	func->repr.bc = bc;         /* weak pointer */
 	func->debug_info = NULL;    /* unused       */
+	func->icache = NULL;        /* unused       */
 
 	return func;
 }
@@ -139,6 +149,7 @@ SpnFunction *spn_func_new_topprg(const char *name, spn_uword *bc, size_t nwords,
 	func->upvalues = NULL; /* unused */
 	func->repr.bc = bc; /* strong pointer */
 	func->debug_info = debug; /* strong pointer */
+	func->icache = NULL; /* allocated lazily by the VM */
 
 	return func;
 }
@@ -159,6 +170,7 @@ SpnFunction *spn_func_new_native(const char *name, int (*fn)(SpnValue *, int, Sp
 	func->upvalues = NULL;   /* unused */
 	func->repr.fn = fn;
 	func->debug_info = NULL; /* unused */
+	func->icache = NULL;     /* unused */
 
 	return func;
 }
@@ -193,6 +205,7 @@ SpnFunction *spn_func_new_closure(SpnFunction *prototype)
 	func->upvalues = spn_array_new();
 	func->repr = prototype->repr;
 	func->debug_info = NULL;            /* unused       */
+	func->icache = NULL;                /* unused       */
 
 	return func;
 }
@@ -201,10 +214,7 @@ SpnFunction *spn_func_new_closure(SpnFunction *prototype)
 
 static SpnValue func_to_val(SpnFunction *func)
 {
-	SpnValue ret;
-	ret.type = SPN_TYPE_FUNC;
-	ret.v.o = func;
-	return ret;
+	return spn_makeobject(SPN_TYPE_FUNC, func);
 }
 
 SpnValue spn_makescriptfunc(const char *name, spn_uword *bc, SpnFunction *env)
@@ -31,6 +31,7 @@ typedef struct SpnFunction {
 		int (*fn)(SpnValue *, int, SpnValue *, void *);
 	} repr;                  /* representation                      */
 	SpnHashMap *debug_info;  /* optional debug info if top-level    */
+	void **icache;           /* top-level only: inline caches (VM)  */
 } SpnFunction;
 
 /* 'name' is always a weak pointer, regardless of whether
@@ -58,6 +59,12 @@ typedef struct SpnFunction {
  * to the closure only and nothing else). It is freed if
  * the closure object is deallocated.
  *
+ * 'icache' is owned by top-level programs. It is an array
+ * of 'nwords' pointers, indexed by bytecode offset, which
+ * the virtual machine lazily fills with its own per-instruction
+ * cache entries. They are allocated using malloc(), they don't
+ * own any objects, so they are freed using a simple free().
+ *
  * 'repr.bc' is a strong pointer if the function object
  * designates a top-level program; otherwise (when the
  * function object represents a free script function or
@@ -80,6 +87,6 @@ SPN_API SpnValue spn_maketopprgfunc(const char *name, spn_uword *bc, size_t nwor
 SPN_API SpnValue spn_makenativefunc(const char *name, int (*fn)(SpnValue *, int, SpnValue *, void *));
 SPN_API SpnValue spn_makeclosure(SpnFunction *prototype);
 
-#define spn_funcvalue(val) ((SpnFunction *)((val)->v.o))
+#define spn_funcvalue(val) ((SpnFunction *)spn_objvalue(val))
 
 #endif /* SPN_FUNC_H */
@@ -18,70 +18,170 @@
 #include "str.h"
 #include "private.h"
 
-/* An attempt to detect sizeof(unsigned long) at compile-time.
- * I'm not much into the C preprocessor, but since it computes
- * every integral expression using the widest integer known to
- * its corresponding C compiler, and that C compiler might not
- * have an integer type wide enough to represent 0x2fffffffffff,
- * the computation may overflow and the comparison will probably fail.
- * Hence we do a little workaround. The idea is this:
- * 1. ULONG_MAX is always >= 0xffffffff (guaranteed by C89).
- * 2. If ULONG_MAX == 0xffffffff, we're most probably on 32-bit.
- * 3. Else it's presumably safe to assume something more than
- *    32-bit and check if all the size primes fit into unsigned
- *    long, with a little bit of extra safety reserve.
+/* The hash table is probed one group of control bytes at a time.
+ * With SSE2, a whole group is compared in a couple of instructions.
  */
-#if ULONG_MAX > 0xffffffffu
-	#if ULONG_MAX >= 0x2fffffffffffu
-		#define ALL_SIZES_FIT 1
-	#else
-		#define ALL_SIZES_FIT 0
-	#endif /* ULONG_MAX >= 0x2fffffffffffu */
+#if USE_SIMD && defined(__SSE2__)
+#define SPN_HASHMAP_SSE2 1
+#include <emmintrin.h>
 #else
-	#define ALL_SIZES_FIT 0
-#endif /* ULONG_MAX > 0xffffffffu */
-
-
-typedef struct Bucket {
-	SpnValue key;
-	SpnValue value;
-	struct Bucket *next;
-} Bucket;
+#define SPN_HASHMAP_SSE2 0
+#endif
+
+/* Key-value pairs are stored in a dense array of entries, in the order
+ * in which they were inserted, so that iteration is deterministic, and
+ * takes time proportional to the number of keys. Removing a key leaves
+ * a hole (an entry with a nil key) behind, and holes are squeezed out
+ * when the array of entries fills up, or when the table shrinks (see
+ * SHRINK_FACTOR). Holes at the end of the array are dropped immediately.
+ *
+ * The entries are found through a hash table of entry indices, which uses
+ * open addressing, with the layout of Swiss tables. Its capacity is a power
+ * of two, and besides the array of buckets (entry indices), it has an array
+ * of control bytes, one for each bucket. The control byte of a bucket is
+ * either CTRL_EMPTY, CTRL_DELETED (a tombstone, left behind by a removed
+ * key), or, if the bucket is full, the topmost 7 bits of the hash of its
+ * key, which is non-negative as a signed char.
+ *
+ * The buckets are probed in groups of GROUP_WIDTH consecutive buckets:
+ * all control bytes in the group are compared to the 7-bit hash at once,
+ * and keys are only compared in buckets whose control byte matches, so
+ * a miss rarely needs to call spn_value_equal() at all. The probing stops
+ * at the first group which contains an empty bucket. In order for groups
+ * to be loaded without wrapping around, the first GROUP_WIDTH control
+ * bytes are mirrored after the end of the array.
+ *
+ * The remaining bits of the hash select the first group to probe; the
+ * subsequent groups are GROUP_WIDTH, 2 * GROUP_WIDTH, etc. buckets apart
+ * (triangular probing), which visits every group when the capacity is a
+ * power of two. At most 7/8 of the buckets are full or tombstones, so
+ * there's always an empty bucket which terminates the probing.
+ */
+#define GROUP_WIDTH  16
+#define MIN_CAPACITY GROUP_WIDTH
+
+#define CTRL_EMPTY   0x80
+#define CTRL_DELETED 0xfe
+
+#define MIN_ENTRIES 8
+
+typedef struct Entry {
+	SpnValue      key;   /* nil if the key has been removed */
+	SpnValue      value;
+	unsigned long hash;  /* hash of the key, see mix_hash() */
+} Entry;
+
+typedef struct Table {
+	size_t        *buckets;  /* indices into the array of entries    */
+	unsigned char *ctrl;     /* control bytes, right after 'buckets' */
+	size_t         capacity; /* number of buckets, 0 or a power of 2 */
+} Table;
+
+/* Rebuilding a big table at once would stall the operation that happens
+ * to trigger it, so tables with at least INCREMENTAL_MIN_CAPACITY buckets
+ * are migrated incrementally: the new table is allocated right away, but
+ * the key-value pairs are moved over from the old one MIGRATE_STEP buckets
+ * at a time, each time a new key is inserted. In the meantime, lookups
+ * search both tables. (Only insertions do this work, since they are what
+ * fills up the table.) The entries themselves are not moved, so this is
+ * invisible to iteration.
+ */
+#define INCREMENTAL_MIN_CAPACITY 4096
+#define MIGRATE_STEP             64
+
+/* Tables that have had keys removed from them are shrunk when they are less
+ * than 1/SHRINK_FACTOR full, so that hashmaps used as caches give back the
+ * memory of the keys that have come and gone. Like growing, this is only
+ * done upon insertion, so removing keys while enumerating them is safe.
+ * (The new table has room for twice the remaining keys, so the hashmap
+ * doesn't oscillate between shrinking and growing.)
+ */
+#define SHRINK_FACTOR 8
+
+/* Shapes (also known as hidden classes).
+ * Hashmaps are most often used as objects: they have a handful of keys,
+ * all of which are short strings (the names of the fields), and many of
+ * them are built by adding the same keys in the same order. Such hashmaps
+ * don't store their keys at all. Instead, they point to a shape, which
+ * describes the set of keys (and the order in which they were added),
+ * and they keep only the values, in a dense array of slots.
+ *
+ * Shapes form a transition tree: the root is the shape of the empty
+ * hashmap, and every other shape is the shape of its parent plus one key,
+ * which occupies the next slot. Hashmaps that are built in the same way
+ * therefore share their shape, and the slot index of a given key is the
+ * same in all of them, which makes it possible for the virtual machine
+ * to cache it (see spn_hashmap_shape() and friends).
+ *
+ * Each virtual machine has its own tree, and only the hashmaps created by
+ * its programs (object literals) start out with a shape; the ones created
+ * by the library and by the host use the bucket table right away. The
+ * transitions of the whole tree are found through a single hash table,
+ * keyed by the parent shape and the new key, so the root (the first key
+ * of every object) may have any number of children.
+ *
+ * Shapes are only freed together with their tree, which is reference
+ * counted: it's owned by its virtual machine, and by every hashmap that
+ * has a shape from it. So a shape pointer uniquely identifies the layout
+ * of a hashmap as long as any hashmap has that shape. To keep the tree
+ * from growing without bounds, its size, the number of keys per shape,
+ * the number of different transitions out of a shape (other than the
+ * root) and the length of the keys are all limited. When any of these
+ * limits would be exceeded (or a non-string key is added), the hashmap
+ * transparently falls back to the bucket table.
+ */
+#define SHAPE_MAX_KEYLEN   32   /* longest key stored in a shape           */
+#define SHAPE_MAX_SLOTS    16   /* most keys in a shape                    */
+#define SHAPE_MAX_CHILDREN 8    /* most transitions out of a non-root shape */
+#define SHAPE_MAX_COUNT    4096 /* most shapes in a transition tree        */
+
+typedef struct Shape {
+	struct Shape *parent;    /* shape without the last key, NULL for root */
+	SpnValue      key;       /* the last key (a string), strong pointer   */
+	size_t        nslots;    /* number of keys, i. e. depth in the tree   */
+	size_t        nchildren; /* number of transitions from this shape     */
+	unsigned long hash;      /* combined hash of the keys, 0 for root     */
+} Shape;
+
+struct SpnShapeTree {
+	size_t  refcnt;     /* the virtual machine and the shaped hashmaps */
+	Shape   root;       /* the shape of empty hashmaps                 */
+	Shape **shapes;     /* all shapes but the root, by their hash      */
+	size_t  capacity;   /* size of 'shapes', 0 or a power of 2         */
+	size_t  count;      /* number of shapes, excluding the root        */
+};
 
 struct SpnHashMap {
-	SpnObject   base;
-	int         sizeindex;   /* index into 'sizes' array (see below)   */
-	size_t      keycount;    /* number of keys in the table            */
-	size_t      valcount;    /* number of non-nil values. <= keycount. */
-	Bucket     *buckets;     /* actual array for key-value pairs       */
+	SpnObject      base;
+	size_t         valcount;    /* number of non-nil values              */
+	Entry         *entries;     /* key-value pairs, in insertion order   */
+	size_t         nentries;    /* used entries, including holes         */
+	size_t         entrycap;    /* allocation size of 'entries'          */
+	size_t         growth_left; /* empty buckets that may still be used  */
+	Table          table;       /* the hash table                        */
+	Table          old;         /* table being migrated, if capacity > 0 */
+	size_t         migrated;    /* buckets of 'old' already migrated     */
+	int            is_class;    /* see spn_hashmap_mark_class()          */
+	Shape         *shape;       /* NULL if the bucket table is used      */
+	SpnShapeTree  *shapetree;   /* tree of 'shape' (strong), or NULL     */
+	SpnValue      *slots;       /* values of the keys in 'shape'         */
+	size_t         slotcap;     /* allocation size of 'slots'            */
 };
 
-static void free_hashmap(void *obj);
-static void expand_or_rehash(SpnHashMap *hm, int always_expand);
-
-/* Hash table allocation sizes. These are primes of which
- * the ratio asymptotically approaches phi, the golden ratio.
+/* Incremented whenever a hashmap marked as a class is modified or freed.
+ * It is shared by all virtual machines, and they may run on different
+ * threads, so it is updated atomically (see SPN_ATOMIC_INC()). A change
+ * in a class of one machine merely invalidates the caches of the others.
  */
-static const unsigned long sizes[] = {
-	0x0,             0x3,             0x7,             0xD,
-	0x17,            0x29,            0x47,            0x7F,
-	0xBF,            0xFB,            0x17F,           0x277,
-	0x43F,           0x6BB,           0xAF3,           0x11AB,
-	0x1CB7,          0x2EB7,          0x4BF7,          0x79FF,
-	0xC5FB,          0x13FFF,         0x205FF,         0x345F7,
-	0x549EF,         0x88FD5,         0xDD9EF,         0x1669FF,
-	0x2441FF,        0x3AABFF,        0x5EEDFF,        0x9999F5,
-	0xF887FF,        0x19221FB,       0x28AA9D9,       0x41CCBE5,
-	0x6A777F7,       0xAC443EF,       0x116BB9EF,      0x1C2FFDF3,
-	0x2D9BB9FD,      0x49CBB7EF,      0x77676FE5,      0xC13327FF,
-#if ALL_SIZES_FIT
-	0x1389A97E3,     0x1F9CDBDF5,     0x3326855D7,     0x52C3613FF,
-	0x85E9E69EF,     0xD8AD47DF9,     0x15E972E7D5,    0x23744765E9,
-	0x395DBA4BFB,    0x5CD201B1F7,    0x962FBBFDFF,    0xF301BDADF7,
-	0x1893179ABF3,   0x27C333759E9,   0x40564B105F1,   0x68197E85FF9,
-	0xA86FC9967E5,   0x11089481C7E9,  0x1B8F911B2DFB,  0x2C98259CF549
-#endif /* ALL_SIZES_FIT */
-};
+static unsigned long class_version = 0;
+
+static void free_hashmap(void *obj);
+static void rehash(SpnHashMap *hm, size_t newcap);
+static void migrate(SpnHashMap *hm, size_t nbuckets);
+static void compact(SpnHashMap *hm, size_t entrycap, size_t capacity);
+static void release_storage(SpnHashMap *hm);
+static int shape_set(SpnHashMap *hm, const SpnValue *key, const SpnValue *val);
+static void shape_to_buckets(SpnHashMap *hm);
 
 static const SpnClass spn_class_hashmap = {
 	sizeof(SpnHashMap),
@@ -97,26 +197,108 @@ SpnHashMap *spn_hashmap_new()
 {
 	SpnHashMap *hm = spn_object_new(&spn_class_hashmap);
 
-	hm->sizeindex = 0;
-	hm->keycount = 0;
 	hm->valcount = 0;
-	hm->buckets = NULL;
+	hm->entries = NULL;
+	hm->nentries = 0;
+	hm->entrycap = 0;
+	hm->growth_left = 0;
+	hm->table.buckets = NULL;
+	hm->table.ctrl = NULL;
+	hm->table.capacity = 0;
+	hm->old = hm->table;
+	hm->migrated = 0;
+	hm->is_class = 0;
+	hm->shape = NULL;
+	hm->shapetree = NULL;
+	hm->slots = NULL;
+	hm->slotcap = 0;
 
 	return hm;
 }
 
+SpnHashMap *spn_hashmap_new_shaped(SpnShapeTree *tree)
+{
+	SpnHashMap *hm = spn_hashmap_new();
+
+#if USE_HASHMAP_SHAPES
+	tree->refcnt++;
+	hm->shape = &tree->root;
+	hm->shapetree = tree;
+#endif /* USE_HASHMAP_SHAPES */
+
+	return hm;
+}
+
+SpnShapeTree *spn_shapetree_new(void)
+{
+	SpnShapeTree *tree = spn_malloc(sizeof *tree);
+
+	tree->refcnt = 1;
+	tree->root.parent = NULL;
+	tree->root.key = spn_nilval;
+	tree->root.nslots = 0;
+	tree->root.nchildren = 0;
+	tree->root.hash = 0;
+	tree->shapes = NULL;
+	tree->capacity = 0;
+	tree->count = 0;
+
+	return tree;
+}
+
+void spn_shapetree_release(SpnShapeTree *tree)
+{
+	size_t i;
+
+	if (--tree->refcnt > 0) {
+		return;
+	}
+
+	for (i = 0; i < tree->capacity; i++) {
+		Shape *shape = tree->shapes[i];
+
+		if (shape != NULL) {
+			spn_value_release(&shape->key);
+			free(shape);
+		}
+	}
+
+	free(tree->shapes);
+	free(tree);
+}
+
 static void free_hashmap(void *obj)
 {
 	SpnHashMap *hm = obj;
-	size_t allocsize = sizes[hm->sizeindex];
 	size_t i;
 
-	for (i = 0; i < allocsize; i++) {
-		spn_value_release(&hm->buckets[i].key);
-		spn_value_release(&hm->buckets[i].value);
+	/* a new class may be allocated at the same address later,
+	 * so caches must not recognize it by its address only
+	 */
+	if (hm->is_class) {
+		SPN_ATOMIC_INC(&class_version);
 	}
 
-	free(hm->buckets);
+	if (hm->shape != NULL) {
+		for (i = 0; i < hm->shape->nslots; i++) {
+			spn_value_release(&hm->slots[i]);
+		}
+
+		free(hm->slots);
+		spn_shapetree_release(hm->shapetree);
+		return;
+	}
+
+	for (i = 0; i < hm->nentries; i++) {
+		spn_value_release(&hm->entries[i].key);
+		spn_value_release(&hm->entries[i].value);
+	}
+
+	free(hm->entries);
+
+	/* the control bytes live in the same allocation as the buckets */
+	free(hm->table.buckets);
+	free(hm->old.buckets);
 }
 
 size_t spn_hashmap_count(SpnHashMap *hm)
@@ -124,298 +306,853 @@ size_t spn_hashmap_count(SpnHashMap *hm)
 	return hm->valcount;
 }
 
+void spn_hashmap_mark_class(SpnHashMap *hm)
+{
+	hm->is_class = 1;
+}
+
+unsigned long spn_hashmap_class_version(void)
+{
+	return SPN_ATOMIC_LOAD(&class_version);
+}
+
+const void *spn_hashmap_shape(SpnHashMap *hm)
+{
+	return hm->shape;
+}
+
+SpnValue spn_hashmap_slot_get(SpnHashMap *hm, long slot)
+{
+	assert(hm->shape != NULL);
+	assert(0 <= slot && slot < (long)(hm->shape->nslots));
+	return hm->slots[slot];
+}
+
 SpnValue spn_makehashmap(void)
 {
-	SpnValue val;
-	val.type = SPN_TYPE_HASHMAP;
-	val.v.o = spn_hashmap_new();
-	return val;
+	return spn_makeobject(SPN_TYPE_HASHMAP, spn_hashmap_new());
+}
+
+/* keys are often the very same objects (interned strings, for example),
+ * which are trivially equal, so this is checked before anything else
+ */
+static int keys_equal(const SpnValue *lhs, const SpnValue *rhs)
+{
+	if (isobject(lhs) && isobject(rhs) && objvalue(lhs) == objvalue(rhs)) {
+		return 1;
+	}
+
+	return spn_value_equal(lhs, rhs);
+}
+
+/* Spreads the bits of a hash value. Some hash values, such as those of
+ * objects without a hash function (which are their addresses), only
+ * differ in a few bits, but both ends of the hash are used: the top
+ * 7 bits go into the control byte, the rest selects the first group.
+ */
+#if ULONG_MAX > 0xffffffffu
+#define HASH_MULTIPLIER 0x9e3779b97f4a7c15ul
+#else
+#define HASH_MULTIPLIER 0x9e3779b9ul
+#endif /* ULONG_MAX > 0xffffffffu */
+
+#define HASH_BITS (sizeof(unsigned long) * CHAR_BIT)
+
+static unsigned long mix_hash(unsigned long hash)
+{
+	hash *= HASH_MULTIPLIER;
+	return hash ^ (hash >> (HASH_BITS / 2));
+}
+
+static unsigned char hash_ctrl(unsigned long hash)
+{
+	return hash >> (HASH_BITS - 7);
+}
+
+/* Group operations. Each of them returns a bit mask with bit #i set
+ * if the i-th control byte of the group starting at 'g' matches.
+ */
+#if SPN_HASHMAP_SSE2
+
+static unsigned group_match(const unsigned char *g, unsigned char c)
+{
+	__m128i ctrl = _mm_loadu_si128((const __m128i *)(g));
+	__m128i needle = _mm_set1_epi8((char)(c));
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, needle));
 }
 
-static Bucket *find_key(Bucket *head, const SpnValue *key)
+/* empty and deleted buckets are exactly those with the sign bit set */
+static unsigned group_match_free(const unsigned char *g)
 {
-	Bucket *node = head;
-	assert(node != NULL);
+	__m128i ctrl = _mm_loadu_si128((const __m128i *)(g));
+	return _mm_movemask_epi8(ctrl);
+}
+
+#else /* SPN_HASHMAP_SSE2 */
+
+static unsigned group_match(const unsigned char *g, unsigned char c)
+{
+	unsigned mask = 0;
+	int i;
+
+	for (i = 0; i < GROUP_WIDTH; i++) {
+		mask |= (unsigned)(g[i] == c) << i;
+	}
+
+	return mask;
+}
+
+static unsigned group_match_free(const unsigned char *g)
+{
+	unsigned mask = 0;
+	int i;
+
+	for (i = 0; i < GROUP_WIDTH; i++) {
+		mask |= (unsigned)(g[i] >> 7) << i;
+	}
+
+	return mask;
+}
+
+#endif /* SPN_HASHMAP_SSE2 */
+
+static unsigned group_match_empty(const unsigned char *g)
+{
+	return group_match(g, CTRL_EMPTY);
+}
+
+/* index of the lowest set bit in a non-zero mask */
+static int lowest_bit(unsigned mask)
+{
+#ifdef __GNUC__
+	return __builtin_ctz(mask);
+#else
+	int i = 0;
+
+	assert(mask != 0);
 
-	do {
-		if (spn_value_equal(&node->key, key)) {
-			return node;
+	while ((mask & 1) == 0) {
+		mask >>= 1;
+		i++;
+	}
+
+	return i;
+#endif /* __GNUC__ */
+}
+
+/* sets the control byte of bucket 'i', and its mirror, if any */
+static void set_ctrl(Table *table, size_t i, unsigned char c)
+{
+	table->ctrl[i] = c;
+
+	if (i < GROUP_WIDTH) {
+		table->ctrl[table->capacity + i] = c;
+	}
+}
+
+/* returns the index of the bucket of 'key', or -1 if not found */
+static long find_bucket(SpnHashMap *hm, Table *table, const SpnValue *key, unsigned long hash)
+{
+	size_t mask, pos, stride = 0;
+	unsigned char c = hash_ctrl(hash);
+
+	/* an empty map has no buckets at all */
+	if (table->capacity == 0) {
+		return -1;
+	}
+
+	mask = table->capacity - 1;
+	pos = hash & mask;
+
+	for (;;) {
+		const unsigned char *g = table->ctrl + pos;
+		unsigned match = group_match(g, c);
+
+		while (match != 0) {
+			size_t i = (pos + lowest_bit(match)) & mask;
+			Entry *entry = &hm->entries[table->buckets[i]];
+
+			if (entry->hash == hash && keys_equal(&entry->key, key)) {
+				return i;
+			}
+
+			match &= match - 1;
 		}
 
-		node = node->next;
-	} while (node != NULL);
+		if (group_match_empty(g) != 0) {
+			return -1;
+		}
 
-	return NULL;
+		stride += GROUP_WIDTH;
+		pos = (pos + stride) & mask;
+	}
 }
 
-/* This returns '&buckets[headidx]' itself if possible (i. e. if
- * that slot is empty), and searches for a nearby node otherwise.
- * Since we consistently enforce a load factor strictly less than 1
- * (namely, 1 / phi ~= 3 / 5), this search should NEVER, EVER fail.
- *
- * Note that here the load factor means the ratio of slots that
- * contain a key. After deleting some items, it may be the case that
- * this is more than the perceived size of the hash table, i. e. the
- * number of non-nil values, regardless of whether they correspond
- * to a key.
+/* returns the index of the first empty or deleted bucket
+ * in the probe sequence of 'hash'. There always is one.
  */
-static Bucket *find_next_empty(Bucket *buckets, size_t headidx, size_t allocsize)
+static size_t find_free_bucket(Table *table, unsigned long hash)
 {
-	size_t i = headidx, n = allocsize;
+	size_t mask = table->capacity - 1;
+	size_t pos = hash & mask;
+	size_t stride = 0;
 
-	assert(headidx < allocsize);
+	for (;;) {
+		unsigned match = group_match_free(table->ctrl + pos);
 
-	while (n--) {
-		Bucket *node = &buckets[i];
+		if (match != 0) {
+			return (pos + lowest_bit(match)) & mask;
+		}
+
+		stride += GROUP_WIDTH;
+		pos = (pos + stride) & mask;
+	}
+}
 
-		if (isnil(&node->key)) {
-			assert(isnil(&node->value));
-			assert(node->next == NULL);
-			return node;
+/* keys of shapes are compared by identity first, since
+ * they are usually the very same (constant) string objects.
+ * Shape keys are short, so a key of the same length can't be
+ * a rope, and it needn't be flattened.
+ */
+static int shape_key_equal(const SpnValue *shapekey, const SpnValue *key)
+{
+	SpnString *lhs = objvalue(shapekey);
+	SpnString *rhs = objvalue(key);
+
+	return lhs == rhs
+	    || (lhs->len == rhs->len && memcmp(lhs->cstr, rhs->cstr, lhs->len) == 0);
+}
+
+/* returns the slot index of 'key' in 'shape', or -1 if it's not there */
+static long shape_find_slot(Shape *shape, const SpnValue *key)
+{
+	if (!isstring(key)) {
+		return -1;
+	}
+
+	/* walk up the tree, towards the root */
+	while (shape->parent != NULL) {
+		if (shape_key_equal(&shape->key, key)) {
+			return shape->nslots - 1;
 		}
 
-		i++;
+		shape = shape->parent;
+	}
+
+	return -1;
+}
+
+/* returns the key occupying 'slot' in 'shape' */
+static SpnValue *shape_key_at(Shape *shape, size_t slot)
+{
+	assert(slot < shape->nslots);
+
+	while (shape->nslots > slot + 1) {
+		shape = shape->parent;
+	}
+
+	return &shape->key;
+}
+
+/* puts 'shape' into the first free place of its probe sequence */
+static void shapetree_insert(SpnShapeTree *tree, Shape *shape)
+{
+	size_t mask = tree->capacity - 1;
+	size_t i = shape->hash & mask;
+
+	while (tree->shapes[i] != NULL) {
+		i = (i + 1) & mask;
+	}
+
+	tree->shapes[i] = shape;
+}
+
+/* keeps the table of shapes at most half full */
+static void shapetree_grow(SpnShapeTree *tree)
+{
+	Shape **old = tree->shapes;
+	size_t oldcap = tree->capacity;
+	size_t i;
+
+	tree->capacity = oldcap ? 2 * oldcap : MIN_CAPACITY;
+	tree->shapes = spn_calloc(tree->capacity, sizeof tree->shapes[0]);
 
-		/* wrap around end of table */
-		if (i >= allocsize) {
-			i = 0;
+	for (i = 0; i < oldcap; i++) {
+		if (old[i] != NULL) {
+			shapetree_insert(tree, old[i]);
 		}
 	}
 
-	assert("No empty slot found, infinite loop detected! Fatal error" == 0);
-	return NULL;
+	free(old);
+}
+
+/* Returns the shape of 'shape' extended with 'key', or NULL if the
+ * transition can't be made (in which case a bucket table is needed).
+ * Creates the child shape if it doesn't exist yet.
+ */
+static Shape *shape_transition(SpnShapeTree *tree, Shape *shape, const SpnValue *key)
+{
+	unsigned long hash;
+	Shape *child;
+
+	if (!isstring(key)
+	 || ((SpnString *)objvalue(key))->len > SHAPE_MAX_KEYLEN
+	 || shape->nslots >= SHAPE_MAX_SLOTS) {
+		return NULL;
+	}
+
+	hash = mix_hash(shape->hash ^ spn_hash_value(key));
+
+	/* try to find an existing transition first */
+	if (tree->capacity > 0) {
+		size_t mask = tree->capacity - 1;
+		size_t i;
+
+		for (i = hash & mask; tree->shapes[i] != NULL; i = (i + 1) & mask) {
+			child = tree->shapes[i];
+
+			if (child->hash == hash
+			 && child->parent == shape
+			 && shape_key_equal(&child->key, key)) {
+				return child;
+			}
+		}
+	}
+
+	/* too polymorphic, or too many shapes overall */
+	if ((shape->parent != NULL && shape->nchildren >= SHAPE_MAX_CHILDREN)
+	 || tree->count >= SHAPE_MAX_COUNT) {
+		return NULL;
+	}
+
+	if (2 * (tree->count + 1) > tree->capacity) {
+		shapetree_grow(tree);
+	}
+
+	child = spn_malloc(sizeof *child);
+
+	spn_value_retain(key);
+	child->parent = shape;
+	child->key = *key;
+	child->nslots = shape->nslots + 1;
+	child->nchildren = 0;
+	child->hash = hash;
+
+	shapetree_insert(tree, child);
+	shape->nchildren++;
+	tree->count++;
+
+	return child;
+}
+
+long spn_hashmap_slot_index(SpnHashMap *hm, const SpnValue *key)
+{
+	return hm->shape != NULL ? shape_find_slot(hm->shape, key) : -1;
+}
+
+/* Returns the smallest capacity that holds 'n' keys at the maximal load */
+static size_t capacity_for(size_t n)
+{
+	size_t capacity = MIN_CAPACITY;
+
+	while (capacity - capacity / 8 < n) {
+		capacity *= 2;
+	}
+
+	return capacity;
+}
+
+/* Returns the number of keys removed from the table since it was built.
+ * Every bucket that is not empty is either full or a tombstone, and all
+ * full buckets (including the ones not migrated yet) have a value.
+ */
+static size_t deleted_count(SpnHashMap *hm)
+{
+	size_t capacity = hm->table.capacity;
+	return capacity - capacity / 8 - hm->growth_left - hm->valcount;
+}
+
+/* Searches the table, then the one being migrated, if any. Returns
+ * the index of the bucket of 'key', or -1 if not found. On success,
+ * '*table' is set to the table containing the bucket.
+ */
+static long lookup(SpnHashMap *hm, const SpnValue *key, unsigned long hash, Table **table)
+{
+	long index = find_bucket(hm, &hm->table, key, hash);
+
+	if (index >= 0) {
+		*table = &hm->table;
+		return index;
+	}
+
+	index = find_bucket(hm, &hm->old, key, hash);
+	*table = &hm->old;
+	return index;
 }
 
 SpnValue spn_hashmap_get(SpnHashMap *hm, const SpnValue *key)
 {
-	Bucket *head, *node;
-	size_t index;
-	size_t allocsize = sizes[hm->sizeindex];
+	Table *table;
+	long index;
 
-	/* avoid division by 0 - an empty map has no values anyway */
-	if (allocsize == 0) {
+	if (hm->shape != NULL) {
+		long slot = shape_find_slot(hm->shape, key);
+		return slot >= 0 ? hm->slots[slot] : spn_nilval;
+	}
+
+	/* avoid hashing the key if there's nothing to find anyway */
+	if (hm->valcount == 0) {
 		return spn_nilval;
 	}
 
-	/* compute hash and get candidate bucket */
-	index = spn_hash_value(key) % allocsize;
-	head = &hm->buckets[index]; /* not NULL */
-	node = find_key(head, key);
-	return node ? node->value : spn_nilval;
+	index = lookup(hm, key, mix_hash(spn_hash_value(key)), &table);
+	return index >= 0 ? hm->entries[table->buckets[index]].value : spn_nilval;
 }
 
 void spn_hashmap_set(SpnHashMap *hm, const SpnValue *key, const SpnValue *val)
 {
-	Bucket *bucket, *fresh, *home;
 	unsigned long hash;
-	size_t index;
+	Entry *entry;
+	Table *table;
+	long index;
+	size_t fresh;
 
 	assert(notnil(key));
 
-	/* Step 0: check degenerate cases and avoid division by 0 */
-	if (sizes[hm->sizeindex] == 0) {
-		/* inserting nil into an empty hash table is a no-op */
-		if (isnil(val)) {
+	/* modifying a class descriptor invalidates member lookup caches */
+	if (hm->is_class) {
+		SPN_ATOMIC_INC(&class_version);
+	}
+
+	/* try to keep the dense layout, if the hashmap has a shape */
+	if (hm->shape != NULL) {
+		if (shape_set(hm, key, val)) {
 			return;
 		}
 
-		/* else we will need to make room for the value */
-		expand_or_rehash(hm, 1);
+		/* the key doesn't fit into a shape, so go on with buckets */
+		shape_to_buckets(hm);
 	}
 
-	hash = spn_hash_value(key);
-	index = hash % sizes[hm->sizeindex];
+	hash = mix_hash(spn_hash_value(key));
+	index = lookup(hm, key, hash, &table);
 
-	/* Step 1: We search for a bucket that already contains the
-	 * key, becaue we need to replace the old value if it exists.
+	/* If the key is already in the table, then either
+	 * replace its value, or remove it if the new value is nil.
 	 */
-	bucket = find_key(&hm->buckets[index], key);
-
-	/* If key is already found in the table: */
-	if (bucket != NULL) {
-		/* check all possible cases:
-		 * 1. changing nil to nil is a no-op
-		 * 2. changing nil to non-nil means insertion
-		 * 3. changing non-nil to nil means removal
-		 * 4. changing non-nil to non-nil should be executed,
-		 *    but it doesn't affect the count of the values.
-		 *
-		 * The count of the keys is not changed here, though,
-		 * since we are re-using an existing key if possible.
-		 */
-		if (isnil(&bucket->value) && isnil(val)) {
-			return;
-		} else if (isnil(&bucket->value) && notnil(val)) {
-			hm->valcount++;
-		} else if (notnil(&bucket->value) && isnil(val)) {
+	if (index >= 0) {
+		entry = &hm->entries[table->buckets[index]];
+
+		if (isnil(val)) {
+			/* leave a hole in the entries, and a tombstone
+			 * in the table, so that probing goes on past it
+			 */
+			spn_value_release(&entry->key);
+			spn_value_release(&entry->value);
+			entry->key = spn_nilval;
+			entry->value = spn_nilval;
+			set_ctrl(table, index, CTRL_DELETED);
 			hm->valcount--;
+
+			/* holes at the end can be given back right away */
+			while (hm->nentries > 0 && isnil(&hm->entries[hm->nentries - 1].key)) {
+				hm->nentries--;
+			}
+
+			/* and so can all the memory, once the hashmap is empty */
+			if (hm->valcount == 0) {
+				release_storage(hm);
+			}
+
+			return;
 		}
 
 		/* don't touch key, just replace the value */
 		spn_value_retain(val);
-		spn_value_release(&bucket->value);
-		bucket->value = *val;
+		spn_value_release(&entry->value);
+		entry->value = *val;
 
 		return;
 	}
 
-	/* Step 2: If the key is not found, and the new value
+	/* If the key is not found, and the new value
 	 * is nil, we don't need to do anything at all.
 	 */
 	if (isnil(val)) {
 		return;
 	}
 
-	/* Step 3: Otherwise we'll need to insert it, so we increase
-	 * the counts and take ownership of the key and the value.
+	/* Otherwise we'll need to insert it. If most keys have been
+	 * removed from the table, it is shrunk first (see SHRINK_FACTOR).
 	 */
-	hm->keycount++;
-	hm->valcount++;
+	if (hm->table.capacity > MIN_CAPACITY
+	 && SHRINK_FACTOR * hm->valcount < hm->table.capacity
+	 && deleted_count(hm) > 0) {
+		size_t room = 2 * (hm->valcount + 1);
+		compact(hm, room, capacity_for(room));
+	}
+
+	/* If the array of entries is full, then it is grown,
+	 * unless it has a lot of holes, in which case they
+	 * are removed instead.
+	 */
+	if (hm->nentries == hm->entrycap) {
+		if (4 * (hm->nentries - hm->valcount) > hm->nentries) {
+			compact(hm, hm->entrycap, hm->table.capacity);
+		} else {
+			hm->entrycap = hm->entrycap ? 2 * hm->entrycap : MIN_ENTRIES;
+			hm->entries = spn_realloc(hm->entries, hm->entrycap * sizeof hm->entries[0]);
+		}
+	}
+
+	/* If there are no empty buckets left to use, then the table is
+	 * rebuilt: it is grown if it is more than half full, otherwise the
+	 * same capacity is enough, since getting rid of the tombstones frees
+	 * up plenty of buckets.
+	 */
+	if (hm->growth_left == 0) {
+		size_t newcap = hm->table.capacity;
+
+		if (newcap == 0) {
+			newcap = MIN_CAPACITY;
+		} else if (2 * hm->valcount >= newcap) {
+			newcap *= 2;
+		}
+
+		rehash(hm, newcap);
+	} else if (hm->old.capacity > 0) {
+		migrate(hm, MIGRATE_STEP);
+	}
+
+	fresh = find_free_bucket(&hm->table, hash);
+
+	/* reusing a tombstone doesn't use up an empty bucket */
+	if (hm->table.ctrl[fresh] == CTRL_EMPTY) {
+		hm->growth_left--;
+	}
 
 	spn_value_retain(key);
 	spn_value_retain(val);
 
-	/* When the load factor crosses 1 / phi (aka 5 / 8), we do
-	 * a complete rehash. If it's only the number of keys that
-	 * exceeded the maximal load factor, but the value count is
-	 * smaller than the maximal load factor, then the bucket
-	 * vector is not actually grown. Instead, the non-nil values
-	 * are reinserted into a table of the same size, freeing up
-	 * unused keys.
-	 *
-	 * If, however, the number of non-nil values is also greater
-	 * than the maximal load factor, then the array of vectors
-	 * is expanded before rehashing.
-	 *
-	 * This operation invalidates 'index' and 'hm->buckets'...
-	 */
-	if (8 * hm->keycount > 5 * sizes[hm->sizeindex]) {
-		expand_or_rehash(hm, 0);
+	entry = &hm->entries[hm->nentries];
+	entry->key = *key;
+	entry->value = *val;
+	entry->hash = hash;
+
+	hm->table.buckets[fresh] = hm->nentries++;
+	set_ctrl(&hm->table, fresh, hash_ctrl(hash));
+	hm->valcount++;
+}
+
+/* Returns nonzero if the key-value pair has been set,
+ * zero if the hashmap needs to be converted to buckets first.
+ */
+static int shape_set(SpnHashMap *hm, const SpnValue *key, const SpnValue *val)
+{
+	long slot = shape_find_slot(hm->shape, key);
+	Shape *next;
+
+	/* existing key: replace its value */
+	if (slot >= 0) {
+		SpnValue *value = &hm->slots[slot];
+
+		/* Removing a key gives up the shape. If its slot were kept,
+		 * the key would regain its old position when it's inserted
+		 * again, instead of coming last, as it does with buckets.
+		 * (Since slots are never nil, the entries made from them
+		 * have the same indices, so iteration cursors stay valid.)
+		 */
+		if (isnil(val)) {
+			return 0;
+		}
+
+		assert(notnil(value));
+
+		spn_value_retain(val);
+		spn_value_release(value);
+		*value = *val;
+
+		return 1;
 	}
 
-	/* ...so we just re-compute them after the reallocation. */
-	index = hash % sizes[hm->sizeindex];
-	home = &hm->buckets[index];
+	/* removing a nonexistent key is a no-op */
+	if (isnil(val)) {
+		return 1;
+	}
 
-	/* If the home position of the key is empty, we are done */
-	if (isnil(&home->key)) {
-		assert(isnil(&home->value));
-		assert(home->next == NULL);
+	next = shape_transition(hm->shapetree, hm->shape, key);
 
-		home->key = *key;
-		home->value = *val;
-		return;
+	if (next == NULL) {
+		return 0;
 	}
 
-	/* Else a collision happened, so we pick an empty/unused bucket
-	 * near 'index'. We then fill it in and link it into the chain.
-	 */
-	fresh = find_next_empty(hm->buckets, index, sizes[hm->sizeindex]);
-	assert(fresh != NULL);
-	assert(fresh != home); /* avoid accidental circular self-references */
-	assert(fresh->next == NULL);
-	assert(isnil(&fresh->key));
-	assert(isnil(&fresh->value));
+	/* make room for the new slot */
+	if (next->nslots > hm->slotcap) {
+		hm->slotcap = hm->slotcap ? 2 * hm->slotcap : 4;
+		hm->slots = spn_realloc(hm->slots, hm->slotcap * sizeof hm->slots[0]);
+	}
 
-	/* set key and value */
-	fresh->key = *key;
-	fresh->value = *val;
+	/* the new key is owned by the shape */
+	spn_value_retain(val);
+	hm->slots[next->nslots - 1] = *val;
+	hm->shape = next;
+	hm->valcount++;
 
-	/* Insert fresh bucket into 2nd place of list. */
-	fresh->next = home->next;
-	home->next = fresh;
+	return 1;
 }
 
-static void expand_or_rehash(SpnHashMap *hm, int always_expand)
+/* moves the contents of the slots into a freshly allocated bucket table */
+static void shape_to_buckets(SpnHashMap *hm)
 {
-	size_t oldsize, newsize, i;
-	Bucket *oldbuckets, *newbuckets;
+	Shape *shape = hm->shape;
+	SpnValue *slots = hm->slots;
+	size_t i;
 
-	oldsize = sizes[hm->sizeindex];
-	oldbuckets = hm->buckets;
+	assert(shape != NULL);
 
-	/* check if there are indeed more values than healthy,
-	 * or it is just that too many keys have been deleted
-	 */
-	if (8 * hm->valcount > 5 * oldsize || always_expand) {
-		hm->sizeindex++;
+	hm->shape = NULL;
+	hm->slots = NULL;
+	hm->slotcap = 0;
+	hm->valcount = 0;
 
-		if (hm->sizeindex >= COUNT(sizes)) {
-			spn_die("exceeded maximal size of hashmap");
-		}
+	for (i = 0; i < shape->nslots; i++) {
+		spn_hashmap_set(hm, shape_key_at(shape, i), &slots[i]);
+		spn_value_release(&slots[i]);
 	}
 
-	newsize = sizes[hm->sizeindex];
-	newbuckets = spn_malloc(newsize * sizeof newbuckets[0]);
+	free(slots);
 
-	/* the new bucket array starts out all empty */
-	for (i = 0; i < newsize; i++) {
-		newbuckets[i].key = spn_nilval;
-		newbuckets[i].value = spn_nilval;
-		newbuckets[i].next = NULL;
+	/* the keys are owned by the entries now */
+	spn_shapetree_release(hm->shapetree);
+	hm->shapetree = NULL;
+}
+
+/* Moves the next 'nbuckets' buckets of the old table into the new one,
+ * and frees the old table when it's done. Since the keys are known to be
+ * distinct, they are not compared, they are just put in the first free
+ * bucket of their probe sequence. The buckets they are moved out of become
+ * tombstones, so lookups in the old table still find the remaining keys.
+ */
+static void migrate(SpnHashMap *hm, size_t nbuckets)
+{
+	Table *old = &hm->old;
+	size_t end = hm->migrated + nbuckets;
+	size_t i;
+
+	if (end > old->capacity) {
+		end = old->capacity;
 	}
 
-	/* When expanding, our situation is a little bit better
-	 * than a full-fledged insert, since we know that we are
-	 * inserting into an empty table. Consequently, we don't
-	 * have to check for already-existing keys, since we
-	 * explicitly disallow duplicates during the insertion.
-	 * We don't need to check for nils either, because they
-	 * are trivially filtered out right within the loop.
-	 */
-	for (i = 0; i < oldsize; i++) {
-		size_t index;
-		Bucket *home, *bucket;
+	for (i = hm->migrated; i < end; i++) {
+		unsigned long hash;
+		size_t fresh;
 
-		if (isnil(&oldbuckets[i].key)) {
+		if (old->ctrl[i] >= CTRL_EMPTY) {
 			continue;
 		}
 
-		/* If the key exists, but the value is nil, then
-		 * the value is conceptually not in the hash table.
-		 * So we just relinquish ownership of the value
-		 * and continue.
-		 */
-		if (isnil(&oldbuckets[i].value)) {
-			spn_value_release(&oldbuckets[i].key);
-			continue;
+		hash = hm->entries[old->buckets[i]].hash;
+		fresh = find_free_bucket(&hm->table, hash);
+
+		hm->table.buckets[fresh] = old->buckets[i];
+		set_ctrl(&hm->table, fresh, hash_ctrl(hash));
+		set_ctrl(old, i, CTRL_DELETED);
+	}
+
+	hm->migrated = end;
+
+	if (end == old->capacity) {
+		free(old->buckets);
+		old->buckets = NULL;
+		old->ctrl = NULL;
+		old->capacity = 0;
+		hm->migrated = 0;
+	}
+}
+
+/* allocates an empty table with 'capacity' buckets */
+static void alloc_table(Table *table, size_t capacity)
+{
+	/* the control bytes are allocated right after the buckets */
+	if (capacity > ((size_t)(-1) - GROUP_WIDTH) / (sizeof table->buckets[0] + 1)) {
+		spn_die("exceeded maximal size of hashmap");
+	}
+
+	table->buckets = spn_malloc(capacity * sizeof table->buckets[0] + capacity + GROUP_WIDTH);
+	table->ctrl = (unsigned char *)(table->buckets + capacity);
+	table->capacity = capacity;
+
+	memset(table->ctrl, CTRL_EMPTY, capacity + GROUP_WIDTH);
+}
+
+/* Starts moving all buckets into a new table of capacity 'newcap'.
+ * Small tables are migrated at once, big ones incrementally (see above).
+ */
+static void rehash(SpnHashMap *hm, size_t newcap)
+{
+	assert(newcap >= MIN_CAPACITY && (newcap & (newcap - 1)) == 0);
+
+	/* the previous migration must be completed first */
+	if (hm->old.capacity > 0) {
+		migrate(hm, hm->old.capacity);
+	}
+
+	hm->old = hm->table;
+	hm->migrated = 0;
+
+	alloc_table(&hm->table, newcap);
+
+	/* room is reserved for all the keys that are still to be migrated */
+	hm->growth_left = newcap - newcap / 8 - hm->valcount;
+
+	if (hm->old.capacity < INCREMENTAL_MIN_CAPACITY) {
+		migrate(hm, hm->old.capacity);
+	}
+}
+
+/* Removes the holes from the array of entries, preserving the order of
+ * the rest, and reallocates it with room for 'entrycap' entries. This
+ * changes the indices of the entries, so the table is rebuilt from scratch,
+ * with 'capacity' buckets, which may be less than the current capacity.
+ */
+static void compact(SpnHashMap *hm, size_t entrycap, size_t capacity)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < hm->nentries; i++) {
+		if (notnil(&hm->entries[i].key)) {
+			hm->entries[n++] = hm->entries[i];
 		}
+	}
 
-		/* find slot for new key-value pair */
-		index = spn_hash_value(&oldbuckets[i].key) % newsize;
-		home = &newbuckets[index];
+	assert(n == hm->valcount);
+	assert(n <= entrycap && n <= capacity - capacity / 8);
 
-		/* if it's empty yet, we insert it and we're done */
-		if (isnil(&home->key)) {
-			assert(isnil(&home->value));
-			assert(home->next == NULL);
+	hm->nentries = n;
 
-			home->key   = oldbuckets[i].key;
-			home->value = oldbuckets[i].value;
-			continue;
+	if (entrycap != hm->entrycap) {
+		hm->entrycap = entrycap;
+		hm->entries = spn_realloc(hm->entries, hm->entrycap * sizeof hm->entries[0]);
+	}
+
+	free(hm->old.buckets);
+	hm->old.buckets = NULL;
+	hm->old.ctrl = NULL;
+	hm->old.capacity = 0;
+	hm->migrated = 0;
+
+	if (capacity == hm->table.capacity) {
+		memset(hm->table.ctrl, CTRL_EMPTY, capacity + GROUP_WIDTH);
+	} else {
+		free(hm->table.buckets);
+		alloc_table(&hm->table, capacity);
+	}
+
+	hm->growth_left = capacity - capacity / 8 - n;
+
+	for (i = 0; i < n; i++) {
+		unsigned long hash = hm->entries[i].hash;
+		size_t fresh = find_free_bucket(&hm->table, hash);
+
+		hm->table.buckets[fresh] = i;
+		set_ctrl(&hm->table, fresh, hash_ctrl(hash));
+	}
+}
+
+/* frees the entries and the tables of a hashmap that has no keys */
+static void release_storage(SpnHashMap *hm)
+{
+	assert(hm->valcount == 0 && hm->nentries == 0);
+
+	free(hm->entries);
+	free(hm->table.buckets);
+	free(hm->old.buckets);
+
+	hm->entries = NULL;
+	hm->entrycap = 0;
+	hm->growth_left = 0;
+	hm->table.buckets = NULL;
+	hm->table.ctrl = NULL;
+	hm->table.capacity = 0;
+	hm->old = hm->table;
+	hm->migrated = 0;
+}
+
+void spn_hashmap_compact(SpnHashMap *hm)
+{
+	if (hm->shape != NULL) {
+		if (hm->slotcap > hm->shape->nslots) {
+			hm->slotcap = hm->shape->nslots;
+			hm->slots = spn_realloc(hm->slots, hm->slotcap * sizeof hm->slots[0]);
+		}
+
+		return;
+	}
+
+	if (hm->valcount == 0) {
+		hm->nentries = 0;
+		release_storage(hm);
+		return;
+	}
+
+	compact(hm, hm->valcount, capacity_for(hm->valcount));
+}
+
+void spn_hashmap_reserve(SpnHashMap *hm, size_t n)
+{
+	size_t needed, newcap;
+
+	if (hm->shape != NULL) {
+		if (n <= SHAPE_MAX_SLOTS) {
+			if (n > hm->slotcap) {
+				hm->slotcap = n;
+				hm->slots = spn_realloc(hm->slots, hm->slotcap * sizeof hm->slots[0]);
+			}
+
+			return;
 		}
 
-		/* else we find a nearby empty slot and link it into the list */
-		bucket = find_next_empty(newbuckets, index, newsize);
+		/* that many keys wouldn't fit into a shape anyway */
+		shape_to_buckets(hm);
+	}
 
-		assert(bucket != NULL);
-		assert(bucket != home); /* avoid circular references */
-		assert(bucket->next == NULL);
-		assert(isnil(&bucket->key));
-		assert(isnil(&bucket->value));
+	if (n <= hm->valcount) {
+		return;
+	}
 
-		/* perform insertion, no fiddling with ownership needed */
-		bucket->key   = oldbuckets[i].key;
-		bucket->value = oldbuckets[i].value;
+	/* If keys have been removed, the next insertion might shrink the
+	 * table (see SHRINK_FACTOR), undoing the reservation. So the holes
+	 * and the tombstones are cleared out right away instead.
+	 */
+	if (hm->nentries > hm->valcount || deleted_count(hm) > 0) {
+		compact(hm, n, capacity_for(n));
+		return;
+	}
+
+	needed = hm->nentries + (n - hm->valcount);
 
-		/* link it in */
-		bucket->next = home->next;
-		home->next = bucket;
+	if (needed > hm->entrycap) {
+		hm->entrycap = needed;
+		hm->entries = spn_realloc(hm->entries, hm->entrycap * sizeof hm->entries[0]);
 	}
 
-	hm->keycount = hm->valcount;
-	hm->buckets = newbuckets;
-	free(oldbuckets);
+	newcap = capacity_for(n);
+
+	if (newcap > hm->table.capacity) {
+		rehash(hm, newcap);
+	}
+}
+
+size_t spn_hashmap_capacity(SpnHashMap *hm)
+{
+	size_t room;
+
+	if (hm->shape != NULL) {
+		return hm->slotcap;
+	}
+
+	room = hm->entrycap - hm->nentries;
+	return hm->valcount + (hm->growth_left < room ? hm->growth_left : room);
 }
 
 void spn_hashmap_delete(SpnHashMap *hm, const SpnValue *key)
@@ -427,9 +1164,7 @@ SpnValue spn_hashmap_get_strkey(SpnHashMap *hm, const char *key)
 {
 	SpnString key_str = spn_string_emplace_nonretained_for_hashmap(key);
 
-	SpnValue key_val;
-	key_val.type = SPN_TYPE_STRING;
-	key_val.v.o = &key_str;
+	SpnValue key_val = spn_makeobject(SPN_TYPE_STRING, &key_str);
 
 	return spn_hashmap_get(hm, &key_val);
 }
@@ -443,15 +1178,27 @@ void spn_hashmap_set_strkey(SpnHashMap *hm, const char *key, const SpnValue *val
 
 size_t spn_hashmap_next(SpnHashMap *hm, size_t cursor, SpnValue *key, SpnValue *val)
 {
-	size_t size = sizes[hm->sizeindex];
 	size_t i;
 
-	for (i = cursor; i < size; i++) {
-		Bucket *bucket = &hm->buckets[i];
+	if (hm->shape != NULL) {
+		for (i = cursor; i < hm->shape->nslots; i++) {
+			if (notnil(&hm->slots[i])) {
+				*key = *shape_key_at(hm->shape, i);
+				*val = hm->slots[i];
+				return i + 1;
+			}
+		}
+
+		return 0;
+	}
+
+	/* entries are enumerated in insertion order, skipping holes */
+	for (i = cursor; i < hm->nentries; i++) {
+		Entry *entry = &hm->entries[i];
 
-		if (notnil(&bucket->value)) {
-			*key = bucket->key;
-			*val = bucket->value;
+		if (notnil(&entry->key)) {
+			*key = entry->key;
+			*val = entry->value;
 			return i + 1;
 		}
 	}
@@ -16,8 +16,21 @@
 #include "api.h"
 
 typedef struct SpnHashMap SpnHashMap;
+typedef struct SpnShapeTree SpnShapeTree;
 
 SPN_API SpnHashMap *spn_hashmap_new(void);
+
+/* creates a hashmap which takes its shapes (see below) from 'tree'.
+ * Hashmaps created by spn_hashmap_new() never have a shape.
+ */
+SPN_API SpnHashMap *spn_hashmap_new_shaped(SpnShapeTree *tree);
+
+/* A shape tree is reference counted: new() returns a tree with a reference
+ * count of 1, and every hashmap that has a shape from it owns it as well.
+ * Each virtual machine has one, for the objects created by its programs.
+ */
+SPN_API SpnShapeTree *spn_shapetree_new(void);
+SPN_API void spn_shapetree_release(SpnShapeTree *tree);
 SPN_API size_t spn_hashmap_count(SpnHashMap *hm);
 
 /* get() affects neither the ownership of the key nor
@@ -26,6 +39,25 @@ SPN_API size_t spn_hashmap_count(SpnHashMap *hm);
 SPN_API SpnValue spn_hashmap_get(SpnHashMap *hm, const SpnValue *key);
 SPN_API void spn_hashmap_set(SpnHashMap *hm, const SpnValue *key, const SpnValue *val);
 
+/* makes room for at least 'n' keys in total, so that they can be
+ * inserted without the hashmap being reallocated or rehashed.
+ */
+SPN_API void spn_hashmap_reserve(SpnHashMap *hm, size_t n);
+
+/* the number of keys the hashmap can hold without being reallocated or
+ * rehashed, provided that no keys are removed in the meantime
+ */
+SPN_API size_t spn_hashmap_capacity(SpnHashMap *hm);
+
+/* Gives back the memory that is not needed for the current keys: squeezes
+ * out the holes left behind by removed keys and shrinks the table to fit.
+ * Hashmaps also shrink automatically when keys are inserted after most of
+ * them have been removed, and free all their storage when they become
+ * empty, so this is only needed for trimming a hashmap that is done being
+ * modified. Don't call it while enumerating the keys with next().
+ */
+SPN_API void spn_hashmap_compact(SpnHashMap *hm);
+
 /* a synonym for set(hm, key, nil) */
 SPN_API void spn_hashmap_delete(SpnHashMap *hm, const SpnValue *key);
 
@@ -38,11 +70,40 @@ SPN_API void spn_hashmap_set_strkey(SpnHashMap *hm, const char *key, const SpnVa
  * keys and values to enumerate. Sets *key and *val to next key and value,
  * respectively, except when 0 is returned in which case *key and *val are
  * not modified. Ownership of key and value is not touched.
+ * Keys are enumerated in the order they were inserted in. (A key that is
+ * removed and then inserted again counts as a new key, so it comes last.)
+ * Keys may be removed while they are being enumerated, but not inserted.
  */
 SPN_API size_t spn_hashmap_next(SpnHashMap *hm, size_t cursor, SpnValue *key, SpnValue *val);
 
+/* The virtual machine caches the results of member lookups. In order for
+ * it to be able to detect stale cache entries, the hashmaps involved in
+ * the lookup (class descriptors, mostly) are marked using this function.
+ * Modifying or freeing a marked hashmap increments a global version number,
+ * which can be queried using spn_hashmap_class_version(). The version number
+ * is shared by all contexts (it's updated atomically, so they may live in
+ * different threads).
+ */
+SPN_API void spn_hashmap_mark_class(SpnHashMap *hm);
+SPN_API unsigned long spn_hashmap_class_version(void);
+
+/* Hashmaps with a few short string keys only may have a shape, which is
+ * shared by all hashmaps of the same shape tree having the same keys (added
+ * in the same order), and they store their values in slots.
+ * spn_hashmap_shape() returns an opaque token which identifies the shape,
+ * or NULL if the hashmap doesn't have one.
+ * spn_hashmap_slot_index() returns the index of the slot of 'key', or -1
+ * if there's no shape or the key isn't in it. The index of a key is the
+ * same in every hashmap with the same shape, so it can be cached, and the
+ * value can be fetched using spn_hashmap_slot_get() later. (The returned
+ * value is not retained, just like with spn_hashmap_get().)
+ */
+SPN_API const void *spn_hashmap_shape(SpnHashMap *hm);
+SPN_API long spn_hashmap_slot_index(SpnHashMap *hm, const SpnValue *key);
+SPN_API SpnValue spn_hashmap_slot_get(SpnHashMap *hm, long slot);
+
 SPN_API SpnValue spn_makehashmap(void);
 
-#define spn_hashmapvalue(val) ((SpnHashMap *)((val)->v.o))
+#define spn_hashmapvalue(val) ((SpnHashMap *)spn_objvalue(val))
 
 #endif /* SPN_HASHMAP_H */
@@ -282,9 +282,7 @@ static SpnHashMap *ast_new(const char *type, SpnSourceLocation loc)
  */
 static void ast_set_child_xfer(SpnHashMap *node, const char *key, SpnHashMap *child)
 {
-	SpnValue val;
-	val.type = SPN_TYPE_HASHMAP;
-	val.v.o = child;
+	SpnValue val = spn_makeobject(SPN_TYPE_HASHMAP, child);
 
 	ast_set_property(node, key, &val);
 	spn_object_release(child);
@@ -307,9 +305,7 @@ static void ast_push_child_xfer(SpnHashMap *node, SpnHashMap *child)
 {
 	SpnArray *children = ast_get_children(node);
 
-	SpnValue vchild;
-	vchild.type = SPN_TYPE_HASHMAP;
-	vchild.v.o = child;
+	SpnValue vchild = spn_makeobject(SPN_TYPE_HASHMAP, child);
 
 	spn_array_push(children, &vchild);
 	spn_object_release(child);
@@ -512,8 +508,7 @@ static SpnHashMap *parse_function(SpnParser *p)
 		return NULL;
 	}
 
-	declargsval.type = SPN_TYPE_ARRAY;
-	declargsval.v.o = declargs;
+	declargsval = spn_makeobject(SPN_TYPE_ARRAY, declargs);
 
 	/* Parse function body */
 	arrow = accept_token_string(p, "->");
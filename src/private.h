@@ -16,6 +16,7 @@
 
 #include "api.h"
 #include "str.h"
+#include "array.h"
 
 #if USE_DYNAMIC_LOADING
 	#ifdef _WIN32
@@ -111,6 +112,9 @@
 /* this is a common function so that the disassembler can use it too */
 SPN_API int nth_arg_idx(spn_uword *ip, int idx);
 
+/* the same as a macro, for the hot paths of the virtual machine */
+#define NTH_ARG_IDX(ip, idx) ((int)(((ip)[(idx) / SPN_WORD_OCTETS] >> 8 * ((idx) % SPN_WORD_OCTETS)) & 0xff))
+
 /* "safe" allocator functions */
 SPN_API void *spn_malloc(size_t n);
 SPN_API void *spn_realloc(void *p, size_t n);
@@ -128,6 +132,30 @@ __attribute__((__noreturn__, __format__(__printf__, 1, 0)))
 #endif /* __GNUC__ */
 SPN_API void spn_diev(const char *fmt, va_list args);
 
+/* The little state that is shared by all virtual machines in the process
+ * (e. g. counters and the object allocator) is accessed atomically, or
+ * under a spin lock, since separate contexts may be used from separate
+ * threads. The atomic builtins of GCC and Clang are used if available;
+ * otherwise these fall back to plain, non-atomic code, and contexts must
+ * not be used concurrently. Spin locks are only held for a few
+ * instructions, and they must not be acquired recursively.
+ */
+typedef unsigned char SpnSpinLock;
+
+#if defined(__GNUC__) && defined(__ATOMIC_ACQUIRE)
+#define SPN_ATOMIC_INC(p)      __atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+#define SPN_ATOMIC_LOAD(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define SPN_ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define SPN_SPIN_LOCK(l)       do { while (__atomic_test_and_set((l), __ATOMIC_ACQUIRE)) {} } while (0)
+#define SPN_SPIN_UNLOCK(l)     __atomic_clear((l), __ATOMIC_RELEASE)
+#else /* __GNUC__ && __ATOMIC_ACQUIRE */
+#define SPN_ATOMIC_INC(p)      (++*(p))
+#define SPN_ATOMIC_LOAD(p)     (*(p))
+#define SPN_ATOMIC_STORE(p, v) (*(p) = (v))
+#define SPN_SPIN_LOCK(l)       ((void)(l))
+#define SPN_SPIN_UNLOCK(l)     ((void)(l))
+#endif /* __GNUC__ && __ATOMIC_ACQUIRE */
+
 /* this is a helper class for the virtual machine,
  * used for representing a pending (unresolved) symbol
  * "stub" in the local symbol table.
@@ -144,7 +172,26 @@ SPN_API SpnValue make_symstub(const char *name);
 SPN_API int is_symstub(const SpnValue *val);
 
 /* yields the symbol stub object of an SpnValue */
-#define symstubvalue(val) ((SymbolStub *)((val)->v.o))
+#define symstubvalue(val) ((SymbolStub *)spn_objvalue(val))
+
+/* The layout of arrays. It's here and not in array.c only because the
+ * virtual machine accesses the elements of packed arrays directly.
+ */
+struct SpnArray {
+	SpnObject base;        /* for being a valid object          */
+	union {
+		SpnValue      *values; /* SPN_ARRAY_VALUES              */
+		long          *ints;   /* SPN_ARRAY_INTS                */
+		double        *floats; /* SPN_ARRAY_FLOATS              */
+		unsigned char *bytes;  /* SPN_ARRAY_BYTES               */
+		void          *raw;
+	} vector;              /* the actual raw array of elements  */
+	size_t    count;       /* logical size                      */
+	size_t    allocsize;   /* allocation (actual) size          */
+	enum spn_array_kind kind;
+	SpnArray *owner;       /* non-NULL if the elements are borrowed
+	                        * from it, see spn_array_slice()    */
+};
 
 /* Dynamic loading support */
 
@@ -974,8 +974,7 @@ static int rtlb_split(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 
 	arr = spn_array_new();
 
-	ret->type = SPN_TYPE_ARRAY;
-	ret->v.o = arr;
+	*ret = spn_makeobject(SPN_TYPE_ARRAY, arr);
 
 	s = haystack->cstr;
 	t = strstr(s, needle->cstr);
@@ -984,12 +983,8 @@ static int rtlb_split(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		SpnValue val;
 		const char *p = t ? t : haystack->cstr + haystack->len;
 		size_t len = p - s;
-		char *buf = spn_malloc(len + 1);
 
-		memcpy(buf, s, len);
-		buf[len] = 0;
-
-		val = makestring_nocopy_len(buf, len, 1);
+		val = makestring_len(s, len);
 		spn_array_push(arr, &val);
 		spn_value_release(&val);
 
@@ -1111,8 +1106,7 @@ static int rtlb_format(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	res = spn_string_format_obj(fmt, argc - 1, &argv[1], &errmsg);
 
 	if (res != NULL) {
-		ret->type = SPN_TYPE_STRING;
-		ret->v.o = res;
+		*ret = spn_makeobject(SPN_TYPE_STRING, res);
 	} else {
 		const void *args[1];
 		args[0] = errmsg;
@@ -1146,524 +1140,679 @@ static void loadlib_string(SpnVMachine *vm)
  * Array library *
  *****************/
 
-/* The following functions realize an optimized in-place quicksort.
- * Most of this has been transliterated from Wikipedia's
- * pseudo-code at https://en.wikipedia.org/wiki/Quicksort
+/* sort() is a stable, adaptive merge sort (TimSort) which works in place
+ * on the raw storage of the array. Natural runs are detected and extended
+ * to a minimal length using binary insertion sort, then merged from a
+ * stack of pending runs whose lengths are kept in a Fibonacci-like
+ * progression, so the stack stays shallow and no recursion is needed.
+ * Presorted (and reverse-sorted) input is recognized as a single run,
+ * costing only n - 1 comparisons.
+ *
+ * When merging, if one run keeps supplying the next element, the merge
+ * switches to galloping mode: it finds the number of elements to take
+ * from that run using exponential search, then moves them at once. This
+ * makes merging runs which barely overlap take a logarithmic number of
+ * comparisons. Whether galloping pays off is learned on the fly: the
+ * threshold for entering galloping mode ('min_gallop') is lowered every
+ * time galloping succeeds, and raised every time it doesn't.
+ *
+ * The comparison is performed through a 'less' callback, which returns
+ * 1 or 0 -- or -1 if a user-supplied comparator failed. In that case,
+ * the sort stops, but every in-progress merge is completed by copying,
+ * so that the storage is still a permutation of the original elements.
  */
-static void rtlb_aux_swap(SpnArray *a, int i, int j)
-{
-	SpnValue x = spn_array_get(a, i);
-	SpnValue y = spn_array_get(a, j);
+#define SORT_MIN_MERGE 32
+#define SORT_MIN_GALLOP 7
+#define SORT_MAX_RUNS 85 /* enough for 2^64 elements */
+#define SORT_STACKBUF 4096
+
+typedef struct SortState SortState;
+
+struct SortState {
+	char *base;                 /* first element                */
+	size_t size;                /* size of one element          */
+	int (*less)(SortState *, const void *, const void *);
+	SpnFunction *comp;          /* user comparator, or NULL     */
+	SpnContext *ctx;
+	enum spn_array_kind kind;   /* how to box elements for comp */
+	int error;
+	size_t min_gallop;          /* see the comment above        */
 
-	spn_value_retain(&x);
-	spn_array_set(a, i, &y);
-	spn_array_set(a, j, &x);
-	spn_value_release(&x);
-}
+	char *tmp;                  /* merge buffer                 */
+	size_t tmpcap;              /* in elements                  */
+	union {
+		SpnValue v;
+		double f;
+		long i;
+		char buf[SORT_STACKBUF];
+	} stackbuf;
 
-static int rtlb_aux_partition(SpnArray *a, int left, int right,
-	SpnFunction *comp, SpnContext *ctx, int *error)
-{
-	int store_idx = left;
-	int pivot_idx = left + (right - left) / 2;
-	int i;
+	size_t nruns;
+	size_t runbase[SORT_MAX_RUNS];
+	size_t runlen[SORT_MAX_RUNS];
+};
+
+#define SORT_ELEM(s, i) ((s)->base + (i) * (s)->size)
 
-	SpnValue pivot = spn_array_get(a, pivot_idx);
+static int sort_less_int(SortState *s, const void *a, const void *b)
+{
+	return *(const long *)a < *(const long *)b;
+}
 
-	rtlb_aux_swap(a, pivot_idx, right);
+static int sort_less_float(SortState *s, const void *a, const void *b)
+{
+	return *(const double *)a < *(const double *)b;
+}
 
-	for (i = left; i < right; i++) {
-		int lessthan;
-		SpnValue ith_elem = spn_array_get(a, i);
+static int sort_less_byte(SortState *s, const void *a, const void *b)
+{
+	return *(const unsigned char *)a < *(const unsigned char *)b;
+}
 
-		/* compare pivot to i-th element */
-		if (comp != NULL) {
-			SpnValue ret;
-			SpnValue argv[2];
-			argv[0] = ith_elem;
-			argv[1] = pivot;
+static int sort_less_intvalue(SortState *s, const void *a, const void *b)
+{
+	return intvalue((const SpnValue *)a) < intvalue((const SpnValue *)b);
+}
 
-			if (spn_ctx_callfunc(ctx, comp, &ret, 2, argv) != 0) {
-				*error = 1;
-				return 0;
-			}
+/* NaN is neither less nor greater than anything, as with spn_value_compare() */
+static int sort_less_floatvalue(SortState *s, const void *a, const void *b)
+{
+	return floatvalue((const SpnValue *)a) < floatvalue((const SpnValue *)b);
+}
 
-			if (!isbool(&ret)) {
-				spn_ctx_runtime_error(ctx, "comparator function must return a Boolean", NULL);
-				spn_value_release(&ret);
-				*error = 1;
-				return 0;
-			}
+/* all strings are flattened before sorting, so 'cstr' is valid */
+static int sort_less_strvalue(SortState *s, const void *a, const void *b)
+{
+	SpnString *lhs = objvalue((const SpnValue *)a);
+	SpnString *rhs = objvalue((const SpnValue *)b);
+	size_t minlen = lhs->len < rhs->len ? lhs->len : rhs->len;
+	int res = memcmp(lhs->cstr, rhs->cstr, minlen);
 
-			lessthan = boolvalue(&ret);
-		} else {
-			if (!spn_values_comparable(&ith_elem, &pivot)) {
-				const void *args[2];
-				args[0] = spn_type_name(ith_elem.type);
-				args[1] = spn_type_name(pivot.type);
-
-				spn_ctx_runtime_error(
-					ctx,
-					"attempt to sort uncomparable values"
-					" of type %s and %s",
-					args
-				);
-
-				*error = 1;
-				return 0;
-			}
+	return res < 0 || (res == 0 && lhs->len < rhs->len);
+}
 
-			lessthan = spn_value_compare(&ith_elem, &pivot) < 0;
-		}
+/* mixed numbers, or objects of a class with a 'compare' function */
+static int sort_less_value(SortState *s, const void *a, const void *b)
+{
+	return spn_value_compare(a, b) < 0;
+}
 
-		if (lessthan) {
-			rtlb_aux_swap(a, i, store_idx++);
-		}
+static SpnValue sort_box(SortState *s, const void *p)
+{
+	switch (s->kind) {
+	case SPN_ARRAY_VALUES:  return *(const SpnValue *)p;
+	case SPN_ARRAY_INTS:    return makeint(*(const long *)p);
+	case SPN_ARRAY_FLOATS:  return makefloat(*(const double *)p);
+	case SPN_ARRAY_BYTES:   return makeint(*(const unsigned char *)p);
+	default:                SHANT_BE_REACHED();
 	}
 
-	rtlb_aux_swap(a, store_idx, right);
-	return store_idx;
+	return spn_nilval;
 }
 
-static int rtlb_aux_qsort(SpnArray *a, int left, int right, SpnFunction *comp, SpnContext *ctx)
+static int sort_less_callback(SortState *s, const void *a, const void *b)
 {
-	int pivot_index;
-	int error = 0;
-
-	if (left >= right) {
-		return 0;
-	}
+	SpnValue ret;
+	SpnValue argv[2];
 
-	pivot_index = rtlb_aux_partition(a, left, right, comp, ctx, &error);
-	if (error) {
-		return -1;
-	}
+	argv[0] = sort_box(s, a);
+	argv[1] = sort_box(s, b);
 
-	if (rtlb_aux_qsort(a, left, pivot_index - 1, comp, ctx) != 0) {
+	if (spn_ctx_callfunc(s->ctx, s->comp, &ret, 2, argv) != 0) {
 		return -1;
 	}
 
-	if (rtlb_aux_qsort(a, pivot_index + 1, right, comp, ctx) != 0) {
+	if (!isbool(&ret)) {
+		spn_ctx_runtime_error(s->ctx, "comparator function must return a Boolean", NULL);
+		spn_value_release(&ret);
 		return -1;
 	}
 
-	return 0;
+	return boolvalue(&ret);
 }
 
-static int rtlb_sort(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+/* wraps the 'less' callback: latches the first error, and reports
+ * every comparison as "not less" from then on.
+ */
+static int sort_lt(SortState *s, const void *a, const void *b)
 {
-	SpnArray *array;
-	SpnFunction *comparator = NULL;
+	int res;
 
-	if (argc < 1 || argc > 2) {
-		spn_ctx_runtime_error(ctx, "one or two arguments are required", NULL);
-		return -1;
+	if (s->error) {
+		return 0;
 	}
 
-	if (!isarray(&argv[0])) {
-		spn_ctx_runtime_error(ctx, "first argument must be an array", NULL);
-		return -2;
+	res = s->less(s, a, b);
+	if (res < 0) {
+		s->error = 1;
+		return 0;
 	}
 
-	array = arrayvalue(&argv[0]);
+	return res;
+}
 
-	if (argc == 2) {
-		if (!isfunc(&argv[1])) {
-			spn_ctx_runtime_error(ctx, "second argument must be a comparator function", NULL);
-			return -3;
-		}
+static void sort_reverse(SortState *s, size_t lo, size_t hi)
+{
+	char tmp[sizeof(SpnValue)];
 
-		comparator = funcvalue(&argv[1]);
+	while (lo + 1 < hi) {
+		hi--;
+		memcpy(tmp, SORT_ELEM(s, lo), s->size);
+		memcpy(SORT_ELEM(s, lo), SORT_ELEM(s, hi), s->size);
+		memcpy(SORT_ELEM(s, hi), tmp, s->size);
+		lo++;
 	}
-
-	return rtlb_aux_qsort(array, 0, spn_array_count(array) - 1, comparator, ctx);
 }
 
-static int rtlb_join(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+/* Returns the length of the run starting at 'lo'. Strictly descending
+ * runs are reversed (strictness is required for stability).
+ */
+static size_t sort_count_run(SortState *s, size_t lo, size_t hi)
 {
-	size_t n, i, len = 0;
-	char *buf = NULL;
-	SpnArray *arr;
-	SpnString *delim;
+	size_t i = lo + 1;
 
-	if (argc != 2) {
-		spn_ctx_runtime_error(ctx, "exactly two arguments are required", NULL);
-		return -1;
+	if (i == hi) {
+		return 1;
 	}
 
-	if (!isarray(&argv[0])) {
-		spn_ctx_runtime_error(ctx, "first argument must be an array", NULL);
-		return -2;
-	}
+	if (sort_lt(s, SORT_ELEM(s, i), SORT_ELEM(s, lo))) {
+		i++;
+		while (i < hi && sort_lt(s, SORT_ELEM(s, i), SORT_ELEM(s, i - 1))) {
+			i++;
+		}
 
-	if (!isstring(&argv[1])) {
-		spn_ctx_runtime_error(ctx, "second argument must be a string", NULL);
-		return -2;
+		sort_reverse(s, lo, i);
+	} else {
+		i++;
+		while (i < hi && !sort_lt(s, SORT_ELEM(s, i), SORT_ELEM(s, i - 1))) {
+			i++;
+		}
 	}
 
-	arr = arrayvalue(&argv[0]);
-	n = spn_array_count(arr);
+	return i - lo;
+}
 
-	delim = stringvalue(&argv[1]);
+/* sorts [lo, hi) given that [lo, start) is already sorted */
+static void sort_binary_insertion(SortState *s, size_t lo, size_t hi, size_t start)
+{
+	char pivot[sizeof(SpnValue)];
 
-	for (i = 0; i < n; i++) {
-		size_t addlen;
-		SpnString *str;
-		SpnValue val = spn_array_get(arr, i);
+	for (; start < hi; start++) {
+		size_t left = lo, right = start;
 
-		if (!isstring(&val)) {
-			free(buf);
-			spn_ctx_runtime_error(ctx, "array must contain strings only", NULL);
-			return -3;
+		memcpy(pivot, SORT_ELEM(s, start), s->size);
+
+		/* find the rightmost position at which 'pivot' can be inserted */
+		while (left < right) {
+			size_t mid = left + (right - left) / 2;
+			if (sort_lt(s, pivot, SORT_ELEM(s, mid))) {
+				right = mid;
+			} else {
+				left = mid + 1;
+			}
 		}
 
-		/* XXX: this should really be solved using
-		 * exponential buffer expansion. Maybe in alpha 2...
-		 */
+		if (s->error) {
+			return;
+		}
 
-		str = stringvalue(&val);
-		addlen = i > 0 ? delim->len + str->len : str->len;
+		memmove(SORT_ELEM(s, left + 1), SORT_ELEM(s, left), (start - left) * s->size);
+		memcpy(SORT_ELEM(s, left), pivot, s->size);
+	}
+}
 
-		buf = spn_realloc(buf, len + addlen + 1);
+/* whether 'elem' goes before 'key': if it's less than or equal
+ * to 'key' (or strictly less, if 'strict' is nonzero)
+ */
+static int sort_goes_left(SortState *s, const void *key, const void *elem, int strict)
+{
+	return strict ? sort_lt(s, elem, key) : !sort_lt(s, key, elem);
+}
 
-		if (i > 0) {
-			memcpy(buf + len, delim->cstr, delim->len);
-			memcpy(buf + len + delim->len, str->cstr, str->len);
-		} else {
-			memcpy(buf + len, str->cstr, str->len);
+/* Number of leading elements of 'a' which go before 'key' (see above).
+ * The answer is first bracketed using exponential search, starting at
+ * the beginning of 'a', or at its end if 'from_right' is nonzero, then
+ * found using binary search. This takes O(log k) comparisons if the
+ * answer is k elements away from the starting point.
+ */
+static size_t sort_gallop(SortState *s, const void *key, const char *a, size_t n, int strict, int from_right)
+{
+	size_t left, right, last = 0, ofs = 1;
+
+	if (from_right) {
+		while (ofs <= n && !sort_goes_left(s, key, a + (n - ofs) * s->size, strict)) {
+			last = ofs;
+			ofs = 2 * ofs + 1;
 		}
 
-		len += addlen;
-	}
+		left = ofs <= n ? n - ofs + 1 : 0;
+		right = n - last;
+	} else {
+		while (ofs <= n && sort_goes_left(s, key, a + (ofs - 1) * s->size, strict)) {
+			last = ofs;
+			ofs = 2 * ofs + 1;
+		}
 
-	if (i > 0) {
-		/* this may catch one error or two */
-		assert(buf != NULL);
+		left = last;
+		right = ofs <= n ? ofs - 1 : n;
+	}
 
-		/* add NUL terminator */
-		buf[len] = 0;
-		*ret = makestring_nocopy_len(buf, len, 1);
-	} else {
-		assert(buf == NULL);
+	while (left < right) {
+		size_t mid = left + (right - left) / 2;
 
-		/* if there were no items to concatenate, return empty string
-		 * (this is necessary because 'buf' is now NULL,
-		 * and we definitely don't want this to segfault)
-		 */
-		*ret = makestring_nocopy_len("", 0, 0);
+		if (sort_goes_left(s, key, a + mid * s->size, strict)) {
+			left = mid + 1;
+		} else {
+			right = mid;
+		}
 	}
 
-	return 0;
+	return left;
 }
 
-/* argv[0] is the array to enumerate
- * argv[1] is the callback function
- * args[0] is the value passed to the callback
- * args[1] is the index passed to the callback
- * cbret is the return value of the callback function
- */
-static int rtlb_array_foreach(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static void sort_ensure_tmp(SortState *s, size_t n)
 {
-	size_t i, n;
-	SpnArray *arr;
-	SpnFunction *predicate;
-
-	if (argc != 2) {
-		spn_ctx_runtime_error(ctx, "two arguments are required", NULL);
-		return -1;
+	if (n <= s->tmpcap) {
+		return;
 	}
 
-	if (!isarray(&argv[0])) {
-		spn_ctx_runtime_error(ctx, "first argument must be an array", NULL);
-		return -2;
+	if (s->tmp != s->stackbuf.buf) {
+		free(s->tmp);
 	}
 
-	if (!isfunc(&argv[1])) {
-		spn_ctx_runtime_error(ctx, "second argument must be a function", NULL);
-		return -3;
-	}
+	s->tmp = spn_malloc(n * s->size);
+	s->tmpcap = n;
+}
 
-	arr = arrayvalue(&argv[0]);
-	predicate = funcvalue(&argv[1]);
-	n = spn_array_count(arr);
+/* merges adjacent runs where the first one is the shorter one */
+static void sort_merge_lo(SortState *s, size_t base1, size_t len1, size_t base2, size_t len2)
+{
+	size_t i = 0, j = 0, size = s->size;
+	char *dst = SORT_ELEM(s, base1);
+	char *run2 = SORT_ELEM(s, base2);
 
-	for (i = 0; i < n; i++) {
-		int err;
-		SpnValue cbret;
-		SpnValue args[2]; /* value and index */
+	sort_ensure_tmp(s, len1);
+	memcpy(s->tmp, dst, len1 * size);
 
-		args[0] = spn_array_get(arr, i);
-		args[1] = makeint(i);
+	while (i < len1 && j < len2) {
+		size_t wins1 = 0, wins2 = 0;
 
-		err = spn_ctx_callfunc(ctx, predicate, &cbret, COUNT(args), args);
+		/* one element at a time, until a run keeps winning */
+		while (i < len1 && j < len2 && wins1 < s->min_gallop && wins2 < s->min_gallop) {
+			if (sort_lt(s, run2 + j * size, s->tmp + i * size)) {
+				memcpy(dst, run2 + j * size, size);
+				j++;
+				wins2++;
+				wins1 = 0;
+			} else {
+				memcpy(dst, s->tmp + i * size, size);
+				i++;
+				wins1++;
+				wins2 = 0;
+			}
 
-		if (err != 0) {
-			return -4;
+			dst += size;
 		}
 
-		/* the callback must return a Boolean or nothing */
-		if (isbool(&cbret)) {
-			if (boolvalue(&cbret) == 0) {
+		/* galloping, until it doesn't pay off any more */
+		while (i < len1 && j < len2) {
+			size_t k1, k2;
+
+			/* elements of run 1 up to the next one of run 2 */
+			k1 = sort_gallop(s, run2 + j * size, s->tmp + i * size, len1 - i, 0, 0);
+			memcpy(dst, s->tmp + i * size, k1 * size);
+			dst += k1 * size;
+			i += k1;
+
+			if (i == len1) {
 				break;
 			}
-		} else if (notnil(&cbret)) {
-			spn_value_release(&cbret);
-			spn_ctx_runtime_error(ctx, "callback function must return boolean or nil", NULL);
-			return -5;
+
+			memcpy(dst, run2 + j * size, size);
+			dst += size;
+			j++;
+
+			if (j == len2) {
+				break;
+			}
+
+			/* elements of run 2 up to the next one of run 1 */
+			k2 = sort_gallop(s, s->tmp + i * size, run2 + j * size, len2 - j, 1, 0);
+			memmove(dst, run2 + j * size, k2 * size);
+			dst += k2 * size;
+			j += k2;
+
+			if (j == len2) {
+				break;
+			}
+
+			memcpy(dst, s->tmp + i * size, size);
+			dst += size;
+			i++;
+
+			if (k1 < SORT_MIN_GALLOP && k2 < SORT_MIN_GALLOP) {
+				s->min_gallop++;
+				break;
+			}
+
+			if (s->min_gallop > 1) {
+				s->min_gallop--;
+			}
 		}
 	}
 
-	return 0;
+	/* the rest of run 2, if any, is already in place */
+	memcpy(dst, s->tmp + i * size, (len1 - i) * size);
 }
 
-static int rtlb_reduce(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+/* merges adjacent runs where the second one is the shorter one */
+static void sort_merge_hi(SortState *s, size_t base1, size_t len1, size_t base2, size_t len2)
 {
-	size_t i, n;
-	SpnArray *arr;
-	SpnValue args[2], tmp;
-	SpnValue *arrval, *first;
-	SpnFunction *func;
+	size_t i = len1, j = len2, size = s->size;
+	char *run1 = SORT_ELEM(s, base1);
+	char *dst = SORT_ELEM(s, base2 + len2);
 
-	if (argc != 3) {
-		spn_ctx_runtime_error(ctx, "expecting three arguments", NULL);
-		return -1;
-	}
+	sort_ensure_tmp(s, len2);
+	memcpy(s->tmp, SORT_ELEM(s, base2), len2 * size);
 
-	arrval = &argv[0];
-	first  = &argv[1];
+	while (i > 0 && j > 0) {
+		size_t wins1 = 0, wins2 = 0;
 
-	if (!isarray(arrval)) {
-		spn_ctx_runtime_error(ctx, "first argument must be an array", NULL);
-		return -2;
-	}
+		/* one element at a time, until a run keeps winning */
+		while (i > 0 && j > 0 && wins1 < s->min_gallop && wins2 < s->min_gallop) {
+			dst -= size;
 
-	if (!isfunc(&argv[2])) {
-		spn_ctx_runtime_error(ctx, "third argument must be a function", NULL);
-		return -3;
-	}
+			if (sort_lt(s, s->tmp + (j - 1) * size, run1 + (i - 1) * size)) {
+				memcpy(dst, run1 + (i - 1) * size, size);
+				i--;
+				wins1++;
+				wins2 = 0;
+			} else {
+				memcpy(dst, s->tmp + (j - 1) * size, size);
+				j--;
+				wins2++;
+				wins1 = 0;
+			}
+		}
 
-	func = funcvalue(&argv[2]);
-	arr = arrayvalue(arrval);
-	n = spn_array_count(arr);
+		/* galloping, until it doesn't pay off any more */
+		while (i > 0 && j > 0) {
+			size_t k1, k2;
 
-	spn_value_retain(first);
-	tmp = *first;
+			/* elements of run 1 greater than the last one of run 2 */
+			k1 = i - sort_gallop(s, s->tmp + (j - 1) * size, run1, i, 0, 1);
+			dst -= k1 * size;
+			i -= k1;
+			memmove(dst, run1 + i * size, k1 * size);
 
-	for (i = 0; i < n; i++) {
-		int err;
-		args[0] = tmp;
+			if (i == 0) {
+				break;
+			}
 
-		/* args[1] needn't be released: values returned by array getter
-		 * functions are non-owning
-		 */
-		args[1] = spn_array_get(arr, i);
+			dst -= size;
+			memcpy(dst, s->tmp + (j - 1) * size, size);
+			j--;
 
-		err = spn_ctx_callfunc(ctx, func, &tmp, COUNT(args), args);
-		spn_value_release(&args[0]);
+			if (j == 0) {
+				break;
+			}
 
-		if (err != 0) {
-			return -4;
+			/* elements of run 2 not less than the last one of run 1 */
+			k2 = j - sort_gallop(s, run1 + (i - 1) * size, s->tmp, j, 1, 1);
+			dst -= k2 * size;
+			j -= k2;
+			memcpy(dst, s->tmp + j * size, k2 * size);
+
+			if (j == 0) {
+				break;
+			}
+
+			dst -= size;
+			memcpy(dst, run1 + (i - 1) * size, size);
+			i--;
+
+			if (k1 < SORT_MIN_GALLOP && k2 < SORT_MIN_GALLOP) {
+				s->min_gallop++;
+				break;
+			}
+
+			if (s->min_gallop > 1) {
+				s->min_gallop--;
+			}
 		}
 	}
 
-	*ret = tmp;
-	return 0;
+	/* the rest of run 1, if any, is already in place */
+	memcpy(run1 + i * size, s->tmp, j * size);
 }
 
-/* args[0] is the value passed to the predicate, args[1] is the index */
-static int rtlb_array_filter(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+/* merges the runs at indices 'k' and 'k + 1' of the run stack */
+static void sort_merge_at(SortState *s, size_t k)
 {
-	size_t i, n;
-	SpnArray *orig, *filt;
-	SpnFunction *predicate;
+	size_t base1 = s->runbase[k], len1 = s->runlen[k];
+	size_t base2 = s->runbase[k + 1], len2 = s->runlen[k + 1];
+	size_t skip;
 
-	if (argc != 2) {
-		spn_ctx_runtime_error(ctx, "expecting two arguments", NULL);
-		return -1;
+	s->runlen[k] = len1 + len2;
+	if (k + 3 == s->nruns) {
+		s->runbase[k + 1] = s->runbase[k + 2];
+		s->runlen[k + 1] = s->runlen[k + 2];
 	}
+	s->nruns--;
 
-	if (!isarray(&argv[0])) {
-		spn_ctx_runtime_error(ctx, "first argument must be an array", NULL);
-		return -2;
+	/* elements of run 1 which are not greater than the first element
+	 * of run 2, and elements of run 2 which are not less than the last
+	 * element of run 1, are already in their final position.
+	 */
+	skip = sort_gallop(s, SORT_ELEM(s, base2), SORT_ELEM(s, base1), len1, 0, 0);
+	base1 += skip;
+	len1 -= skip;
+	if (len1 == 0) {
+		return;
 	}
 
-	if (!isfunc(&argv[1])) {
-		spn_ctx_runtime_error(ctx, "second argument must be a function", NULL);
-		return -3;
+	len2 = sort_gallop(s, SORT_ELEM(s, base1 + len1 - 1), SORT_ELEM(s, base2), len2, 1, 1);
+	if (len2 == 0) {
+		return;
 	}
 
-	orig = arrayvalue(&argv[0]);
-	predicate = funcvalue(&argv[1]);
-	n = spn_array_count(orig);
-	filt = spn_array_new();
-
-	for (i = 0; i < n; i++) {
-		SpnValue args[2];
-		SpnValue cond;
+	if (len1 <= len2) {
+		sort_merge_lo(s, base1, len1, base2, len2);
+	} else {
+		sort_merge_hi(s, base1, len1, base2, len2);
+	}
+}
 
-		args[0] = spn_array_get(orig, i);
-		args[1] = makeint(i);
+/* restores the invariants len[k - 2] > len[k - 1] + len[k]
+ * and len[k - 1] > len[k] on the run stack
+ */
+static void sort_merge_collapse(SortState *s)
+{
+	size_t *len = s->runlen;
 
-		if (spn_ctx_callfunc(ctx, predicate, &cond, COUNT(args), args) != 0) {
-			spn_object_release(filt);
-			return -4;
-		}
+	while (s->nruns > 1) {
+		size_t k = s->nruns - 2;
 
-		if (isbool(&cond)) {
-			if (boolvalue(&cond)) {
-				spn_array_push(filt, &args[0]);
+		if ((k > 0 && len[k - 1] <= len[k] + len[k + 1])
+		 || (k > 1 && len[k - 2] <= len[k - 1] + len[k])) {
+			if (len[k - 1] < len[k + 1]) {
+				k--;
 			}
-		} else {
-			spn_value_release(&cond);
-			spn_object_release(filt);
-			spn_ctx_runtime_error(ctx, "predicate must return a boolean", NULL);
-			return -5;
+		} else if (len[k] > len[k + 1]) {
+			break;
 		}
-	}
 
-	ret->type = SPN_TYPE_ARRAY;
-	ret->v.o = filt;
-	return 0;
+		sort_merge_at(s, k);
+	}
 }
 
-static int rtlb_array_map(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static void sort_merge_force_collapse(SortState *s)
 {
-	size_t i, n;
-	SpnArray *orig, *mapped;
-	SpnFunction *predicate;
+	while (s->nruns > 1) {
+		size_t k = s->nruns - 2;
 
-	if (argc != 2) {
-		spn_ctx_runtime_error(ctx, "expecting two arguments", NULL);
-		return -1;
-	}
+		if (k > 0 && s->runlen[k - 1] < s->runlen[k + 1]) {
+			k--;
+		}
 
-	if (!isarray(&argv[0])) {
-		spn_ctx_runtime_error(ctx, "first argument must be an array", NULL);
-		return -2;
+		sort_merge_at(s, k);
 	}
+}
 
-	if (!isfunc(&argv[1])) {
-		spn_ctx_runtime_error(ctx, "second argument must be a function", NULL);
-		return -3;
-	}
+static size_t sort_min_run(size_t n)
+{
+	size_t r = 0;
 
-	orig = arrayvalue(&argv[0]);
-	predicate = funcvalue(&argv[1]);
-	n = spn_array_count(orig);
-	mapped = spn_array_new();
+	while (n >= SORT_MIN_MERGE) {
+		r |= n & 1;
+		n >>= 1;
+	}
 
-	for (i = 0; i < n; i++) {
-		SpnValue result;
-		SpnValue args[2];
+	return n + r;
+}
 
-		args[0] = spn_array_get(orig, i);
-		args[1] = makeint(i);
+/* Sorts 'n' elements of size 's->size' at 's->base'.
+ * Returns nonzero if the comparator failed.
+ */
+static int sort_run(SortState *s, size_t n)
+{
+	size_t lo = 0, minrun = sort_min_run(n);
 
-		if (spn_ctx_callfunc(ctx, predicate, &result, COUNT(args), args) != 0) {
-			spn_object_release(mapped);
-			return -4;
-		}
+	s->error = 0;
+	s->min_gallop = SORT_MIN_GALLOP;
+	s->nruns = 0;
+	s->tmp = s->stackbuf.buf;
+	s->tmpcap = sizeof s->stackbuf / s->size;
 
-		spn_array_push(mapped, &result);
-		spn_value_release(&result);
-	}
+	while (lo < n && !s->error) {
+		size_t runlen = sort_count_run(s, lo, n);
 
-	ret->type = SPN_TYPE_ARRAY;
-	ret->v.o = mapped;
-	return 0;
-}
+		/* extend short runs to 'minrun' elements */
+		if (runlen < minrun) {
+			size_t force = n - lo < minrun ? n - lo : minrun;
+			sort_binary_insertion(s, lo, lo + force, lo + runlen);
+			runlen = force;
+		}
 
-static int rtlb_push(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
-{
-	SpnArray *arr;
+		s->runbase[s->nruns] = lo;
+		s->runlen[s->nruns] = runlen;
+		s->nruns++;
+		sort_merge_collapse(s);
 
-	if (argc != 2) {
-		spn_ctx_runtime_error(ctx, "expecting 2 arguments", NULL);
-		return -1;
+		lo += runlen;
 	}
 
-	if (!isarray(&argv[0])) {
-		spn_ctx_runtime_error(ctx, "first argument must be an array", NULL);
-		return -2;
+	if (!s->error) {
+		sort_merge_force_collapse(s);
 	}
 
-	arr = arrayvalue(&argv[0]);
-	spn_array_push(arr, &argv[1]);
+	if (s->tmp != s->stackbuf.buf) {
+		free(s->tmp);
+	}
 
-	return 0;
+	return s->error;
 }
 
-static int rtlb_pop(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+/* Picks a direct comparison for an array of boxed values if no
+ * comparator was given. Any two elements must be comparable, and
+ * since comparability is a matter of class (or of being a number),
+ * it suffices to compare each element to the first one.
+ */
+static int rtlb_aux_sort_values(SortState *s, SpnValue *vals, size_t n, SpnContext *ctx)
 {
-	size_t n;
-	SpnArray *arr;
+	int allints = 1, allfloats = 1, allstrings = 1;
+	size_t i;
 
-	if (argc != 1) {
-		spn_ctx_runtime_error(ctx, "expecting one argument", NULL);
-		return -1;
-	}
+	for (i = 0; i < n; i++) {
+		if (!spn_values_comparable(&vals[0], &vals[i])) {
+			const void *args[2];
+			args[0] = spn_type_name(valtype(&vals[i]));
+			args[1] = spn_type_name(valtype(&vals[0]));
 
-	if (!isarray(&argv[0])) {
-		spn_ctx_runtime_error(ctx, "argument must be an array", NULL);
-		return -2;
-	}
+			spn_ctx_runtime_error(
+				ctx,
+				"attempt to sort uncomparable values"
+				" of type %s and %s",
+				args
+			);
 
-	arr = arrayvalue(&argv[0]);
-	n = spn_array_count(arr);
+			return -1;
+		}
 
-	if (n == 0) {
-		spn_ctx_runtime_error(ctx, "cannot pop() empty array", NULL);
-		return -3;
-	}
+		allints = allints && isint(&vals[i]);
+		allfloats = allfloats && isfloat(&vals[i]);
 
-	/* return last element */
-	*ret = spn_array_get(arr, n - 1);
-	spn_value_retain(ret);
+		if (allstrings && isstring(&vals[i])) {
+			spn_string_flatten(objvalue(&vals[i]));
+		} else {
+			allstrings = 0;
+		}
+	}
 
-	/* remove it from array */
-	spn_array_pop(arr);
+	s->less = allints ? sort_less_intvalue
+	        : allfloats ? sort_less_floatvalue
+	        : allstrings ? sort_less_strvalue
+	        : sort_less_value;
 
-	return 0;
+	return sort_run(s, n);
 }
 
-static int rtlb_last(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+/* Sorts a private copy of the elements, so that a comparator which
+ * modifies the array can't pull the storage from under the sort.
+ * The result is written back only if the sort succeeded and the
+ * comparator didn't change the length of the array.
+ */
+static int rtlb_aux_sort_callback(SortState *s, SpnArray *arr, size_t n, SpnContext *ctx)
 {
-	size_t n;
-	SpnArray *arr;
+	size_t i, size = s->size;
+	char *copy = spn_malloc(n * size);
+	int error;
 
-	if (argc != 1) {
-		spn_ctx_runtime_error(ctx, "expecting one argument", NULL);
-		return -1;
-	}
+	memcpy(copy, spn_array_data(arr), n * size);
 
-	if (!isarray(&argv[0])) {
-		spn_ctx_runtime_error(ctx, "argument must be an array", NULL);
-		return -2;
+	if (s->kind == SPN_ARRAY_VALUES) {
+		for (i = 0; i < n; i++) {
+			spn_value_retain(&((SpnValue *)copy)[i]);
+		}
 	}
 
-	arr = arrayvalue(&argv[0]);
-	n = spn_array_count(arr);
+	s->base = copy;
+	s->less = sort_less_callback;
+	error = sort_run(s, n);
 
-	if (n == 0) {
-		spn_ctx_runtime_error(ctx, "cannot get last element of empty array", NULL);
-		return -3;
+	if (error == 0 && spn_array_count(arr) != n) {
+		spn_ctx_runtime_error(ctx, "array was resized during sorting", NULL);
+		error = -1;
 	}
 
-	*ret = spn_array_get(arr, n - 1);
-	spn_value_retain(ret);
+	if (error == 0) {
+		char *data = spn_array_data(arr);
 
-	return 0;
+		if (s->kind == SPN_ARRAY_VALUES) {
+			for (i = 0; i < n; i++) {
+				spn_value_release(&((SpnValue *)data)[i]);
+			}
+		}
+
+		memcpy(data, copy, n * size);
+	} else if (s->kind == SPN_ARRAY_VALUES) {
+		for (i = 0; i < n; i++) {
+			spn_value_release(&((SpnValue *)copy)[i]);
+		}
+	}
+
+	free(copy);
+	return error;
 }
 
-static int rtlb_swap(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_sort(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
-	SpnArray *arr;
-	SpnValue tmp_a, tmp_b;
-	long idx_a, idx_b;
+	SpnArray *array;
+	SortState s;
 	size_t n;
 
-	if (argc != 3) {
-		spn_ctx_runtime_error(ctx, "expecting 3 arguments", NULL);
+	if (argc < 1 || argc > 2) {
+		spn_ctx_runtime_error(ctx, "one or two arguments are required", NULL);
 		return -1;
 	}
 
@@ -1672,90 +1821,57 @@ static int rtlb_swap(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		return -2;
 	}
 
-	if (!isint(&argv[1]) || !isint(&argv[2])) {
-		spn_ctx_runtime_error(ctx, "second and third arguments must be integers", NULL);
-		return -2;
-	}
-
-	arr = arrayvalue(&argv[0]);
-	idx_a = intvalue(&argv[1]);
-	idx_b = intvalue(&argv[2]);
+	array = arrayvalue(&argv[0]);
+	n = spn_array_count(array);
 
-	n = spn_array_count(arr);
+	s.comp = NULL;
+	s.ctx = ctx;
+	s.kind = spn_array_kind(array);
 
-	if (idx_a < 0 || idx_a >= n
-	 || idx_b < 0 || idx_b >= n) {
-		long sn = n;
-		const void *args[2];
-		args[0] = idx_a < 0 || idx_a >= n ? &idx_a : &idx_b;
-		args[1] = &sn;
-		spn_ctx_runtime_error(ctx, "index %d is out of bounds for array of size %d", args);
-		return -3;
+	switch (s.kind) {
+	case SPN_ARRAY_VALUES:  s.size = sizeof(SpnValue);      s.less = NULL;            break;
+	case SPN_ARRAY_INTS:    s.size = sizeof(long);          s.less = sort_less_int;   break;
+	case SPN_ARRAY_FLOATS:  s.size = sizeof(double);        s.less = sort_less_float; break;
+	case SPN_ARRAY_BYTES:   s.size = sizeof(unsigned char); s.less = sort_less_byte;  break;
+	default:                SHANT_BE_REACHED();
 	}
 
-	tmp_a = spn_array_get(arr, idx_a);
-	tmp_b = spn_array_get(arr, idx_b);
-
-	/* retain the original value of A, because it may
-	 * be released, causing premature deallocation:
-	 * when "arr[idx_a] = tmp_b" is executed, tmp_a may be released (if tmp_b is nil).
-	 * - However, tmp_b is safe without an additional retain,
-	 *   since by the time it may be released, it has already
-	 *   been retained by the first setter.
-	 */
-	spn_value_retain(&tmp_a);
-
-	spn_array_set(arr, idx_a, &tmp_b);
-	spn_array_set(arr, idx_b, &tmp_a);
-
-	spn_value_release(&tmp_a);
-
-	return 0;
-}
-
-static int rtlb_reverse(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
-{
-	size_t i, n;
-	SpnArray *arr, *result;
+	if (argc == 2) {
+		if (!isfunc(&argv[1])) {
+			spn_ctx_runtime_error(ctx, "second argument must be a comparator function", NULL);
+			return -3;
+		}
 
-	if (argc != 1) {
-		spn_ctx_runtime_error(ctx, "expecting one argument", NULL);
-		return -1;
+		s.comp = funcvalue(&argv[1]);
 	}
 
-	if (!isarray(&argv[0])) {
-		spn_ctx_runtime_error(ctx, "argument must be an array", NULL);
-		return -2;
+	if (n < 2) {
+		return 0;
 	}
 
-	arr = arrayvalue(&argv[0]);
-	n = spn_array_count(arr);
+	if (s.comp != NULL) {
+		return rtlb_aux_sort_callback(&s, array, n, ctx) ? -4 : 0;
+	}
 
-	*ret = makearray();
-	result = arrayvalue(ret);
+	s.base = spn_array_data(array);
 
-	/* copy elements of 'arr' into 'result' in reverse order */
-	for (i = n; i > 0; i--) {
-		SpnValue tmp = spn_array_get(arr, i - 1);
-		spn_array_push(result, &tmp);
+	if (s.kind == SPN_ARRAY_VALUES) {
+		return rtlb_aux_sort_values(&s, (SpnValue *)s.base, n, ctx) ? -4 : 0;
 	}
 
+	sort_run(&s, n);
 	return 0;
 }
 
-/* if "any" is nonzero, this function will return true if the
- * predicate returns true for any of the elements in the array.
- * if, however, "any" is zero, then it will only return true
- * if the predicate is true for all of the elements.
- */
-static int rtlb_aux_anyall(SpnValue *ret, int argc, SpnValue *argv, void *ctx, int any)
+static int rtlb_join(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
-	size_t i, n;
+	size_t n, i, len = 0;
+	char *buf = NULL;
 	SpnArray *arr;
-	SpnFunction *predicate;
+	SpnString *delim;
 
 	if (argc != 2) {
-		spn_ctx_runtime_error(ctx, "expecting two arguments", NULL);
+		spn_ctx_runtime_error(ctx, "exactly two arguments are required", NULL);
 		return -1;
 	}
 
@@ -1764,64 +1880,80 @@ static int rtlb_aux_anyall(SpnValue *ret, int argc, SpnValue *argv, void *ctx, i
 		return -2;
 	}
 
-	if (!isfunc(&argv[1])) {
-		spn_ctx_runtime_error(ctx, "second argument must be a function", NULL);
-		return -3;
+	if (!isstring(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "second argument must be a string", NULL);
+		return -2;
 	}
 
 	arr = arrayvalue(&argv[0]);
-	predicate = funcvalue(&argv[1]);
-
-	*ret = any ? spn_falseval : spn_trueval;
-
 	n = spn_array_count(arr);
 
-	for (i = 0; i < n; i++) {
-		SpnValue keyval[2]; /* item 0: value, item 1: index */
-		SpnValue result;
+	delim = stringvalue(&argv[1]);
 
-		keyval[0] = spn_array_get(arr, i);
-		keyval[1] = makeint(i);
+	for (i = 0; i < n; i++) {
+		size_t addlen;
+		SpnString *str;
+		SpnValue val = spn_array_get(arr, i);
 
-		if (spn_ctx_callfunc(ctx, predicate, &result, COUNT(keyval), keyval) != 0) {
-			return -4;
+		if (!isstring(&val)) {
+			free(buf);
+			spn_ctx_runtime_error(ctx, "array must contain strings only", NULL);
+			return -3;
 		}
 
-		if (!isbool(&result)) {
-			spn_value_release(&result);
-			spn_ctx_runtime_error(ctx, "predicate must return a Boolean", NULL);
-			return -5;
-		}
+		/* XXX: this should really be solved using
+		 * exponential buffer expansion. Maybe in alpha 2...
+		 */
 
-		if (any && boolvalue(&result)) {
-			*ret = spn_trueval;
-			break;
-		} else if (!any && !boolvalue(&result)) {
-			*ret = spn_falseval;
-			break;
+		str = stringvalue(&val);
+		addlen = i > 0 ? delim->len + str->len : str->len;
+
+		buf = spn_realloc(buf, len + addlen + 1);
+
+		if (i > 0) {
+			memcpy(buf + len, delim->cstr, delim->len);
+			memcpy(buf + len + delim->len, str->cstr, str->len);
+		} else {
+			memcpy(buf + len, str->cstr, str->len);
 		}
+
+		len += addlen;
 	}
 
-	return 0;
-}
+	if (i > 0) {
+		/* this may catch one error or two */
+		assert(buf != NULL);
 
-static int rtlb_any(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
-{
-	return rtlb_aux_anyall(ret, argc, argv, ctx, 1);
-}
+		/* add NUL terminator */
+		buf[len] = 0;
+		*ret = makestring_nocopy_len(buf, len, 1);
+	} else {
+		assert(buf == NULL);
 
-static int rtlb_all(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
-{
-	return rtlb_aux_anyall(ret, argc, argv, ctx, 0);
+		/* if there were no items to concatenate, return empty string
+		 * (this is necessary because 'buf' is now NULL,
+		 * and we definitely don't want this to segfault)
+		 */
+		*ret = makestring_nocopy_len("", 0, 0);
+	}
+
+	return 0;
 }
 
-static int rtlb_arr_find(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+/* argv[0] is the array to enumerate
+ * argv[1] is the callback function
+ * args[0] is the value passed to the callback
+ * args[1] is the index passed to the callback
+ * cbret is the return value of the callback function
+ */
+static int rtlb_array_foreach(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
 	size_t i, n;
 	SpnArray *arr;
+	SpnFunction *predicate;
 
 	if (argc != 2) {
-		spn_ctx_runtime_error(ctx, "expecting two arguments", NULL);
+		spn_ctx_runtime_error(ctx, "two arguments are required", NULL);
 		return -1;
 	}
 
@@ -1830,26 +1962,103 @@ static int rtlb_arr_find(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		return -2;
 	}
 
+	if (!isfunc(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "second argument must be a function", NULL);
+		return -3;
+	}
+
 	arr = arrayvalue(&argv[0]);
+	predicate = funcvalue(&argv[1]);
 	n = spn_array_count(arr);
 
 	for (i = 0; i < n; i++) {
-		SpnValue tmp = spn_array_get(arr, i);
+		int err;
+		SpnValue cbret;
+		SpnValue args[2]; /* value and index */
 
-		if (spn_value_equal(&tmp, &argv[1])) {
-			*ret = makeint(i);
-			return 0;
+		args[0] = spn_array_get(arr, i);
+		args[1] = makeint(i);
+
+		err = spn_ctx_callfunc(ctx, predicate, &cbret, COUNT(args), args);
+
+		if (err != 0) {
+			return -4;
+		}
+
+		/* the callback must return a Boolean or nothing */
+		if (isbool(&cbret)) {
+			if (boolvalue(&cbret) == 0) {
+				break;
+			}
+		} else if (notnil(&cbret)) {
+			spn_value_release(&cbret);
+			spn_ctx_runtime_error(ctx, "callback function must return boolean or nil", NULL);
+			return -5;
 		}
 	}
 
-	*ret = makeint(-1);
 	return 0;
 }
 
-static int rtlb_pfind(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_reduce(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
 	size_t i, n;
 	SpnArray *arr;
+	SpnValue args[2], tmp;
+	SpnValue *arrval, *first;
+	SpnFunction *func;
+
+	if (argc != 3) {
+		spn_ctx_runtime_error(ctx, "expecting three arguments", NULL);
+		return -1;
+	}
+
+	arrval = &argv[0];
+	first  = &argv[1];
+
+	if (!isarray(arrval)) {
+		spn_ctx_runtime_error(ctx, "first argument must be an array", NULL);
+		return -2;
+	}
+
+	if (!isfunc(&argv[2])) {
+		spn_ctx_runtime_error(ctx, "third argument must be a function", NULL);
+		return -3;
+	}
+
+	func = funcvalue(&argv[2]);
+	arr = arrayvalue(arrval);
+	n = spn_array_count(arr);
+
+	spn_value_retain(first);
+	tmp = *first;
+
+	for (i = 0; i < n; i++) {
+		int err;
+		args[0] = tmp;
+
+		/* args[1] needn't be released: values returned by array getter
+		 * functions are non-owning
+		 */
+		args[1] = spn_array_get(arr, i);
+
+		err = spn_ctx_callfunc(ctx, func, &tmp, COUNT(args), args);
+		spn_value_release(&args[0]);
+
+		if (err != 0) {
+			return -4;
+		}
+	}
+
+	*ret = tmp;
+	return 0;
+}
+
+/* args[0] is the value passed to the predicate, args[1] is the index */
+static int rtlb_array_filter(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	size_t i, n;
+	SpnArray *orig, *filt;
 	SpnFunction *predicate;
 
 	if (argc != 2) {
@@ -1867,172 +2076,1449 @@ static int rtlb_pfind(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		return -3;
 	}
 
-	arr = arrayvalue(&argv[0]);
+	orig = arrayvalue(&argv[0]);
 	predicate = funcvalue(&argv[1]);
-	n = spn_array_count(arr);
+	n = spn_array_count(orig);
+	filt = spn_array_new();
 
 	for (i = 0; i < n; i++) {
-		SpnValue pret;
-		SpnValue tmp = spn_array_get(arr, i);
+		SpnValue args[2];
+		SpnValue cond;
 
-		if (spn_ctx_callfunc(ctx, predicate, &pret, 1, &tmp) != 0) {
+		args[0] = spn_array_get(orig, i);
+		args[1] = makeint(i);
+
+		if (spn_ctx_callfunc(ctx, predicate, &cond, COUNT(args), args) != 0) {
+			spn_object_release(filt);
 			return -4;
 		}
 
-		if (!isbool(&pret)) {
-			spn_value_release(&pret);
-			spn_ctx_runtime_error(ctx, "predicate must return a Boolean", NULL);
+		if (isbool(&cond)) {
+			if (boolvalue(&cond)) {
+				spn_array_push(filt, &args[0]);
+			}
+		} else {
+			spn_value_release(&cond);
+			spn_object_release(filt);
+			spn_ctx_runtime_error(ctx, "predicate must return a boolean", NULL);
 			return -5;
 		}
-
-		if (boolvalue(&pret)) {
-			*ret = makeint(i);
-			return 0;
-		}
 	}
 
-	*ret = makeint(-1);
+	*ret = spn_makeobject(SPN_TYPE_ARRAY, filt);
 	return 0;
 }
 
-/* return value:
- * > 0 if a < b
- * = 0 if a >= b
- * < 0 if an error occurred
- */
-static int rtlb_aux_bsearch_compare(SpnValue vals[2], SpnFunction *predicate, SpnContext *ctx)
+static int rtlb_array_map(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
-	const void *args[2];
+	size_t i, n;
+	SpnArray *orig, *mapped;
+	SpnFunction *predicate;
 
-	if (predicate) {
-		SpnValue pret;
-		if (spn_ctx_callfunc(ctx, predicate, &pret, 2, vals) != 0) {
-			return -1;
-		}
+	if (argc != 2) {
+		spn_ctx_runtime_error(ctx, "expecting two arguments", NULL);
+		return -1;
+	}
 
-		if (!isbool(&pret)) {
-			spn_value_release(&pret);
-			spn_ctx_runtime_error(ctx, "predicate must return a Boolean", NULL);
-			return -2;
-		}
+	if (!isarray(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "first argument must be an array", NULL);
+		return -2;
+	}
 
-		return boolvalue(&pret);
+	if (!isfunc(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "second argument must be a function", NULL);
+		return -3;
 	}
 
-	/* if no predicate was supplied, use the "<" operator */
-	if (spn_values_comparable(&vals[0], &vals[1])) {
-		/* "spn_value_compare(a, b) < 0" <=> "a < b" */
-		return spn_value_compare(&vals[0], &vals[1]) < 0;
+	orig = arrayvalue(&argv[0]);
+	predicate = funcvalue(&argv[1]);
+	n = spn_array_count(orig);
+	mapped = spn_array_new();
+	spn_array_reserve(mapped, n);
+
+	for (i = 0; i < n; i++) {
+		SpnValue result;
+		SpnValue args[2];
+
+		args[0] = spn_array_get(orig, i);
+		args[1] = makeint(i);
+
+		if (spn_ctx_callfunc(ctx, predicate, &result, COUNT(args), args) != 0) {
+			spn_object_release(mapped);
+			return -4;
+		}
+
+		spn_array_push(mapped, &result);
+		spn_value_release(&result);
 	}
 
-	/* if the values are not orderable, we're in trouble */
-	args[0] = spn_type_name(vals[0].type);
-	args[1] = spn_type_name(vals[1].type);
-	spn_ctx_runtime_error(ctx, "cannot compare values of type %s and %s", args);
-	return -3;
+	*ret = spn_makeobject(SPN_TYPE_ARRAY, mapped);
+	return 0;
 }
 
-/* searches for elements in the range [lower, upper) */
+/* returns 0 if 'val' can be stored in 'arr',
+ * otherwise raises a runtime error and returns nonzero
+ */
+static int rtlb_aux_accepts(SpnArray *arr, const SpnValue *val, void *ctx)
+{
+	if (!spn_array_accepts(arr, val)) {
+		const void *args[1];
+		args[0] = spn_type_name(valtype(val));
+		spn_ctx_runtime_error(ctx, "value of type %s cannot be stored in a packed array", args);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int rtlb_push(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnArray *arr;
+
+	if (argc != 2) {
+		spn_ctx_runtime_error(ctx, "expecting 2 arguments", NULL);
+		return -1;
+	}
+
+	if (!isarray(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "first argument must be an array", NULL);
+		return -2;
+	}
+
+	arr = arrayvalue(&argv[0]);
+
+	if (rtlb_aux_accepts(arr, &argv[1], ctx) != 0) {
+		return -3;
+	}
+
+	spn_array_push(arr, &argv[1]);
+
+	return 0;
+}
+
+static int rtlb_array_reserve(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	if (argc != 2) {
+		spn_ctx_runtime_error(ctx, "expecting 2 arguments", NULL);
+		return -1;
+	}
+
+	if (!isarray(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "first argument must be an array", NULL);
+		return -2;
+	}
+
+	if (!isint(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "second argument must be an integer", NULL);
+		return -3;
+	}
+
+	if (intvalue(&argv[1]) < 0) {
+		spn_ctx_runtime_error(ctx, "second argument must not be negative", NULL);
+		return -4;
+	}
+
+	spn_array_reserve(arrayvalue(&argv[0]), intvalue(&argv[1]));
+
+	return 0;
+}
+
+static int rtlb_pop(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	size_t n;
+	SpnArray *arr;
+
+	if (argc != 1) {
+		spn_ctx_runtime_error(ctx, "expecting one argument", NULL);
+		return -1;
+	}
+
+	if (!isarray(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "argument must be an array", NULL);
+		return -2;
+	}
+
+	arr = arrayvalue(&argv[0]);
+	n = spn_array_count(arr);
+
+	if (n == 0) {
+		spn_ctx_runtime_error(ctx, "cannot pop() empty array", NULL);
+		return -3;
+	}
+
+	/* return last element */
+	*ret = spn_array_get(arr, n - 1);
+	spn_value_retain(ret);
+
+	/* remove it from array */
+	spn_array_pop(arr);
+
+	return 0;
+}
+
+static int rtlb_last(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	size_t n;
+	SpnArray *arr;
+
+	if (argc != 1) {
+		spn_ctx_runtime_error(ctx, "expecting one argument", NULL);
+		return -1;
+	}
+
+	if (!isarray(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "argument must be an array", NULL);
+		return -2;
+	}
+
+	arr = arrayvalue(&argv[0]);
+	n = spn_array_count(arr);
+
+	if (n == 0) {
+		spn_ctx_runtime_error(ctx, "cannot get last element of empty array", NULL);
+		return -3;
+	}
+
+	*ret = spn_array_get(arr, n - 1);
+	spn_value_retain(ret);
+
+	return 0;
+}
+
+static int rtlb_swap(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnArray *arr;
+	SpnValue tmp_a, tmp_b;
+	long idx_a, idx_b;
+	size_t n;
+
+	if (argc != 3) {
+		spn_ctx_runtime_error(ctx, "expecting 3 arguments", NULL);
+		return -1;
+	}
+
+	if (!isarray(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "first argument must be an array", NULL);
+		return -2;
+	}
+
+	if (!isint(&argv[1]) || !isint(&argv[2])) {
+		spn_ctx_runtime_error(ctx, "second and third arguments must be integers", NULL);
+		return -2;
+	}
+
+	arr = arrayvalue(&argv[0]);
+	idx_a = intvalue(&argv[1]);
+	idx_b = intvalue(&argv[2]);
+
+	n = spn_array_count(arr);
+
+	if (idx_a < 0 || idx_a >= n
+	 || idx_b < 0 || idx_b >= n) {
+		long sn = n;
+		const void *args[2];
+		args[0] = idx_a < 0 || idx_a >= n ? &idx_a : &idx_b;
+		args[1] = &sn;
+		spn_ctx_runtime_error(ctx, "index %d is out of bounds for array of size %d", args);
+		return -3;
+	}
+
+	tmp_a = spn_array_get(arr, idx_a);
+	tmp_b = spn_array_get(arr, idx_b);
+
+	/* retain the original value of A, because it may
+	 * be released, causing premature deallocation:
+	 * when "arr[idx_a] = tmp_b" is executed, tmp_a may be released (if tmp_b is nil).
+	 * - However, tmp_b is safe without an additional retain,
+	 *   since by the time it may be released, it has already
+	 *   been retained by the first setter.
+	 */
+	spn_value_retain(&tmp_a);
+
+	spn_array_set(arr, idx_a, &tmp_b);
+	spn_array_set(arr, idx_b, &tmp_a);
+
+	spn_value_release(&tmp_a);
+
+	return 0;
+}
+
+static int rtlb_reverse(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	size_t i, n;
+	SpnArray *arr, *result;
+
+	if (argc != 1) {
+		spn_ctx_runtime_error(ctx, "expecting one argument", NULL);
+		return -1;
+	}
+
+	if (!isarray(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "argument must be an array", NULL);
+		return -2;
+	}
+
+	arr = arrayvalue(&argv[0]);
+	n = spn_array_count(arr);
+
+	*ret = makearray();
+	result = arrayvalue(ret);
+
+	/* copy elements of 'arr' into 'result' in reverse order */
+	for (i = n; i > 0; i--) {
+		SpnValue tmp = spn_array_get(arr, i - 1);
+		spn_array_push(result, &tmp);
+	}
+
+	return 0;
+}
+
+/* if "any" is nonzero, this function will return true if the
+ * predicate returns true for any of the elements in the array.
+ * if, however, "any" is zero, then it will only return true
+ * if the predicate is true for all of the elements.
+ */
+static int rtlb_aux_anyall(SpnValue *ret, int argc, SpnValue *argv, void *ctx, int any)
+{
+	size_t i, n;
+	SpnArray *arr;
+	SpnFunction *predicate;
+
+	if (argc != 2) {
+		spn_ctx_runtime_error(ctx, "expecting two arguments", NULL);
+		return -1;
+	}
+
+	if (!isarray(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "first argument must be an array", NULL);
+		return -2;
+	}
+
+	if (!isfunc(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "second argument must be a function", NULL);
+		return -3;
+	}
+
+	arr = arrayvalue(&argv[0]);
+	predicate = funcvalue(&argv[1]);
+
+	*ret = any ? spn_falseval : spn_trueval;
+
+	n = spn_array_count(arr);
+
+	for (i = 0; i < n; i++) {
+		SpnValue keyval[2]; /* item 0: value, item 1: index */
+		SpnValue result;
+
+		keyval[0] = spn_array_get(arr, i);
+		keyval[1] = makeint(i);
+
+		if (spn_ctx_callfunc(ctx, predicate, &result, COUNT(keyval), keyval) != 0) {
+			return -4;
+		}
+
+		if (!isbool(&result)) {
+			spn_value_release(&result);
+			spn_ctx_runtime_error(ctx, "predicate must return a Boolean", NULL);
+			return -5;
+		}
+
+		if (any && boolvalue(&result)) {
+			*ret = spn_trueval;
+			break;
+		} else if (!any && !boolvalue(&result)) {
+			*ret = spn_falseval;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static int rtlb_any(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	return rtlb_aux_anyall(ret, argc, argv, ctx, 1);
+}
+
+static int rtlb_all(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	return rtlb_aux_anyall(ret, argc, argv, ctx, 0);
+}
+
+static int rtlb_arr_find(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	size_t i, n;
+	SpnArray *arr;
+
+	if (argc != 2) {
+		spn_ctx_runtime_error(ctx, "expecting two arguments", NULL);
+		return -1;
+	}
+
+	if (!isarray(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "first argument must be an array", NULL);
+		return -2;
+	}
+
+	arr = arrayvalue(&argv[0]);
+	n = spn_array_count(arr);
+
+	for (i = 0; i < n; i++) {
+		SpnValue tmp = spn_array_get(arr, i);
+
+		if (spn_value_equal(&tmp, &argv[1])) {
+			*ret = makeint(i);
+			return 0;
+		}
+	}
+
+	*ret = makeint(-1);
+	return 0;
+}
+
+static int rtlb_pfind(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	size_t i, n;
+	SpnArray *arr;
+	SpnFunction *predicate;
+
+	if (argc != 2) {
+		spn_ctx_runtime_error(ctx, "expecting two arguments", NULL);
+		return -1;
+	}
+
+	if (!isarray(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "first argument must be an array", NULL);
+		return -2;
+	}
+
+	if (!isfunc(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "second argument must be a function", NULL);
+		return -3;
+	}
+
+	arr = arrayvalue(&argv[0]);
+	predicate = funcvalue(&argv[1]);
+	n = spn_array_count(arr);
+
+	for (i = 0; i < n; i++) {
+		SpnValue pret;
+		SpnValue tmp = spn_array_get(arr, i);
+
+		if (spn_ctx_callfunc(ctx, predicate, &pret, 1, &tmp) != 0) {
+			return -4;
+		}
+
+		if (!isbool(&pret)) {
+			spn_value_release(&pret);
+			spn_ctx_runtime_error(ctx, "predicate must return a Boolean", NULL);
+			return -5;
+		}
+
+		if (boolvalue(&pret)) {
+			*ret = makeint(i);
+			return 0;
+		}
+	}
+
+	*ret = makeint(-1);
+	return 0;
+}
+
+/* return value:
+ * > 0 if a < b
+ * = 0 if a >= b
+ * < 0 if an error occurred
+ */
+static int rtlb_aux_bsearch_compare(SpnValue vals[2], SpnFunction *predicate, SpnContext *ctx)
+{
+	const void *args[2];
+
+	if (predicate) {
+		SpnValue pret;
+		if (spn_ctx_callfunc(ctx, predicate, &pret, 2, vals) != 0) {
+			return -1;
+		}
+
+		if (!isbool(&pret)) {
+			spn_value_release(&pret);
+			spn_ctx_runtime_error(ctx, "predicate must return a Boolean", NULL);
+			return -2;
+		}
+
+		return boolvalue(&pret);
+	}
+
+	/* if no predicate was supplied, use the "<" operator */
+	if (spn_values_comparable(&vals[0], &vals[1])) {
+		/* "spn_value_compare(a, b) < 0" <=> "a < b" */
+		return spn_value_compare(&vals[0], &vals[1]) < 0;
+	}
+
+	/* if the values are not orderable, we're in trouble */
+	args[0] = spn_type_name(valtype(&vals[0]));
+	args[1] = spn_type_name(valtype(&vals[1]));
+	spn_ctx_runtime_error(ctx, "cannot compare values of type %s and %s", args);
+	return -3;
+}
+
+/* searches for elements in the range [lower, upper) */
 static int rtlb_aux_bsearch(SpnValue *ret, SpnArray *arr, const SpnValue *elem,
 	SpnFunction *predicate, SpnContext *ctx)
 {
-	size_t lower = 0;
-	size_t upper = spn_array_count(arr);
+	size_t lower = 0;
+	size_t upper = spn_array_count(arr);
+
+	while (lower < upper) {
+		/* this is never out of bounds since integer division truncates */
+		size_t middle = lower + (upper - lower) / 2;
+		int is_smaller, is_greater;
+		SpnValue tmp = spn_array_get(arr, middle);
+		SpnValue vals[2];
+
+		/* first, check if elem < middle */
+		vals[0] = *elem;
+		vals[1] = tmp;
+		is_smaller = rtlb_aux_bsearch_compare(vals, predicate, ctx);
+
+		/* check for errors */
+		if (is_smaller < 0) {
+			return -1;
+		}
+
+		/* key is smaller than middle element,
+		 * so we search the lower half of the array
+		 */
+		if (is_smaller > 0) {
+			upper = middle;
+			continue;
+		}
+
+		/* key was not smaller than middle element,
+		 * so check if "middle < elem"
+		 */
+		vals[0] = tmp;
+		vals[1] = *elem;
+		is_greater = rtlb_aux_bsearch_compare(vals, predicate, ctx);
+
+		/* check for errors again */
+		if (is_greater < 0) {
+			return -1;
+		}
+
+		/* key is greater than middle element, continue
+		 * search with upper half of the array
+		 */
+		if (is_greater > 0) {
+			lower = middle + 1;
+			continue;
+		}
+
+		/* otherwise, the key is neither smaller nor greater than
+		 * the middle element, so they are equal to each other
+		 */
+		*ret = makeint(middle);
+		return 0;
+	}
+
+	/* if we reach this point, then the size of the search range
+	 * has been reduced to zero: the element was not found
+	 */
+	assert(lower == upper);
+
+	*ret = makeint(-1);
+	return 0;
+}
+
+static int rtlb_bsearch(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnArray *arr;
+	SpnFunction *predicate;
+
+	if (argc < 2 || argc > 3) {
+		spn_ctx_runtime_error(ctx, "expecting 2 or 3 arguments", NULL);
+		return -1;
+	}
+
+	if (!isarray(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "first argument must be an array", NULL);
+		return -2;
+	}
+
+	if (argc >= 3 && !isfunc(&argv[2])) {
+		spn_ctx_runtime_error(ctx, "third argument must be a function", NULL);
+		return -3;
+	}
+
+	arr = arrayvalue(&argv[0]);
+	predicate = argc >= 3 ? funcvalue(&argv[2]) : NULL;
+
+	return rtlb_aux_bsearch(ret, arr, &argv[1], predicate, ctx);
+}
+
+static int rtlb_slice(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnArray *arr, *result;
+	long idx, len, n;
+
+	if (argc != 3) {
+		spn_ctx_runtime_error(ctx, "expecting 3 arguments", NULL);
+		return -1;
+	}
+
+	if (!isarray(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "first argument must be an array", NULL);
+		return -2;
+	}
+
+	if (!isint(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "second argument must be an integer index", NULL);
+		return -3;
+	}
+
+	if (!isint(&argv[2])) {
+		spn_ctx_runtime_error(ctx, "third argument must be an integer length", NULL);
+		return -4;
+	}
+
+	idx = intvalue(&argv[1]);
+	len = intvalue(&argv[2]);
+	arr = arrayvalue(&argv[0]);
+	n = spn_array_count(arr);
+
+	if (idx < 0 || idx > n) {
+		const void *args[2];
+		args[0] = &idx;
+		args[1] = &n;
+		spn_ctx_runtime_error(ctx, "starting index %d is out of bounds for array of length %d", args);
+		return -5;
+	}
+
+	if (len < 0) {
+		const void *args[1];
+		args[0] = &len;
+		spn_ctx_runtime_error(ctx, "length was negative (%d)", args);
+		return -6;
+	}
+
+	if (idx + len > n) {
+		const void *args[3];
+		long end = idx + len;
+		args[0] = &idx;
+		args[1] = &end;
+		args[2] = &n;
+		spn_ctx_runtime_error(ctx, "range [%d, %d) out of bounds for array of size %d", args);
+		return -7;
+	}
+
+	result = spn_array_slice(arr, idx, len);
+	*ret = spn_makeobject(SPN_TYPE_ARRAY, result);
+
+	return 0;
+}
+
+static int rtlb_insert(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnArray *arr;
+	long index, size;
+
+	if (argc != 3) {
+		spn_ctx_runtime_error(ctx, "expecting 3 arguments", NULL);
+		return -1;
+	}
+
+	if (!isarray(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "first argument must be an array", NULL);
+		return -2;
+	}
+
+	if (!isint(&argv[2])) {
+		spn_ctx_runtime_error(ctx, "third argument must be an integer", NULL);
+		return -3;
+	}
+
+	arr = arrayvalue(&argv[0]);
+	size = spn_array_count(arr);
+	index = intvalue(&argv[2]);
+
+	if (index < 0 || index > size) {
+		const void *args[2];
+		args[0] = &index;
+		args[1] = &size;
+		spn_ctx_runtime_error(ctx, "index %d out of bounds for array of size %d", args);
+		return -4;
+	}
+
+	if (rtlb_aux_accepts(arr, &argv[1], ctx) != 0) {
+		return -5;
+	}
+
+	spn_array_insert(arr, index, &argv[1]);
+
+	return 0;
+}
+
+static int rtlb_inject(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnArray *haystack, *needle;
+	long index, hsize;
+	size_t i, nsize;
+
+	if (argc < 2 || argc > 3) {
+		spn_ctx_runtime_error(ctx, "expecting 2 or 3 arguments", NULL);
+		return -1;
+	}
+
+	if (!isarray(&argv[0]) || !isarray(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "haystack and needle must be arrays", NULL);
+		return -2;
+	}
+
+	if (argc >= 3 && !isint(&argv[2])) {
+		spn_ctx_runtime_error(ctx, "index must be an integer", NULL);
+		return -3;
+	}
+
+	haystack = arrayvalue(&argv[0]);
+	needle = arrayvalue(&argv[1]);
+	hsize = spn_array_count(haystack);
+	index = argc >= 3 ? intvalue(&argv[2]) : hsize;
+
+	if (index < 0 || index > hsize) {
+		const void *args[2];
+		args[0] = &index;
+		args[1] = &hsize;
+		spn_ctx_runtime_error(ctx, "index %d out of bounds for array of size %d", args);
+		return -4;
+	}
+
+	nsize = spn_array_count(needle);
+
+	for (i = 0; i < nsize; i++) {
+		SpnValue val = spn_array_get(needle, i);
+
+		if (rtlb_aux_accepts(haystack, &val, ctx) != 0) {
+			return -5;
+		}
+	}
+
+	spn_array_inject(haystack, index, needle);
+
+	return 0;
+}
+
+static int rtlb_erase(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnArray *arr;
+	long index, n;
+
+	if (argc != 2) {
+		spn_ctx_runtime_error(ctx, "expecting 2 arguments", NULL);
+		return -1;
+	}
+
+	if (!isarray(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "first argument must be an array", NULL);
+		return -2;
+	}
+
+	if (!isint(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "second argument must be an integer index", NULL);
+		return -3;
+	}
+
+	arr = arrayvalue(&argv[0]);
+	n = spn_array_count(arr);
+	index = intvalue(&argv[1]);
+
+	if (index < 0 || index >= n) {
+		const void *args[2];
+		args[0] = &index;
+		args[1] = &n;
+		spn_ctx_runtime_error(ctx, "index %d out of bounds for array of size %d", args);
+		return -4;
+	}
+
+	spn_array_remove(arr, index);
+
+	return 0;
+}
+
+static int rtlb_concat(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnArray *result;
+	int i;
+
+	*ret = makearray();
+	result = arrayvalue(ret);
+
+	for (i = 0; i < argc; i++) {
+		SpnArray *arr;
+		size_t j, n;
+
+		if (!isarray(&argv[i])) {
+			const void *args[2];
+			int argidx = i + 1;
+			args[0] = &argidx;
+			args[1] = spn_type_name(valtype(&argv[i]));
+			spn_ctx_runtime_error(ctx, "arguments must be arrays (arg %i was %s)", args);
+			spn_value_release(ret);
+			return -1;
+		}
+
+		arr = arrayvalue(&argv[i]);
+		n = spn_array_count(arr);
+
+		for (j = 0; j < n; j++) {
+			SpnValue tmp = spn_array_get(arr, j);
+			spn_array_push(result, &tmp);
+		}
+	}
+
+	return 0;
+}
+
+static int rtlb_zipwith(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	size_t n, i;
+	SpnArray *seq_1, *seq_2, *result;
+	SpnFunction *transform;
+
+	if (argc != 3) {
+		spn_ctx_runtime_error(ctx, "expecting three arguments", NULL);
+		return -1;
+	}
+
+	if (!isarray(&argv[0]) || !isarray(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "first two arguments must be arrays", NULL);
+		return -2;
+	}
+
+	if (!isfunc(&argv[2])) {
+		spn_ctx_runtime_error(ctx, "third argument must be a function", NULL);
+		return -3;
+	}
+
+	seq_1 = arrayvalue(&argv[0]);
+	seq_2 = arrayvalue(&argv[1]);
+	transform = funcvalue(&argv[2]);
+
+	n = spn_array_count(seq_1);
+
+	if (spn_array_count(seq_2) != n) {
+		spn_ctx_runtime_error(ctx, "length of the sequences must be equal", NULL);
+		return -4;
+	}
+
+	*ret = makearray();
+	result = arrayvalue(ret);
+
+	for (i = 0; i < n; i++) {
+		SpnValue tooth; /* one of the teeth of the zipper */
+		SpnValue args[2];
+
+		args[0] = spn_array_get(seq_1, i);
+		args[1] = spn_array_get(seq_2, i);
+
+		if (spn_ctx_callfunc(ctx, transform, &tooth, COUNT(args), args) != 0) {
+			spn_object_release(result);
+			return -5;
+		}
+
+		spn_array_push(result, &tooth);
+		spn_value_release(&tooth);
+	}
+
+	return 0;
+}
+
+/* creates a packed array, either of the given size and filled with zeroes,
+ * or with the elements of the given array
+ */
+static int rtlb_aux_packedarray(SpnValue *ret, int argc, SpnValue *argv, void *ctx, enum spn_array_kind kind)
+{
+	SpnArray *arr;
 
-	while (lower < upper) {
-		/* this is never out of bounds since integer division truncates */
-		size_t middle = lower + (upper - lower) / 2;
-		int is_smaller, is_greater;
-		SpnValue tmp = spn_array_get(arr, middle);
-		SpnValue vals[2];
+	if (argc != 1) {
+		spn_ctx_runtime_error(ctx, "expecting one argument", NULL);
+		return -1;
+	}
 
-		/* first, check if elem < middle */
-		vals[0] = *elem;
-		vals[1] = tmp;
-		is_smaller = rtlb_aux_bsearch_compare(vals, predicate, ctx);
+	if (isint(&argv[0])) {
+		if (intvalue(&argv[0]) < 0) {
+			spn_ctx_runtime_error(ctx, "size must not be negative", NULL);
+			return -2;
+		}
 
-		/* check for errors */
-		if (is_smaller < 0) {
-			return -1;
+		arr = spn_array_new_packed(kind);
+		spn_array_setsize(arr, intvalue(&argv[0]));
+	} else if (isarray(&argv[0])) {
+		SpnArray *orig = arrayvalue(&argv[0]);
+		size_t i, n = spn_array_count(orig);
+
+		arr = spn_array_new_packed(kind);
+		spn_array_reserve(arr, n);
+
+		for (i = 0; i < n; i++) {
+			SpnValue val = spn_array_get(orig, i);
+
+			if (rtlb_aux_accepts(arr, &val, ctx) != 0) {
+				spn_object_release(arr);
+				return -3;
+			}
+
+			spn_array_push(arr, &val);
 		}
+	} else {
+		spn_ctx_runtime_error(ctx, "argument must be an integer or an array", NULL);
+		return -4;
+	}
 
-		/* key is smaller than middle element,
-		 * so we search the lower half of the array
-		 */
-		if (is_smaller > 0) {
-			upper = middle;
-			continue;
+	*ret = spn_makeobject(SPN_TYPE_ARRAY, arr);
+	return 0;
+}
+
+static int rtlb_intarray(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+
+	return rtlb_aux_packedarray(ret, argc, argv, ctx, SPN_ARRAY_INTS);
+}
+
+static int rtlb_floatarray(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+
+	return rtlb_aux_packedarray(ret, argc, argv, ctx, SPN_ARRAY_FLOATS);
+}
+
+static int rtlb_bytearray(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+
+	return rtlb_aux_packedarray(ret, argc, argv, ctx, SPN_ARRAY_BYTES);
+}
+
+/* Numeric kernels.
+ * The arithmetic methods of arrays (sum(), dot(), min(), max(), scale(),
+ * add(), mul() and prefixsum()) operate on a whole array of numbers in one
+ * go, instead of calling back into the virtual machine for every element.
+ * Floating-point arrays are processed by the kernels below, which use SSE2
+ * on x86, as well as AVX2 if the processor turns out to support it at run
+ * time, and portable scalar code elsewhere. Reductions keep several partial
+ * results, so sums may differ in the last bits from a left-to-right loop.
+ * However, every code path uses the same layout of partial results (see
+ * vec_sum() and vec_prefixsum()), so the results don't depend on which
+ * one runs. Integer arrays are processed by plain loops, with wrap-around
+ * arithmetic.
+ */
+#if USE_SIMD && defined(__SSE2__)
+#define RTLB_SSE2 1
+#include <emmintrin.h>
+#else
+#define RTLB_SSE2 0
+#endif
+
+#if RTLB_SSE2 && (__GNUC__ >= 5 || defined(__clang__))
+#define RTLB_AVX2 1
+#include <immintrin.h>
+#define AVX2_TARGET __attribute__((__target__("avx2")))
+#else
+#define RTLB_AVX2 0
+#endif
+
+/* number of partial sums kept by vec_sum() */
+#define VEC_LANES 8
+
+enum vec_op {
+	VEC_ADD,   /* x[i] + y[i] */
+	VEC_MUL,   /* x[i] * y[i] */
+	VEC_SCALE  /* x[i] * k    */
+};
+
+/* The lesser (or the greater, if 'max' is nonzero) of two numbers, neither
+ * of which is NaN. -0.0 counts as less than +0.0, so that the result never
+ * depends on the order in which the elements are compared.
+ */
+static double minmax2(double a, double b, int max)
+{
+	if (a == b) {
+		/* equal numbers have the same bits, except for zeroes */
+		int a_negzero = a == 0.0 && 1.0 / a < 0.0;
+		return a_negzero != max ? a : b;
+	}
+
+	return (max ? a > b : a < b) ? a : b;
+}
+
+#if RTLB_SSE2
+
+/* minmax2() on two lanes at once. Lanes involving a NaN yield garbage,
+ * so vec_minmax() checks for NaNs separately.
+ * (MINPD and MAXPD return the second operand if the operands are equal.)
+ */
+static __m128d vec_minmax2_sse2(__m128d m, __m128d a, int max)
+{
+	__m128d eq = _mm_cmpeq_pd(a, m);
+
+	if (max) {
+		return _mm_andnot_pd(_mm_andnot_pd(a, eq), _mm_max_pd(a, m));
+	}
+
+	return _mm_or_pd(_mm_min_pd(a, m), _mm_and_pd(eq, a));
+}
+
+#endif /* RTLB_SSE2 */
+
+#if RTLB_AVX2
+
+static int has_avx2(void)
+{
+	static int supported = -1;
+
+	if (supported < 0) {
+		__builtin_cpu_init();
+		supported = __builtin_cpu_supports("avx2") != 0;
+	}
+
+	return supported;
+}
+
+AVX2_TARGET
+static size_t vec_sum_avx2(const double *x, const double *y, size_t n, double *result)
+{
+	__m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+	__m128d s;
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256d a = _mm256_loadu_pd(x + i), b = _mm256_loadu_pd(x + i + 4);
+
+		if (y != NULL) {
+			a = _mm256_mul_pd(a, _mm256_loadu_pd(y + i));
+			b = _mm256_mul_pd(b, _mm256_loadu_pd(y + i + 4));
 		}
 
-		/* key was not smaller than middle element,
-		 * so check if "middle < elem"
-		 */
-		vals[0] = tmp;
-		vals[1] = *elem;
-		is_greater = rtlb_aux_bsearch_compare(vals, predicate, ctx);
+		s0 = _mm256_add_pd(s0, a);
+		s1 = _mm256_add_pd(s1, b);
+	}
 
-		/* check for errors again */
-		if (is_greater < 0) {
-			return -1;
+	/* see vec_sum() for the order of additions */
+	s0 = _mm256_add_pd(s0, s1);
+	s = _mm_add_pd(_mm256_castpd256_pd128(s0), _mm256_extractf128_pd(s0, 1));
+	*result = _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+
+	return i;
+}
+
+/* the AVX2 version of vec_minmax2_sse2() */
+AVX2_TARGET
+static __m256d vec_minmax2_avx2(__m256d m, __m256d a, int max)
+{
+	__m256d eq = _mm256_cmp_pd(a, m, _CMP_EQ_OQ);
+
+	if (max) {
+		return _mm256_andnot_pd(_mm256_andnot_pd(a, eq), _mm256_max_pd(a, m));
+	}
+
+	return _mm256_or_pd(_mm256_min_pd(a, m), _mm256_and_pd(eq, a));
+}
+
+AVX2_TARGET
+static size_t vec_minmax_avx2(const double *x, size_t n, int max, double *result, int *unordered)
+{
+	__m256d m0 = _mm256_set1_pd(x[0]), m1 = m0;
+	__m256d u0 = _mm256_setzero_pd(), u1 = u0;
+	double lanes[4];
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256d a = _mm256_loadu_pd(x + i), b = _mm256_loadu_pd(x + i + 4);
+		m0 = vec_minmax2_avx2(m0, a, max);
+		m1 = vec_minmax2_avx2(m1, b, max);
+		u0 = _mm256_or_pd(u0, _mm256_cmp_pd(a, a, _CMP_UNORD_Q));
+		u1 = _mm256_or_pd(u1, _mm256_cmp_pd(b, b, _CMP_UNORD_Q));
+	}
+
+	_mm256_storeu_pd(lanes, vec_minmax2_avx2(m0, m1, max));
+	*unordered = _mm256_movemask_pd(_mm256_or_pd(u0, u1)) != 0;
+	*result = minmax2(minmax2(lanes[0], lanes[1], max), minmax2(lanes[2], lanes[3], max), max);
+
+	return i;
+}
+
+AVX2_TARGET
+static size_t vec_map_avx2(double *dst, const double *x, const double *y, double k, size_t n, enum vec_op op)
+{
+	__m256d vk = _mm256_set1_pd(k);
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m256d a = _mm256_loadu_pd(x + i);
+
+		switch (op) {
+		case VEC_ADD:   a = _mm256_add_pd(a, _mm256_loadu_pd(y + i)); break;
+		case VEC_MUL:   a = _mm256_mul_pd(a, _mm256_loadu_pd(y + i)); break;
+		case VEC_SCALE: a = _mm256_mul_pd(a, vk);                     break;
 		}
 
-		/* key is greater than middle element, continue
-		 * search with upper half of the array
-		 */
-		if (is_greater > 0) {
-			lower = middle + 1;
-			continue;
+		_mm256_storeu_pd(dst + i, a);
+	}
+
+	return i;
+}
+
+#endif /* RTLB_AVX2 */
+
+/* Sum of x[i], or of x[i] * y[i] if 'y' is not NULL.
+ * The first n - n % VEC_LANES elements are added up in VEC_LANES partial
+ * sums (s[i % VEC_LANES] += x[i]), which are then combined as
+ * ((s0 + s4) + (s2 + s6)) + ((s1 + s5) + (s3 + s7)). This is what the
+ * 8 lanes of two AVX registers or of four SSE registers amount to, and
+ * it's what the scalar code does as well. The remaining elements are
+ * added one by one.
+ */
+static double vec_sum(const double *x, const double *y, size_t n)
+{
+	double s = 0.0;
+	size_t i = 0;
+
+#if RTLB_AVX2
+	if (has_avx2()) {
+		i = vec_sum_avx2(x, y, n, &s);
+	} else
+#endif /* RTLB_AVX2 */
+	{
+#if RTLB_SSE2
+		__m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+		__m128d s2 = _mm_setzero_pd(), s3 = _mm_setzero_pd();
+
+		for (; i + VEC_LANES <= n; i += VEC_LANES) {
+			__m128d a = _mm_loadu_pd(x + i), b = _mm_loadu_pd(x + i + 2);
+			__m128d c = _mm_loadu_pd(x + i + 4), d = _mm_loadu_pd(x + i + 6);
+
+			if (y != NULL) {
+				a = _mm_mul_pd(a, _mm_loadu_pd(y + i));
+				b = _mm_mul_pd(b, _mm_loadu_pd(y + i + 2));
+				c = _mm_mul_pd(c, _mm_loadu_pd(y + i + 4));
+				d = _mm_mul_pd(d, _mm_loadu_pd(y + i + 6));
+			}
+
+			s0 = _mm_add_pd(s0, a);
+			s1 = _mm_add_pd(s1, b);
+			s2 = _mm_add_pd(s2, c);
+			s3 = _mm_add_pd(s3, d);
 		}
 
-		/* otherwise, the key is neither smaller nor greater than
-		 * the middle element, so they are equal to each other
-		 */
-		*ret = makeint(middle);
+		s0 = _mm_add_pd(_mm_add_pd(s0, s2), _mm_add_pd(s1, s3));
+		s = _mm_cvtsd_f64(_mm_add_sd(s0, _mm_unpackhi_pd(s0, s0)));
+#else
+		double p[VEC_LANES] = { 0.0 };
+		size_t j;
+
+		for (; i + VEC_LANES <= n; i += VEC_LANES) {
+			for (j = 0; j < VEC_LANES; j++) {
+				p[j] += y != NULL ? x[i + j] * y[i + j] : x[i + j];
+			}
+		}
+
+		s = ((p[0] + p[4]) + (p[2] + p[6])) + ((p[1] + p[5]) + (p[3] + p[7]));
+#endif /* RTLB_SSE2 */
+	}
+
+	for (; i < n; i++) {
+		s += y != NULL ? x[i] * y[i] : x[i];
+	}
+
+	return s;
+}
+
+/* Minimum or maximum of x[i]; 'n' must not be 0. Whichever code path
+ * runs, the result is the first NaN if there are any, otherwise the
+ * least (or greatest) element, where -0.0 is less than +0.0.
+ */
+static double vec_minmax(const double *x, size_t n, int max)
+{
+	double m = x[0];
+	size_t i = 0;
+	int unordered = 0; /* whether the vector code has seen a NaN */
+
+#if RTLB_AVX2
+	if (has_avx2()) {
+		i = vec_minmax_avx2(x, n, max, &m, &unordered);
+	} else
+#endif /* RTLB_AVX2 */
+	{
+#if RTLB_SSE2
+		__m128d v0 = _mm_set1_pd(x[0]), v1 = v0;
+		__m128d u0 = _mm_setzero_pd(), u1 = u0;
+		double lanes[2];
+
+		for (; i + 4 <= n; i += 4) {
+			__m128d a = _mm_loadu_pd(x + i), b = _mm_loadu_pd(x + i + 2);
+			v0 = vec_minmax2_sse2(v0, a, max);
+			v1 = vec_minmax2_sse2(v1, b, max);
+			u0 = _mm_or_pd(u0, _mm_cmpunord_pd(a, a));
+			u1 = _mm_or_pd(u1, _mm_cmpunord_pd(b, b));
+		}
+
+		_mm_storeu_pd(lanes, vec_minmax2_sse2(v0, v1, max));
+		m = minmax2(lanes[0], lanes[1], max);
+		unordered = _mm_movemask_pd(_mm_or_pd(u0, u1)) != 0;
+#endif /* RTLB_SSE2 */
+	}
+
+	if (unordered) {
+		for (i = 0; x[i] == x[i]; i++) {}
+		return x[i];
+	}
+
+	for (; i < n; i++) {
+		if (x[i] != x[i]) {
+			return x[i];
+		}
+
+		m = minmax2(m, x[i], max);
+	}
+
+	return m;
+}
+
+/* dst[i] = x[i] <op> y[i] (or k) */
+static void vec_map(double *dst, const double *x, const double *y, double k, size_t n, enum vec_op op)
+{
+	size_t i = 0;
+
+#if RTLB_AVX2
+	if (has_avx2()) {
+		i = vec_map_avx2(dst, x, y, k, n, op);
+	} else
+#endif /* RTLB_AVX2 */
+	{
+#if RTLB_SSE2
+		__m128d vk = _mm_set1_pd(k);
+
+		for (; i + 2 <= n; i += 2) {
+			__m128d a = _mm_loadu_pd(x + i);
+
+			switch (op) {
+			case VEC_ADD:   a = _mm_add_pd(a, _mm_loadu_pd(y + i)); break;
+			case VEC_MUL:   a = _mm_mul_pd(a, _mm_loadu_pd(y + i)); break;
+			case VEC_SCALE: a = _mm_mul_pd(a, vk);                  break;
+			}
+
+			_mm_storeu_pd(dst + i, a);
+		}
+#endif /* RTLB_SSE2 */
+	}
+
+	for (; i < n; i++) {
+		switch (op) {
+		case VEC_ADD:   dst[i] = x[i] + y[i]; break;
+		case VEC_MUL:   dst[i] = x[i] * y[i]; break;
+		case VEC_SCALE: dst[i] = x[i] * k;    break;
+		}
+	}
+}
+
+/* dst[i] = x[0] + ... + x[i]. Each pair of elements is scanned
+ * within a register, then the running total is added to both.
+ * The scalar code adds up pairs the same way.
+ */
+static void vec_prefixsum(double *dst, const double *x, size_t n)
+{
+	double s = 0.0;
+	size_t i = 0;
+
+#if RTLB_SSE2
+	__m128d carry = _mm_setzero_pd();
+
+	for (; i + 2 <= n; i += 2) {
+		__m128d a = _mm_loadu_pd(x + i);
+		a = _mm_add_pd(a, _mm_unpacklo_pd(_mm_setzero_pd(), a));
+		a = _mm_add_pd(a, carry);
+		_mm_storeu_pd(dst + i, a);
+		carry = _mm_unpackhi_pd(a, a);
+	}
+
+	s = _mm_cvtsd_f64(carry);
+#else
+	for (; i + 2 <= n; i += 2) {
+		double a = x[i], b = x[i + 1];
+		dst[i] = (a + 0.0) + s;
+		dst[i + 1] = (b + a) + s;
+		s = dst[i + 1];
+	}
+#endif /* RTLB_SSE2 */
+
+	for (; i < n; i++) {
+		s += x[i];
+		dst[i] = s;
+	}
+}
+
+/* the integer counterparts of the kernels above */
+static long veci_sum(const long *x, const long *y, size_t n)
+{
+	unsigned long s = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		s += y != NULL ? (unsigned long)(x[i]) * (unsigned long)(y[i]) : (unsigned long)(x[i]);
+	}
+
+	return s;
+}
+
+static long veci_minmax(const long *x, size_t n, int max)
+{
+	long m = x[0];
+	size_t i;
+
+	for (i = 1; i < n; i++) {
+		if (max ? x[i] > m : x[i] < m) {
+			m = x[i];
+		}
+	}
+
+	return m;
+}
+
+static void veci_map(long *dst, const long *x, const long *y, long k, size_t n, enum vec_op op)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		unsigned long a = x[i];
+
+		switch (op) {
+		case VEC_ADD:   dst[i] = a + (unsigned long)(y[i]); break;
+		case VEC_MUL:   dst[i] = a * (unsigned long)(y[i]); break;
+		case VEC_SCALE: dst[i] = a * (unsigned long)(k);    break;
+		}
+	}
+}
+
+static void veci_prefixsum(long *dst, const long *x, size_t n)
+{
+	unsigned long s = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		s += x[i];
+		dst[i] = s;
+	}
+}
+
+/* An array of numbers, as seen by the kernels: the storage of a packed
+ * array of integers or floats, or otherwise a temporary copy of the
+ * elements, as integers if all of them are integers, as floats if not.
+ */
+typedef struct NumVec {
+	enum spn_array_kind kind;   /* SPN_ARRAY_INTS or SPN_ARRAY_FLOATS */
+	const long         *ints;
+	const double       *floats;
+	size_t              n;
+	void               *buf;    /* the temporary copy, if any */
+} NumVec;
+
+static int numvec_init(NumVec *v, const SpnValue *val, void *ctx)
+{
+	SpnArray *arr = arrayvalue(val);
+	size_t i, n = spn_array_count(arr);
+	long *ints;
+	double *floats;
+
+	v->n = n;
+	v->ints = NULL;
+	v->floats = NULL;
+	v->buf = NULL;
+
+	switch (spn_array_kind(arr)) {
+	case SPN_ARRAY_INTS:
+		v->kind = SPN_ARRAY_INTS;
+		v->ints = arr->vector.ints;
+		return 0;
+	case SPN_ARRAY_FLOATS:
+		v->kind = SPN_ARRAY_FLOATS;
+		v->floats = arr->vector.floats;
 		return 0;
+	default:
+		break;
 	}
 
-	/* if we reach this point, then the size of the search range
-	 * has been reduced to zero: the element was not found
-	 */
-	assert(lower == upper);
+	v->kind = SPN_ARRAY_INTS;
+
+	for (i = 0; i < n; i++) {
+		SpnValue elem = spn_array_get(arr, i);
+
+		if (!isnum(&elem)) {
+			spn_ctx_runtime_error(ctx, "array must contain numbers only", NULL);
+			return -1;
+		}
+
+		if (isfloat(&elem)) {
+			v->kind = SPN_ARRAY_FLOATS;
+		}
+	}
+
+	if (v->kind == SPN_ARRAY_INTS) {
+		v->ints = ints = spn_malloc(n * sizeof ints[0]);
+		v->buf = ints;
+
+		for (i = 0; i < n; i++) {
+			SpnValue elem = spn_array_get(arr, i);
+			ints[i] = intvalue(&elem);
+		}
+	} else {
+		v->floats = floats = spn_malloc(n * sizeof floats[0]);
+		v->buf = floats;
+
+		for (i = 0; i < n; i++) {
+			SpnValue elem = spn_array_get(arr, i);
+			floats[i] = isfloat(&elem) ? floatvalue(&elem) : intvalue(&elem);
+		}
+	}
 
-	*ret = makeint(-1);
 	return 0;
 }
 
-static int rtlb_bsearch(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
-{
-	SpnArray *arr;
-	SpnFunction *predicate;
+/* converts the elements to floating-point, if they are integers */
+static void numvec_tofloats(NumVec *v)
+{
+	double *floats;
+	size_t i;
 
-	if (argc < 2 || argc > 3) {
-		spn_ctx_runtime_error(ctx, "expecting 2 or 3 arguments", NULL);
-		return -1;
+	if (v->kind == SPN_ARRAY_FLOATS) {
+		return;
 	}
 
-	if (!isarray(&argv[0])) {
-		spn_ctx_runtime_error(ctx, "first argument must be an array", NULL);
-		return -2;
-	}
+	floats = spn_malloc(v->n * sizeof floats[0]);
 
-	if (argc >= 3 && !isfunc(&argv[2])) {
-		spn_ctx_runtime_error(ctx, "third argument must be a function", NULL);
-		return -3;
+	for (i = 0; i < v->n; i++) {
+		floats[i] = v->ints[i];
 	}
 
-	arr = arrayvalue(&argv[0]);
-	predicate = argc >= 3 ? funcvalue(&argv[2]) : NULL;
+	free(v->buf);
+	v->buf = floats;
+	v->floats = floats;
+	v->ints = NULL;
+	v->kind = SPN_ARRAY_FLOATS;
+}
 
-	return rtlb_aux_bsearch(ret, arr, &argv[1], predicate, ctx);
+static void numvec_free(NumVec *v)
+{
+	free(v->buf);
 }
 
-static int rtlb_slice(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+/* Parses the arguments of the arithmetic methods: the array itself,
+ * then an optional second operand, which is an array of the same length
+ * if 'other' is not NULL, or a number otherwise. If either operand is
+ * not made of integers only, both are converted to floating-point.
+ */
+static int rtlb_aux_numvec_args(NumVec *self, NumVec *other, SpnValue *scalar, int argc, SpnValue *argv, void *ctx)
 {
-	SpnArray *arr, *result;
-	long i, idx, len, n;
+	int nargs = other != NULL || scalar != NULL ? 2 : 1;
 
-	if (argc != 3) {
-		spn_ctx_runtime_error(ctx, "expecting 3 arguments", NULL);
+	if (argc != nargs) {
+		spn_ctx_runtime_error(ctx, nargs == 2 ? "expecting two arguments" : "expecting one argument", NULL);
 		return -1;
 	}
 
@@ -2041,261 +3527,211 @@ static int rtlb_slice(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		return -2;
 	}
 
-	if (!isint(&argv[1])) {
-		spn_ctx_runtime_error(ctx, "second argument must be an integer index", NULL);
-		return -3;
+	if (other != NULL && !isarray(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "second argument must be an array", NULL);
+		return -2;
 	}
 
-	if (!isint(&argv[2])) {
-		spn_ctx_runtime_error(ctx, "third argument must be an integer length", NULL);
-		return -4;
+	if (scalar != NULL && !isnum(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "second argument must be a number", NULL);
+		return -2;
 	}
 
-	idx = intvalue(&argv[1]);
-	len = intvalue(&argv[2]);
-	arr = arrayvalue(&argv[0]);
-	n = spn_array_count(arr);
-
-	if (idx < 0 || idx > n) {
-		const void *args[2];
-		args[0] = &idx;
-		args[1] = &n;
-		spn_ctx_runtime_error(ctx, "starting index %d is out of bounds for array of length %d", args);
-		return -5;
+	if (numvec_init(self, &argv[0], ctx) != 0) {
+		return -3;
 	}
 
-	if (len < 0) {
-		const void *args[1];
-		args[0] = &len;
-		spn_ctx_runtime_error(ctx, "length was negative (%d)", args);
-		return -6;
-	}
+	if (other != NULL) {
+		if (numvec_init(other, &argv[1], ctx) != 0) {
+			numvec_free(self);
+			return -3;
+		}
 
-	if (idx + len > n) {
-		const void *args[3];
-		long end = idx + len;
-		args[0] = &idx;
-		args[1] = &end;
-		args[2] = &n;
-		spn_ctx_runtime_error(ctx, "range [%d, %d) out of bounds for array of size %d", args);
-		return -7;
+		if (other->n != self->n) {
+			spn_ctx_runtime_error(ctx, "arrays must be of the same length", NULL);
+			numvec_free(self);
+			numvec_free(other);
+			return -4;
+		}
+
+		if (self->kind != other->kind) {
+			numvec_tofloats(self);
+			numvec_tofloats(other);
+		}
 	}
 
-	*ret = makearray();
-	result = arrayvalue(ret);
+	if (scalar != NULL) {
+		*scalar = argv[1];
 
-	for (i = 0; i < len; i++) {
-		SpnValue tmp = spn_array_get(arr, idx + i);
-		spn_array_push(result, &tmp);
+		if (isfloat(scalar)) {
+			numvec_tofloats(self);
+		}
 	}
 
 	return 0;
 }
 
-static int rtlb_insert(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+/* creates a new packed array of the kind of 'v', to store the result in */
+static void *rtlb_aux_numvec_result(SpnValue *ret, const NumVec *v)
 {
-	SpnArray *arr;
-	long index, size;
-
-	if (argc != 3) {
-		spn_ctx_runtime_error(ctx, "expecting 3 arguments", NULL);
-		return -1;
-	}
+	SpnArray *arr = spn_array_new_packed(v->kind);
+	spn_array_setsize(arr, v->n);
+	*ret = spn_makeobject(SPN_TYPE_ARRAY, arr);
+	return spn_array_data(arr);
+}
 
-	if (!isarray(&argv[0])) {
-		spn_ctx_runtime_error(ctx, "first argument must be an array", NULL);
-		return -2;
-	}
+static int rtlb_arr_sum(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	NumVec self;
 
-	if (!isint(&argv[2])) {
-		spn_ctx_runtime_error(ctx, "third argument must be an integer", NULL);
-		return -3;
+	if (rtlb_aux_numvec_args(&self, NULL, NULL, argc, argv, ctx) != 0) {
+		return -1;
 	}
 
-	arr = arrayvalue(&argv[0]);
-	size = spn_array_count(arr);
-	index = intvalue(&argv[2]);
-
-	if (index < 0 || index > size) {
-		const void *args[2];
-		args[0] = &index;
-		args[1] = &size;
-		spn_ctx_runtime_error(ctx, "index %d out of bounds for array of size %d", args);
-		return -4;
+	if (self.kind == SPN_ARRAY_INTS) {
+		*ret = makeint(veci_sum(self.ints, NULL, self.n));
+	} else {
+		*ret = makefloat(vec_sum(self.floats, NULL, self.n));
 	}
 
-	spn_array_insert(arr, index, &argv[1]);
-
+	numvec_free(&self);
 	return 0;
 }
 
-static int rtlb_inject(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_arr_dot(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
-	SpnArray *haystack, *needle;
-	long index, hsize;
+	NumVec self, other;
 
-	if (argc < 2 || argc > 3) {
-		spn_ctx_runtime_error(ctx, "expecting 2 or 3 arguments", NULL);
+	if (rtlb_aux_numvec_args(&self, &other, NULL, argc, argv, ctx) != 0) {
 		return -1;
 	}
 
-	if (!isarray(&argv[0]) || !isarray(&argv[1])) {
-		spn_ctx_runtime_error(ctx, "haystack and needle must be arrays", NULL);
-		return -2;
-	}
-
-	if (argc >= 3 && !isint(&argv[2])) {
-		spn_ctx_runtime_error(ctx, "index must be an integer", NULL);
-		return -3;
-	}
-
-	haystack = arrayvalue(&argv[0]);
-	needle = arrayvalue(&argv[1]);
-	hsize = spn_array_count(haystack);
-	index = argc >= 3 ? intvalue(&argv[2]) : hsize;
-
-	if (index < 0 || index > hsize) {
-		const void *args[2];
-		args[0] = &index;
-		args[1] = &hsize;
-		spn_ctx_runtime_error(ctx, "index %d out of bounds for array of size %d", args);
-		return -4;
+	if (self.kind == SPN_ARRAY_INTS) {
+		*ret = makeint(veci_sum(self.ints, other.ints, self.n));
+	} else {
+		*ret = makefloat(vec_sum(self.floats, other.floats, self.n));
 	}
 
-	spn_array_inject(haystack, index, needle);
-
+	numvec_free(&self);
+	numvec_free(&other);
 	return 0;
 }
 
-static int rtlb_erase(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_aux_minmax(SpnValue *ret, int argc, SpnValue *argv, void *ctx, int max)
 {
-	SpnArray *arr;
-	long index, n;
+	NumVec self;
 
-	if (argc != 2) {
-		spn_ctx_runtime_error(ctx, "expecting 2 arguments", NULL);
+	if (rtlb_aux_numvec_args(&self, NULL, NULL, argc, argv, ctx) != 0) {
 		return -1;
 	}
 
-	if (!isarray(&argv[0])) {
-		spn_ctx_runtime_error(ctx, "first argument must be an array", NULL);
+	if (self.n == 0) {
+		spn_ctx_runtime_error(ctx, "array must not be empty", NULL);
+		numvec_free(&self);
 		return -2;
 	}
 
-	if (!isint(&argv[1])) {
-		spn_ctx_runtime_error(ctx, "second argument must be an integer index", NULL);
-		return -3;
+	if (self.kind == SPN_ARRAY_INTS) {
+		*ret = makeint(veci_minmax(self.ints, self.n, max));
+	} else {
+		*ret = makefloat(vec_minmax(self.floats, self.n, max));
 	}
 
-	arr = arrayvalue(&argv[0]);
-	n = spn_array_count(arr);
-	index = intvalue(&argv[1]);
-
-	if (index < 0 || index >= n) {
-		const void *args[2];
-		args[0] = &index;
-		args[1] = &n;
-		spn_ctx_runtime_error(ctx, "index %d out of bounds for array of size %d", args);
-		return -4;
-	}
+	numvec_free(&self);
+	return 0;
+}
 
-	spn_array_remove(arr, index);
+static int rtlb_arr_min(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
 
-	return 0;
+	return rtlb_aux_minmax(ret, argc, argv, ctx, 0);
 }
 
-static int rtlb_concat(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_arr_max(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
-	SpnArray *result;
-	int i;
 
-	*ret = makearray();
-	result = arrayvalue(ret);
+	return rtlb_aux_minmax(ret, argc, argv, ctx, 1);
+}
 
-	for (i = 0; i < argc; i++) {
-		SpnArray *arr;
-		size_t j, n;
+static int rtlb_aux_elementwise(SpnValue *ret, int argc, SpnValue *argv, void *ctx, enum vec_op op)
+{
+	NumVec self, other;
+	SpnValue k = makeint(0);
+	void *dst;
 
-		if (!isarray(&argv[i])) {
-			const void *args[2];
-			int argidx = i + 1;
-			args[0] = &argidx;
-			args[1] = spn_type_name(argv[i].type);
-			spn_ctx_runtime_error(ctx, "arguments must be arrays (arg %i was %s)", args);
-			spn_value_release(ret);
+	if (op == VEC_SCALE) {
+		if (rtlb_aux_numvec_args(&self, NULL, &k, argc, argv, ctx) != 0) {
 			return -1;
 		}
 
-		arr = arrayvalue(&argv[i]);
-		n = spn_array_count(arr);
-
-		for (j = 0; j < n; j++) {
-			SpnValue tmp = spn_array_get(arr, j);
-			spn_array_push(result, &tmp);
+		other = self;
+		other.buf = NULL;
+	} else {
+		if (rtlb_aux_numvec_args(&self, &other, NULL, argc, argv, ctx) != 0) {
+			return -1;
 		}
 	}
 
+	dst = rtlb_aux_numvec_result(ret, &self);
+
+	if (self.kind == SPN_ARRAY_INTS) {
+		veci_map(dst, self.ints, other.ints, intvalue(&k), self.n, op);
+	} else {
+		double kf = isfloat(&k) ? floatvalue(&k) : intvalue(&k);
+		vec_map(dst, self.floats, other.floats, kf, self.n, op);
+	}
+
+	numvec_free(&self);
+	numvec_free(&other);
 	return 0;
 }
 
-static int rtlb_zipwith(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_arr_scale(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
-	size_t n, i;
-	SpnArray *seq_1, *seq_2, *result;
-	SpnFunction *transform;
-
-	if (argc != 3) {
-		spn_ctx_runtime_error(ctx, "expecting three arguments", NULL);
-		return -1;
-	}
-
-	if (!isarray(&argv[0]) || !isarray(&argv[1])) {
-		spn_ctx_runtime_error(ctx, "first two arguments must be arrays", NULL);
-		return -2;
-	}
 
-	if (!isfunc(&argv[2])) {
-		spn_ctx_runtime_error(ctx, "third argument must be a function", NULL);
-		return -3;
-	}
+	return rtlb_aux_elementwise(ret, argc, argv, ctx, VEC_SCALE);
+}
 
-	seq_1 = arrayvalue(&argv[0]);
-	seq_2 = arrayvalue(&argv[1]);
-	transform = funcvalue(&argv[2]);
+static int rtlb_arr_add(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
 
-	n = spn_array_count(seq_1);
+	return rtlb_aux_elementwise(ret, argc, argv, ctx, VEC_ADD);
+}
 
-	if (spn_array_count(seq_2) != n) {
-		spn_ctx_runtime_error(ctx, "length of the sequences must be equal", NULL);
-		return -4;
-	}
+static int rtlb_arr_mul(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
 
-	*ret = makearray();
-	result = arrayvalue(ret);
+	return rtlb_aux_elementwise(ret, argc, argv, ctx, VEC_MUL);
+}
 
-	for (i = 0; i < n; i++) {
-		SpnValue tooth; /* one of the teeth of the zipper */
-		SpnValue args[2];
+static int rtlb_arr_prefixsum(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	NumVec self;
+	void *dst;
 
-		args[0] = spn_array_get(seq_1, i);
-		args[1] = spn_array_get(seq_2, i);
+	if (rtlb_aux_numvec_args(&self, NULL, NULL, argc, argv, ctx) != 0) {
+		return -1;
+	}
 
-		if (spn_ctx_callfunc(ctx, transform, &tooth, COUNT(args), args) != 0) {
-			spn_object_release(result);
-			return -5;
-		}
+	dst = rtlb_aux_numvec_result(ret, &self);
 
-		spn_array_push(result, &tooth);
-		spn_value_release(&tooth);
+	if (self.kind == SPN_ARRAY_INTS) {
+		veci_prefixsum(dst, self.ints, self.n);
+	} else {
+		vec_prefixsum(dst, self.floats, self.n);
 	}
 
+	numvec_free(&self);
 	return 0;
 }
 
 static void loadlib_array(SpnVMachine *vm)
 {
 	static const SpnExtFunc F[] = {
-		{ "zipwith", rtlb_zipwith }
+		{ "zipwith",    rtlb_zipwith    },
+		{ "intarray",   rtlb_intarray   },
+		{ "floatarray", rtlb_floatarray },
+		{ "bytearray",  rtlb_bytearray  }
 	};
 
 	/* Methods */
@@ -2317,10 +3753,19 @@ static void loadlib_array(SpnVMachine *vm)
 		{ "erase",      rtlb_erase         },
 		{ "concat",     rtlb_concat        },
 		{ "push",       rtlb_push          },
+		{ "reserve",    rtlb_array_reserve },
 		{ "pop",        rtlb_pop           },
 		{ "last",       rtlb_last          },
 		{ "swap",       rtlb_swap          },
-		{ "reverse",    rtlb_reverse       }
+		{ "reverse",    rtlb_reverse       },
+		{ "sum",        rtlb_arr_sum       },
+		{ "dot",        rtlb_arr_dot       },
+		{ "min",        rtlb_arr_min       },
+		{ "max",        rtlb_arr_max       },
+		{ "scale",      rtlb_arr_scale     },
+		{ "add",        rtlb_arr_add       },
+		{ "mul",        rtlb_arr_mul       },
+		{ "prefixsum",  rtlb_arr_prefixsum }
 	};
 
 	spn_vm_addlib_cfuncs(vm, NULL, F, COUNT(F));
@@ -2391,6 +3836,7 @@ static int rtlb_hashmap_map(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	result = spn_hashmap_new();
 	hm = hashmapvalue(&argv[0]);
 	transform = funcvalue(&argv[1]);
+	spn_hashmap_reserve(result, spn_hashmap_count(hm));
 
 	while ((cursor = spn_hashmap_next(hm, cursor, &valkey[1], &valkey[0])) != 0) {
 		SpnValue tmp;
@@ -2403,8 +3849,7 @@ static int rtlb_hashmap_map(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		spn_value_release(&tmp);
 	}
 
-	ret->type = SPN_TYPE_HASHMAP;
-	ret->v.o = result;
+	*ret = spn_makeobject(SPN_TYPE_HASHMAP, result);
 
 	return 0;
 }
@@ -2455,8 +3900,7 @@ static int rtlb_hashmap_filter(SpnValue *ret, int argc, SpnValue *argv, void *ct
 		}
 	}
 
-	ret->type = SPN_TYPE_HASHMAP;
-	ret->v.o = result;
+	*ret = spn_makeobject(SPN_TYPE_HASHMAP, result);
 
 	return 0;
 }
@@ -2485,6 +3929,7 @@ static int rtlb_aux_keyval(SpnValue *ret, int argc, SpnValue *argv, void *ctx, i
 	*ret = makearray();
 	result = arrayvalue(ret);
 	hm = hashmapvalue(&argv[0]);
+	spn_array_reserve(result, spn_hashmap_count(hm));
 
 	while ((it = spn_hashmap_next(hm, it, &key, &val)) != 0) {
 		spn_array_push(result, getvals ? &val : &key);
@@ -2493,6 +3938,33 @@ static int rtlb_aux_keyval(SpnValue *ret, int argc, SpnValue *argv, void *ctx, i
 	return 0;
 }
 
+static int rtlb_hashmap_reserve(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	if (argc != 2) {
+		spn_ctx_runtime_error(ctx, "expecting 2 arguments", NULL);
+		return -1;
+	}
+
+	if (!ishashmap(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "first argument must be a hashmap", NULL);
+		return -2;
+	}
+
+	if (!isint(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "second argument must be an integer", NULL);
+		return -3;
+	}
+
+	if (intvalue(&argv[1]) < 0) {
+		spn_ctx_runtime_error(ctx, "second argument must not be negative", NULL);
+		return -4;
+	}
+
+	spn_hashmap_reserve(hashmapvalue(&argv[0]), intvalue(&argv[1]));
+
+	return 0;
+}
+
 static int rtlb_keys(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
 
@@ -2533,6 +4005,8 @@ static int rtlb_zip(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		return -3;
 	}
 
+	spn_hashmap_reserve(result, n);
+
 	for (i = 0; i < n; i++) {
 		SpnValue key = spn_array_get(keys, i);
 		SpnValue val = spn_array_get(vals, i);
@@ -2554,7 +4028,8 @@ static void loadlib_hashmap(SpnVMachine *vm)
 		{ "map",     rtlb_hashmap_map     },
 		{ "filter",  rtlb_hashmap_filter  },
 		{ "keys",    rtlb_keys            },
-		{ "values",  rtlb_values          }
+		{ "values",  rtlb_values          },
+		{ "reserve", rtlb_hashmap_reserve }
 	};
 
 	spn_vm_addlib_cfuncs(vm, NULL, F, COUNT(F));
@@ -2966,9 +4441,9 @@ static int rtlb_abs(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	*ret = argv[0]; /* don't need to retain a number */
 
 	if (isfloat(ret)) {
-		ret->v.f = fabs(ret->v.f);
-	} else if (ret->v.i < 0) {
-		ret->v.i = -ret->v.i;
+		*ret = makefloat(fabs(floatvalue(ret)));
+	} else if (intvalue(ret) < 0) {
+		*ret = makeint(-intvalue(ret));
 	}
 
 	return 0;
@@ -3196,8 +4671,7 @@ static int rtlb_range(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		return -1; /* silence "used uninitialized" warning */
 	}
 
-	ret->type = SPN_TYPE_ARRAY;
-	ret->v.o = range;
+	*ret = spn_makeobject(SPN_TYPE_ARRAY, range);
 
 	return 0;
 }
@@ -3910,8 +5384,7 @@ static int rtlb_aux_gettm(SpnValue *ret, int argc, SpnValue *argv, SpnContext *c
 	spn_hashmap_set_strkey(hm, "isdst", &val);
 
 	/* return the array */
-	ret->type = SPN_TYPE_HASHMAP;
-	ret->v.o = hm;
+	*ret = spn_makeobject(SPN_TYPE_HASHMAP, hm);
 
 	return 0;
 }
@@ -4071,8 +5544,7 @@ static int rtlb_aux_parse(SpnValue *ret, int argc, SpnValue *argv, void *ctx, in
 		return -1;
 	}
 
-	ret->type = SPN_TYPE_HASHMAP;
-	ret->v.o = ast;
+	*ret = spn_makeobject(SPN_TYPE_HASHMAP, ast);
 	return 0;
 }
 
@@ -4110,8 +5582,7 @@ static int rtlb_compilestr(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	}
 
 	/* return function, make it owning */
-	ret->type = SPN_TYPE_FUNC;
-	ret->v.o = fn;
+	*ret = spn_makeobject(SPN_TYPE_FUNC, fn);
 	spn_value_retain(ret);
 
 	return 0;
@@ -4164,8 +5635,7 @@ static int rtlb_exprtofn(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		return -3;
 	}
 
-	ret->type = SPN_TYPE_FUNC;
-	ret->v.o = fn;
+	*ret = spn_makeobject(SPN_TYPE_FUNC, fn);
 	spn_value_retain(ret);
 
 	return 0;
@@ -4224,8 +5694,7 @@ static int rtlb_compileast(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		return -3;
 	}
 
-	ret->type = SPN_TYPE_FUNC;
-	ret->v.o = fn;
+	*ret = spn_makeobject(SPN_TYPE_FUNC, fn);
 	return 0;
 }
 
@@ -4380,8 +5849,7 @@ static int rtlb_backtrace(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 
 	free(bt);
 
-	ret->type = SPN_TYPE_ARRAY;
-	ret->v.o = fnames;
+	*ret = spn_makeobject(SPN_TYPE_ARRAY, fnames);
 	return 0;
 }
 
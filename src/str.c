@@ -33,11 +33,89 @@ static const SpnClass spn_class_string = {
 	free_string
 };
 
+/* Short strings keep their characters inline, right after the SpnString
+ * structure, so they need one allocation instead of two. There are two
+ * such classes, so that instances are not much larger than necessary.
+ * They have the same UID as 'spn_class_string', so for the rest of the
+ * engine, they are just strings ('cstr' points to the inline buffer).
+ */
+#define INLINE_CAP_SMALL 15
+#define INLINE_CAP_LARGE 31
+
+static const SpnClass spn_class_string_inline_small = {
+	sizeof(SpnString) + INLINE_CAP_SMALL + 1,
+	SPN_CLASS_UID_STRING,
+	equal_strings,
+	compare_strings,
+	hash_string,
+	free_string
+};
+
+static const SpnClass spn_class_string_inline_large = {
+	sizeof(SpnString) + INLINE_CAP_LARGE + 1,
+	SPN_CLASS_UID_STRING,
+	equal_strings,
+	compare_strings,
+	hash_string,
+	free_string
+};
+
+/* The VM's concatenation instructions don't copy results which are at
+ * least this long; they create a rope instead (see spn_string_concat_n()).
+ * Ropes are thus never shorter than this.
+ */
+#define ROPE_MIN_LEN 256
+
+static int is_unshared_rope(SpnString *str)
+{
+	return str->cstr == NULL && str->base.refcnt == 1;
+}
+
+/* Releases the two parts of a rope. Ropes built by appending in a loop
+ * can be very deep, so parts that are themselves ropes not referenced by
+ * anything else are taken apart here, iteratively, instead of letting
+ * their destructors recurse.
+ */
+static void free_rope(SpnString *rope)
+{
+	SpnString *lhs = rope->left;
+	SpnString *rhs = rope->right;
+
+	while (lhs != NULL) {
+		SpnString *next = NULL;
+
+		if (is_unshared_rope(lhs)) {
+			next = lhs;
+		} else {
+			spn_object_release(lhs);
+		}
+
+		if (next == NULL && is_unshared_rope(rhs)) {
+			next = rhs;
+		} else {
+			spn_object_release(rhs);
+		}
+
+		if (next == NULL) {
+			break;
+		}
+
+		/* 'next' is destroyed with its parts detached */
+		lhs = next->left;
+		rhs = next->right;
+		next->left = NULL;
+		next->right = NULL;
+		spn_object_release(next);
+	}
+}
+
 static void free_string(void *obj)
 {
 	SpnString *str = obj;
 
-	if (str->dealloc) {
+	if (str->cstr == NULL) {
+		free_rope(str);
+	} else if (str->dealloc) {
 		free(str->cstr);
 	}
 }
@@ -51,7 +129,11 @@ static int compare_strings(void *lp, void *rp)
 
 	size_t minlen = l_len < r_len ? l_len : r_len;
 
-	int res = memcmp(lhs->cstr, rhs->cstr, minlen);
+	int res = memcmp(
+		spn_string_flatten(lhs)->cstr,
+		spn_string_flatten(rhs)->cstr,
+		minlen
+	);
 
 	if (res != 0) {
 		return res;
@@ -62,7 +144,26 @@ static int compare_strings(void *lp, void *rp)
 
 static int equal_strings(void *lp, void *rp)
 {
-	return compare_strings(lp, rp) == 0;
+	SpnString *lhs = lp, *rhs = rp;
+
+	/* identical (e. g. interned) strings are trivially equal */
+	if (lhs == rhs) {
+		return 1;
+	}
+
+	/* strings with different lengths or hashes can't be equal */
+	if (lhs->len != rhs->len) {
+		return 0;
+	}
+
+	if (lhs->ishashed && rhs->ishashed && lhs->hash != rhs->hash) {
+		return 0;
+	}
+
+	spn_string_flatten(lhs);
+	spn_string_flatten(rhs);
+
+	return memcmp(lhs->cstr, rhs->cstr, lhs->len) == 0;
 }
 
 /* Helper function for the constructors.
@@ -74,6 +175,36 @@ static void init_string(SpnString *strobj, const char *cstr, size_t len, int dea
 	strobj->len = len;
 	strobj->dealloc = dealloc;
 	strobj->ishashed = 0;
+	strobj->left = NULL;
+	strobj->right = NULL;
+}
+
+/* Helper function for the copying constructors. Allocates a string object
+ * of length 'len', with inline storage if possible, and with a buffer on
+ * the heap otherwise. The buffer is NUL-terminated, the rest of its
+ * contents are to be filled in by the caller.
+ */
+static SpnString *alloc_string(size_t len)
+{
+	SpnString *strobj;
+	char *buf;
+
+	if (len <= INLINE_CAP_SMALL) {
+		strobj = spn_object_new(&spn_class_string_inline_small);
+		buf = (char *)(strobj + 1);
+		init_string(strobj, buf, len, 0);
+	} else if (len <= INLINE_CAP_LARGE) {
+		strobj = spn_object_new(&spn_class_string_inline_large);
+		buf = (char *)(strobj + 1);
+		init_string(strobj, buf, len, 0);
+	} else {
+		buf = spn_malloc(len + 1);
+		strobj = spn_object_new(&spn_class_string);
+		init_string(strobj, buf, len, 1);
+	}
+
+	buf[len] = 0;
+	return strobj;
 }
 
 /* since strings are immutable, it's enough to generate the hash on-demand,
@@ -84,6 +215,7 @@ static unsigned long hash_string(void *obj)
 	SpnString *str = obj;
 
 	if (!str->ishashed) {
+		spn_string_flatten(str);
 		str->hash = spn_hash_bytes(str->cstr, str->len);
 		str->ishashed = 1;
 	}
@@ -104,16 +236,23 @@ SpnString *spn_string_new_nocopy(const char *cstr, int dealloc)
 
 SpnString *spn_string_new_len(const char *cstr, size_t len)
 {
-	char *buf = spn_malloc(len + 1);
-	memcpy(buf, cstr, len); /* so that strings can hold binary data */
-	buf[len] = 0;
-
-	return spn_string_new_nocopy_len(buf, len, 1);
+	SpnString *strobj = alloc_string(len);
+	memcpy(strobj->cstr, cstr, len); /* so that strings can hold binary data */
+	return strobj;
 }
 
 SpnString *spn_string_new_nocopy_len(const char *cstr, size_t len, int dealloc)
 {
-	SpnString *strobj = spn_object_new(&spn_class_string);
+	SpnString *strobj;
+
+	/* if we own a short buffer, it's better to move it inline */
+	if (dealloc && len <= INLINE_CAP_LARGE) {
+		strobj = spn_string_new_len(cstr, len);
+		free((char *)(cstr));
+		return strobj;
+	}
+
+	strobj = spn_object_new(&spn_class_string);
 	init_string(strobj, cstr, len, dealloc);
 	return strobj;
 }
@@ -132,13 +271,115 @@ SpnString spn_string_emplace_nonretained_for_hashmap(const char *cstr)
 SpnString *spn_string_concat(SpnString *lhs, SpnString *rhs)
 {
 	size_t len = lhs->len + rhs->len;
-	char *buf = spn_malloc(len + 1);
+	SpnString *strobj = alloc_string(len);
 
-	memcpy(buf, lhs->cstr, lhs->len);
-	memcpy(buf + lhs->len, rhs->cstr, rhs->len);
-	buf[len] = 0;
+	spn_string_flatten(lhs);
+	spn_string_flatten(rhs);
+
+	memcpy(strobj->cstr, lhs->cstr, lhs->len);
+	memcpy(strobj->cstr + lhs->len, rhs->cstr, rhs->len);
+
+	return strobj;
+}
+
+/* takes ownership of 'lhs' and 'rhs' */
+static SpnString *new_rope(SpnString *lhs, SpnString *rhs)
+{
+	SpnString *strobj = spn_object_new(&spn_class_string);
+	init_string(strobj, NULL, lhs->len + rhs->len, 0);
+	strobj->left = lhs;
+	strobj->right = rhs;
+	return strobj;
+}
+
+/* Runs of short strings are copied into a new string, long ones are
+ * only referenced (by a rope), so repeatedly appending short pieces to
+ * a long string doesn't copy the long string over and over again.
+ */
+SpnString *spn_string_concat_n(SpnString *strs[], size_t n)
+{
+	SpnString *res = NULL;
+	size_t i = 0;
+
+	while (i < n) {
+		SpnString *part;
+		size_t j = i, len = 0;
+
+		while (j < n && strs[j]->len < ROPE_MIN_LEN) {
+			len += strs[j++]->len;
+		}
+
+		if (j == i || j == i + 1) {
+			/* a single long or short string, no need to copy */
+			part = strs[i++];
+			spn_object_retain(part);
+		} else {
+			char *p;
+
+			part = alloc_string(len);
+			p = part->cstr;
+
+			for (; i < j; i++) {
+				memcpy(p, spn_string_flatten(strs[i])->cstr, strs[i]->len);
+				p += strs[i]->len;
+			}
+		}
+
+		/* runs are maximal, so one of the two is long */
+		res = res != NULL ? new_rope(res, part) : part;
+	}
+
+	return res != NULL ? res : alloc_string(0);
+}
+
+/* The rope is traversed from right to left, so that the stack stays
+ * shallow for the common, left-leaning ropes, which are built by
+ * appending to a string. Parts that are ropes themselves are not
+ * flattened, since they may be shared.
+ */
+static void flatten_rope(SpnString *rope)
+{
+	size_t pos = rope->len;
+	char *buf = spn_malloc(pos + 1);
+
+	size_t stacksize = 16, sp = 0;
+	SpnString **stack = spn_malloc(stacksize * sizeof stack[0]);
+
+	buf[pos] = 0;
+	stack[sp++] = rope;
+
+	while (sp > 0) {
+		SpnString *node = stack[--sp];
+
+		if (node->cstr != NULL) {
+			pos -= node->len;
+			memcpy(buf + pos, node->cstr, node->len);
+			continue;
+		}
+
+		if (sp + 2 > stacksize) {
+			stacksize *= 2;
+			stack = spn_realloc(stack, stacksize * sizeof stack[0]);
+		}
+
+		stack[sp++] = node->left;
+		stack[sp++] = node->right;
+	}
+
+	assert(pos == 0);
+	free(stack);
+
+	free_rope(rope);
+	init_string(rope, buf, rope->len, 1);
+}
+
+SpnString *spn_string_flatten(SpnString *str)
+{
+	if (str->cstr == NULL) {
+		flatten_rope(str);
+	}
 
-	return spn_string_new_nocopy_len(buf, len, 1);
+	return str;
 }
 
 /*********************************************
@@ -446,7 +687,7 @@ static int append_format(
 					TYPE_MISMATCH,
 					*argidx,
 					SPN_TYPE_STRING,
-					val->type
+					valtype(val)
 				);
 				return -1;
 			}
@@ -498,7 +739,7 @@ static int append_format(
 					TYPE_MISMATCH,
 					*argidx,
 					SPN_TTAG_NUMBER,
-					val->type
+					valtype(val)
 				);
 				return -1;
 			}
@@ -566,7 +807,7 @@ static int append_format(
 					TYPE_MISMATCH,
 					*argidx,
 					SPN_TTAG_NUMBER,
-					val->type
+					valtype(val)
 				);
 				return -1;
 			}
@@ -628,7 +869,7 @@ static int append_format(
 					TYPE_MISMATCH,
 					*argidx,
 					SPN_TTAG_NUMBER,
-					val->type
+					valtype(val)
 				);
 				return -1;
 			}
@@ -691,7 +932,7 @@ static int append_format(
 					TYPE_MISMATCH,
 					*argidx,
 					SPN_TTAG_BOOL,
-					val->type
+					valtype(val)
 				);
 				return -1;
 			}
@@ -826,7 +1067,7 @@ static char *make_format_string(
 						TYPE_MISMATCH,
 						argidx,
 						SPN_TTAG_NUMBER,
-						widthptr->type
+						valtype(widthptr)
 					);
 					free(bld.buf);
 					return NULL;
@@ -880,7 +1121,7 @@ static char *make_format_string(
 							TYPE_MISMATCH,
 							argidx,
 							SPN_TTAG_NUMBER,
-							precptr->type
+							valtype(precptr)
 						);
 						free(bld.buf);
 						return NULL;
@@ -952,7 +1193,7 @@ char *spn_string_format_cstr(const char *fmt, size_t *len, const void **argv)
 SpnString *spn_string_format_obj(SpnString *fmt, int argc, SpnValue *argv, char **errmsg)
 {
 	size_t len;
-	char *buf = make_format_string(fmt->cstr, &len, argc, argv, 1, errmsg);
+	char *buf = make_format_string(spn_string_flatten(fmt)->cstr, &len, argc, argv, 1, errmsg);
 	return buf ? spn_string_new_nocopy_len(buf, len, 1) : NULL;
 }
 
@@ -960,10 +1201,7 @@ SpnString *spn_string_format_obj(SpnString *fmt, int argc, SpnValue *argv, char
 
 static SpnValue string_to_val(SpnString *str)
 {
-	SpnValue ret;
-	ret.type = SPN_TYPE_STRING;
-	ret.v.o = str;
-	return ret;
+	return spn_makeobject(SPN_TYPE_STRING, str);
 }
 
 SpnValue spn_makestring(const char *s)
@@ -15,19 +15,29 @@
 
 #include "api.h"
 
+/* 'cstr' is NULL if the string is a rope (see spn_string_concat_n()).
+ * Strings passed to native functions and returned to C by the virtual
+ * machine are always flattened, but strings taken out of an array or a
+ * hashmap may be ropes: access those through spn_stringvalue(), or call
+ * spn_string_flatten() before reading 'cstr'.
+ */
 typedef struct SpnString {
 	SpnObject     base;     /* private          */
-	char         *cstr;     /* public, readonly */
+	char         *cstr;     /* public, readonly, NULL for ropes */
 	size_t        len;      /* public, readonly */
 	int           dealloc;  /* private          */
 	int           ishashed; /* private          */
 	unsigned long hash;     /* private          */
+	struct SpnString *left; /* private, rope    */
+	struct SpnString *right;/* private, rope    */
 } SpnString;
 
 /* these create an SpnString object. "nocopy" versions don't copy the
  * buffer passed in, others do. "len" versions don't need a 0-terminated
  * string, others do. The 'dealloc' flag should be non-zero if you want the
  * backing buffer to be freed when the destructor runs.
+ * Copying constructors store short strings inline, in the string object
+ * itself; 'cstr' is always valid and 0-terminated nevertheless.
  */
 SPN_API	SpnString *spn_string_new(const char *cstr);
 SPN_API	SpnString *spn_string_new_nocopy(const char *cstr, int dealloc);
@@ -57,6 +67,22 @@ SPN_API SpnString spn_string_emplace_nonretained_for_hashmap(const char *cstr);
  */
 SPN_API SpnString *spn_string_concat(SpnString *lhs, SpnString *rhs);
 
+/* Concatenates 'n' strings. Unlike 'spn_string_concat()', this doesn't
+ * necessarily copy the characters: if the result is long, it may be a
+ * rope, which only references its parts, and which is flattened (copied
+ * into one contiguous buffer) when its characters are first needed.
+ * This makes building a long string piece by piece take linear time.
+ * The 'cstr' member of a rope is NULL until 'spn_string_flatten()' is
+ * called on it; 'spn_stringvalue()' does that automatically. 'len' is
+ * always valid.
+ */
+SPN_API SpnString *spn_string_concat_n(SpnString *strs[], size_t n);
+
+/* if 'str' is a rope, copies its characters into a contiguous buffer.
+ * Returns 'str', which is now guaranteed to have a valid 'cstr'.
+ */
+SPN_API SpnString *spn_string_flatten(SpnString *str);
+
 /* The following functions create a formatted string.
  * The format specifiers are documented in doc/stdlib.md.
  */
@@ -97,6 +123,6 @@ SPN_API SpnValue spn_makestring_len(const char *s, size_t len);
 SPN_API SpnValue spn_makestring_nocopy(const char *s);
 SPN_API SpnValue spn_makestring_nocopy_len(const char *s, size_t len, int dealloc);
 
-#define spn_stringvalue(val) ((SpnString *)((val)->v.o))
+#define spn_stringvalue(val) spn_string_flatten((SpnString *)spn_objvalue(val))
 
 #endif /* SPN_STR_H */
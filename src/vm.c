@@ -19,30 +19,43 @@
 #include "private.h"
 
 /* stack management macros
- * 0th slot: header
+ * topmost slots: header
  * register ordinal numbers grow _downwards_
  *
  * |                          | <- SP
  * +--------------------------+
- * | activation record header | <- SP - 1
+ * | activation record header | <- SP - HDR_SLOTS
  * +--------------------------+
- * | register #0              | <- SP - 2
+ * | register #0              | <- SP - HDR_SLOTS - 1
  * +--------------------------+
- * | register #1              | <- SP - 3
+ * | register #1              | <- SP - HDR_SLOTS - 2
  * +--------------------------+
  * |                          |
  *
+ * A slot is exactly one value, so that registers are packed densely;
+ * the header occupies as many slots as needed to hold a TFrame.
+ *
  *
  * register layout within a stack frame:
  *
  * [0...argc)			- declared arguments
  * [argc...nregs)		- other local variables and temporary registers
  * [nregs...nregs + extra_argc)	- unnamed (variadic) arguments
+ *
+ * The stack is a chain of segments, and it is never reallocated: a frame
+ * which doesn't fit in the rest of the current segment is pushed at the
+ * bottom of the next one, so a frame is always contiguous, but it need
+ * not be adjacent to its caller's. (That's why each frame header records
+ * the stack pointer of the caller.) Consequently, pointers to registers
+ * stay valid for as long as the frame is alive, even across calls.
+ * Segments are not freed when they are emptied; they are reused by
+ * subsequent calls, and they are only released along with the VM.
  */
 
-#define EXTRA_SLOTS	1
-#define IDX_FRMHDR	(-1)
-#define REG_OFFSET	(-2)
+#define HDR_SLOTS	((int)((sizeof(TFrame) + sizeof(TSlot) - 1) / sizeof(TSlot)))
+#define EXTRA_SLOTS	HDR_SLOTS
+#define REG_OFFSET	(-HDR_SLOTS - 1)
+#define FRMHDR(s)	((TFrame *)((s) - HDR_SLOTS))
 
 /* the debug versions of the following macros are defined in such a horrible
  * way because once I've shot myself in the foot trying to store the result of
@@ -61,48 +74,75 @@
  * arguments: 's' - stack pointer; 'r': register index
  */
 #ifndef NDEBUG
-#define VALPTR(s, r) (assert((r) < (s)[IDX_FRMHDR].h.size - EXTRA_SLOTS), &(s)[(-(int)(r) + REG_OFFSET)].v)
-#define SLOTPTR(s, r) (assert((r) < (s)[IDX_FRMHDR].h.size - EXTRA_SLOTS), &(s)[(-(int)(r) + REG_OFFSET)])
+#define VALPTR(s, r) (assert((int)(r) < FRMHDR(s)->size - EXTRA_SLOTS), &(s)[(-(int)(r) + REG_OFFSET)].v)
+#define SLOTPTR(s, r) (assert((int)(r) < FRMHDR(s)->size - EXTRA_SLOTS), &(s)[(-(int)(r) + REG_OFFSET)])
 #else
 #define VALPTR(s, r) (&(s)[(-(int)(r) + REG_OFFSET)].v)
 #define SLOTPTR(s, r) (&(s)[(-(int)(r) + REG_OFFSET)])
 #endif
 
-
-/* An index into the array of local symbol tables is used instead of a
- * pointer to the symtab struct itself because that array may be
- * 'realloc()'ated, and then we have an invalid pointer once again
+/* reference counting of register contents. Most registers hold numbers,
+ * Booleans or nil, so the type check is done in-line rather than by
+ * calling spn_value_retain() and spn_value_release().
+ * These evaluate their argument more than once.
  */
+#define REG_RETAIN(v)  do { if (isobject(v)) ((SpnObject *)objvalue(v))->refcnt++; } while (0)
+#define REG_RELEASE(v) do { if (isobject(v)) spn_object_release(objvalue(v)); } while (0)
+
+
+typedef struct TSlot {
+	SpnValue v;
+} TSlot;
+
 typedef struct TFrame {
-	size_t       size;       /* no. of slots, including EXTRA_SLOTS */
+	int          size;       /* no. of slots, including EXTRA_SLOTS */
 	int          decl_argc;  /* declaration argument count          */
 	int          extra_argc; /* number of extra args, if any (or 0) */
 	int          real_argc;  /* number of call args                 */
 	spn_uword   *retaddr;    /* return address (points to bytecode) */
-	ptrdiff_t    retidx;     /* pointer into the caller's frame     */
+	SpnValue    *retptr;     /* return value register of the caller */
+	TSlot       *prevsp;     /* stack pointer of the caller, or NULL */
 	SpnFunction *callee;     /* the called function itself          */
 	SpnArray    *argv;       /* lazily loaded argument vector       */
+	int          owncallee;  /* the frame retains 'callee'          */
 } TFrame;
 
-/* see http://stackoverflow.com/q/18310789/ */
-typedef union TSlot {
-	TFrame h;
-	SpnValue v;
-} TSlot;
+/* a segment of the stack. Frames larger than STACK_SEGMENT_SLOTS
+ * get a segment of their own, of exactly the required size.
+ */
+#define STACK_SEGMENT_SLOTS 1024
+
+/* the table of interned strings is purged when it grows beyond this */
+#define MIN_INTERN_LIMIT 256
+
+typedef struct TSegment TSegment;
+
+struct TSegment {
+	TSegment *prev;
+	TSegment *next;
+	TSlot    *base;         /* first slot                   */
+	TSlot    *end;          /* one past the last slot       */
+};
 
 struct SpnVMachine {
-	TSlot      *stack;      /* base of the stack            */
-	TSlot      *sp;         /* stack pointer                */
-	size_t      stackallsz; /* stack alloc size in frames   */
+	TSegment   *seg;        /* segment of the topmost frame */
+	TSlot      *sp;         /* stack pointer, NULL if empty */
+
+	SpnFunction *native;    /* native callee w/o pseudo-frame */
+	spn_uword  *nativeret;  /* and its return address         */
 
 	ptrdiff_t   exc_addr;   /* address of last exception    */
 
 	SpnHashMap *glbsymtab;  /* global symbol table          */
 	SpnHashMap *classes;    /* class descriptors            */
+	SpnHashMap *strings;    /* interned constant strings    */
+	size_t      strlimit;   /* purge 'strings' above this   */
+	SpnShapeTree *shapes;   /* shapes of object literals    */
 
 	SpnValue    supername;  /* the string "super"           */
 	SpnValue    getname;    /* the string "get"             */
 	SpnValue    setname;    /* the string "set"             */
+	SpnValue    lengthname; /* the string "length"          */
 
 	char       *errmsg;     /* last (runtime) error message */
 	int         haserror;   /* whether an error occurred    */
@@ -116,8 +156,8 @@ struct args_copy_descriptor {
 		struct {
 			spn_uword *ip;
 			spn_uword *retaddr;
-			ptrdiff_t calleroff;
-			ptrdiff_t retidx;
+			TSlot *caller;
+			SpnValue *retptr;
 		} script_env;
 		struct {
 			SpnValue *argv;
@@ -132,6 +172,14 @@ static void push_and_copy_args(
 	int argc
 );
 
+/* replaces the topmost frame with the frame of 'fn' (tail call) */
+static void replace_frame(SpnVMachine *vm, SpnFunction *fn, spn_uword *ip, int argc);
+
+/* copies '*src' into the register 'dst', retaining the new value
+ * and releasing the old one
+ */
+static void store_reg(SpnValue *dst, const SpnValue *src);
+
 
 static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *ret);
 
@@ -139,8 +187,8 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *ret);
 static void free_frames(SpnVMachine *vm);
 
 /* stack manipulation */
-static size_t stacksize(SpnVMachine *vm);
-static void expand_stack(SpnVMachine *vm, size_t nregs);
+static TSegment *new_segment(TSegment *prev, size_t nslots);
+static TSlot *next_segment(SpnVMachine *vm, size_t nslots);
 
 static void push_frame(
 	SpnVMachine *vm,
@@ -149,7 +197,7 @@ static void push_frame(
 	int extra_argc,
 	int real_argc,
 	spn_uword *retaddr,
-	ptrdiff_t retidx,
+	SpnValue *retptr,
 	SpnFunction *callee
 );
 static void pop_frame(SpnVMachine *vm);
@@ -157,10 +205,16 @@ static void pop_frame(SpnVMachine *vm);
 /* this function helps including native functions' names in the stack trace */
 static void push_native_pseudoframe(SpnVMachine *vm, SpnFunction *callee, spn_uword *retaddr);
 
+/* pushes the pseudo-frame of the native function currently being called
+ * by SPN_INS_CALL, if it hasn't been pushed yet. See the comment there.
+ */
+static void push_pending_native_frame(SpnVMachine *vm);
+
 /* reads/creates the local symbol table of 'program' if necessary,
  * then stores it back into the function object.
  */
-static void read_local_symtab(SpnFunction *program);
+static void read_local_symtab(SpnVMachine *vm, SpnFunction *program);
+static SpnValue intern_string(SpnVMachine *vm, const char *cstr, size_t len);
 
 /* accessing function arguments */
 static SpnValue *nth_call_arg(TSlot *sp, spn_uword *ip, int idx);
@@ -187,6 +241,16 @@ static int get_builtin_property(SpnValue *dstreg, SpnValue *pself, SpnValue *nam
 
 static int lookup_member(SpnVMachine *vm, SpnValue *result, SpnValue *pself, SpnValue *name);
 
+/* same as lookup_member(), but it remembers the result in the inline cache
+ * of the instruction at 'insptr'. Return value is the same too.
+ */
+static int lookup_member_cached(SpnVMachine *vm, spn_uword *insptr, SpnValue *result, SpnValue *pself, SpnValue *name);
+
+/* reads a property using its getter, or by indexing 'self' if it's a hashmap.
+ * 'dstidx' is the index of the destination register. Returns 0 on success.
+ */
+static int get_property(SpnVMachine *vm, spn_uword *ip, int dstidx, SpnValue *pself, SpnValue *prname);
+
 /* type information, reflection */
 static SpnValue typeof_value(SpnValue *val);
 
@@ -198,9 +262,10 @@ SpnVMachine *spn_vm_new(void)
 	SpnVMachine *vm = spn_malloc(sizeof(*vm));
 
 	/* initialize stack */
-	vm->stackallsz = 0;
-	vm->stack = NULL;
+	vm->seg = new_segment(NULL, STACK_SEGMENT_SLOTS);
 	vm->sp = NULL;
+	vm->native = NULL;
+	vm->nativeret = NULL;
 
 	/* address of instruction that threw an exception.
 	 * if negative: no exception, or occurred in a C function
@@ -210,10 +275,21 @@ SpnVMachine *spn_vm_new(void)
 	/* initialize the global symbol table and class descriptors */
 	vm->glbsymtab = spn_hashmap_new();
 	vm->classes   = spn_hashmap_new();
+	vm->strings   = spn_hashmap_new();
+	vm->strlimit  = MIN_INTERN_LIMIT;
+	vm->shapes    = spn_shapetree_new();
 
-	vm->supername = makestring_nocopy("super");
-	vm->getname   = makestring_nocopy("get");
-	vm->setname   = makestring_nocopy("set");
+	/* these are interned so that they are identical
+	 * to the same string constants in programs
+	 */
+	vm->supername = intern_string(vm, "super", 5);
+	vm->getname   = intern_string(vm, "get", 3);
+	vm->setname   = intern_string(vm, "set", 3);
+
+	vm->lengthname = intern_string(vm, "length", 6);
+
+	/* member lookup caches depend on the contents of 'classes' */
+	spn_hashmap_mark_class(vm->classes);
 
 	/* set up error reporting and context info */
 	vm->errmsg = NULL;
@@ -227,7 +303,17 @@ void spn_vm_free(SpnVMachine *vm)
 {
 	/* free the stack */
 	free_frames(vm);
-	free(vm->stack);
+
+	while (vm->seg->next != NULL) {
+		vm->seg = vm->seg->next;
+	}
+
+	while (vm->seg != NULL) {
+		TSegment *prev = vm->seg->prev;
+		free(vm->seg->base);
+		free(vm->seg);
+		vm->seg = prev;
+	}
 
 	/* free the global symbol table and all class descirptors */
 	spn_object_release(vm->glbsymtab);
@@ -237,6 +323,12 @@ void spn_vm_free(SpnVMachine *vm)
 	spn_value_release(&vm->supername);
 	spn_value_release(&vm->getname);
 	spn_value_release(&vm->setname);
+	spn_value_release(&vm->lengthname);
+
+	spn_object_release(vm->strings);
+
+	/* hashmaps that are still alive keep the tree alive too */
+	spn_shapetree_release(vm->shapes);
 
 	/* free the error message buffer */
 	free(vm->errmsg);
@@ -246,12 +338,12 @@ void spn_vm_free(SpnVMachine *vm)
 
 static ptrdiff_t return_address_from_stack_ptr(TSlot *sp)
 {
-	TFrame *frmhdr = &sp[IDX_FRMHDR].h;
+	TFrame *frmhdr = FRMHDR(sp);
 
 	if (frmhdr->retaddr != NULL) {
 		/* get stack frame info of caller (previous stack frame) */
-		TSlot *caller_sp = sp - frmhdr->size;
-		TFrame *caller_frmhdr = &caller_sp[IDX_FRMHDR].h;
+		TSlot *caller_sp = frmhdr->prevsp;
+		TFrame *caller_frmhdr = FRMHDR(caller_sp);
 
 		/* return the offset into the bytecode of the top-level
 		 * program in which the caller is defined
@@ -269,19 +361,22 @@ SpnStackFrame *spn_vm_stacktrace(SpnVMachine *vm, size_t *size)
 	size_t i = 0;
 	SpnStackFrame *buf;
 
-	TSlot *sp = vm->sp;
+	TSlot *sp;
+
+	/* a native function is asking for a stack trace */
+	push_pending_native_frame(vm);
+	sp = vm->sp;
 
-	/* handle uninitialized stack */
+	/* handle empty stack */
 	if (sp == NULL) {
 		*size = 0;
 		return NULL;
 	}
 
 	/* count frames */
-	while (sp > vm->stack) {
-		TFrame *frmhdr = &sp[IDX_FRMHDR].h;
+	while (sp != NULL) {
 		i++;
-		sp -= frmhdr->size;
+		sp = FRMHDR(sp)->prevsp;
 	}
 
 	/* allocate buffer */
@@ -292,8 +387,8 @@ SpnStackFrame *spn_vm_stacktrace(SpnVMachine *vm, size_t *size)
 	i = 0;
 	sp = vm->sp;
 
-	while (sp > vm->stack) {
-		TFrame *frmhdr = &sp[IDX_FRMHDR].h;
+	while (sp != NULL) {
+		TFrame *frmhdr = FRMHDR(sp);
 		SpnStackFrame *frame = &buf[i];
 
 		frame->function = frmhdr->callee;
@@ -310,7 +405,7 @@ SpnStackFrame *spn_vm_stacktrace(SpnVMachine *vm, size_t *size)
 			frame->exc_address = spn_vm_exception_addr(vm);
 		}
 
-		sp -= frmhdr->size;
+		sp = frmhdr->prevsp;
 		i++;
 	}
 
@@ -342,10 +437,8 @@ SpnHashMap *spn_vm_getclasses(SpnVMachine *vm)
 
 static void free_frames(SpnVMachine *vm)
 {
-	if (vm->stack != NULL) {
-		while (vm->sp > vm->stack) {
-			pop_frame(vm);
-		}
+	while (vm->sp != NULL) {
+		pop_frame(vm);
 	}
 }
 
@@ -381,6 +474,11 @@ int spn_vm_callfunc(
 	 */
 	clean_vm_if_needed(vm);
 
+	/* if called back from a native function, its frame must be below
+	 * the callee's, for the stack trace and the return addresses
+	 */
+	push_pending_native_frame(vm);
+
 	/* native functions are easy to deal with */
 	if (fn->native) {
 		int err;
@@ -417,7 +515,7 @@ int spn_vm_callfunc(
 	 * If so, read the local symbol table (if necessary).
 	 */
 	if (fn->topprg) {
-		read_local_symtab(fn);
+		read_local_symtab(vm, fn);
 	}
 
 	/* compute entry point */
@@ -519,7 +617,7 @@ static void runtime_error(SpnVMachine *vm, spn_uword *ip, const char *fmt, const
 	/* a non-NULL pointer means that a Sparkling VM instruction threw */
 	if (ip != NULL) {
 		/* store address of runtime error */
-		spn_uword *prog_bc = vm->sp[IDX_FRMHDR].h.callee->env->repr.bc;
+		spn_uword *prog_bc = FRMHDR(vm->sp)->callee->env->repr.bc;
 		vm->exc_addr = ip - prog_bc;
 	} else {
 		/* indicate the fact that error was caused by native code */
@@ -554,34 +652,55 @@ void spn_vm_setcontext(SpnVMachine *vm, void *ctx)
 	vm->ctx = ctx;
 }
 
-/* because 'NULL - NULL' is UB */
-static size_t stacksize(SpnVMachine *vm)
+static TSegment *new_segment(TSegment *prev, size_t nslots)
 {
-	return vm->stackallsz != 0 ? vm->sp - vm->stack : 0;
+	TSegment *seg = spn_malloc(sizeof *seg);
+
+	if (nslots < STACK_SEGMENT_SLOTS) {
+		nslots = STACK_SEGMENT_SLOTS;
+	}
+
+	seg->prev = prev;
+	seg->next = NULL;
+	seg->base = spn_malloc(nslots * sizeof seg->base[0]);
+	seg->end = seg->base + nslots;
+
+	return seg;
 }
 
-static void expand_stack(SpnVMachine *vm, size_t nregs)
+/* makes the segment after the current one current, and returns its base.
+ * The cached next segment is reused if it can hold 'nslots' slots;
+ * if it can't, then it is replaced by a big enough one.
+ */
+static TSlot *next_segment(SpnVMachine *vm, size_t nslots)
 {
-	size_t oldsize = stacksize(vm);
-	size_t newsize = oldsize + nregs;
+	TSegment *next = vm->seg->next;
+
+	if (next != NULL && (size_t)(next->end - next->base) < nslots) {
+		/* segments above the topmost frame are all empty */
+		while (next != NULL) {
+			TSegment *tmp = next->next;
+			free(next->base);
+			free(next);
+			next = tmp;
+		}
 
-	if (vm->stackallsz == 0) {
-		vm->stackallsz = 8;
-		/* or however many; something greater than 0 so the << works */
+		vm->seg->next = NULL;
 	}
 
-	while (vm->stackallsz < newsize) {
-		vm->stackallsz *= 2;
+	if (next == NULL) {
+		next = new_segment(vm->seg, nslots);
+		vm->seg->next = next;
 	}
 
-	vm->stack = spn_realloc(vm->stack, vm->stackallsz * sizeof vm->stack[0]);
-
-	/* re-initialize stack pointer because we realloc()'d the stack */
-	vm->sp = vm->stack + oldsize;
+	vm->seg = next;
+	return next->base;
 }
 
 /* nregs is the logical size (without the activation record header)
- * of the new stack frame, in slots
+ * of the new stack frame, in slots. The argument registers (the first
+ * min(decl_argc, real_argc) ones and the 'extra_argc' variadic ones)
+ * are left uninitialized; the caller must fill them in.
  */
 static void push_frame(
 	SpnVMachine *vm,
@@ -590,10 +709,12 @@ static void push_frame(
 	int extra_argc,
 	int real_argc,
 	spn_uword *retaddr,
-	ptrdiff_t retidx,
+	SpnValue *retptr,
 	SpnFunction *callee
 )
 {
+	TSlot *bottom, *sp;
+	TFrame *hdr;
 	int i;
 
 	/* real frame allocation size, including extra call-time arguments,
@@ -606,34 +727,56 @@ static void push_frame(
 	 */
 	assert(extra_argc >= 0);
 
-	/* reallocate stack if necessary */
-	if (vm->stackallsz == 0					/* empty stack	*/
-	 || vm->stackallsz < stacksize(vm) + real_nregs) {	/* too small	*/
-		expand_stack(vm, real_nregs);
+	/* move on to the next segment if the frame doesn't fit */
+	bottom = vm->sp != NULL ? vm->sp : vm->seg->base;
+
+	if (vm->seg->end - bottom < real_nregs) {
+		bottom = next_segment(vm, real_nregs);
 	}
 
-	/* adjust stack pointer */
-	vm->sp += real_nregs;
+	sp = bottom + real_nregs;
 
-	/* initialize registers to nil */
-	for (i = -real_nregs; i < -EXTRA_SLOTS; i++) {
-		vm->sp[i].v = spn_nilval;
+	/* Initialize registers to nil, except for the ones that receive
+	 * the arguments: push_and_copy_args() overwrites those right away.
+	 * Without NaN-boxing, nil is recognized by its type tag alone,
+	 * so the payload is not written.
+	 */
+	for (i = decl_argc < real_argc ? decl_argc : real_argc; i < nregs; i++) {
+#if USE_NAN_BOXING
+		sp[REG_OFFSET - i].v = spn_nilval;
+#else
+		sp[REG_OFFSET - i].v.type = SPN_TYPE_NIL;
+#endif
 	}
 
 	/* initialize activation record header */
-	vm->sp[IDX_FRMHDR].h.size = real_nregs;
-	vm->sp[IDX_FRMHDR].h.decl_argc = decl_argc;
-	vm->sp[IDX_FRMHDR].h.extra_argc = extra_argc;
-	vm->sp[IDX_FRMHDR].h.real_argc = real_argc;
-	vm->sp[IDX_FRMHDR].h.retaddr = retaddr; /* if NULL, return to C-land */
-	vm->sp[IDX_FRMHDR].h.retidx = retidx; /* if >= 0, return _directly_ to VM stack */
-	vm->sp[IDX_FRMHDR].h.callee = callee;
-	vm->sp[IDX_FRMHDR].h.argv = NULL;
+	hdr = FRMHDR(sp);
+	hdr->size = real_nregs;
+	hdr->decl_argc = decl_argc;
+	hdr->extra_argc = extra_argc;
+	hdr->real_argc = real_argc;
+	hdr->retaddr = retaddr; /* if NULL, return to C-land */
+	hdr->retptr = retptr; /* if not NULL, return _directly_ to VM stack */
+	hdr->prevsp = vm->sp;
+	hdr->callee = callee;
+	hdr->argv = NULL;
+	hdr->owncallee = 0;
+
+	/* adjust stack pointer */
+	vm->sp = sp;
 }
 
 static void push_native_pseudoframe(SpnVMachine *vm, SpnFunction *callee, spn_uword *retaddr)
 {
-	push_frame(vm, 0, 0, 0, 0, retaddr, -1, callee);
+	push_frame(vm, 0, 0, 0, 0, retaddr, NULL, callee);
+}
+
+static void push_pending_native_frame(SpnVMachine *vm)
+{
+	if (vm->native != NULL) {
+		push_native_pseudoframe(vm, vm->native, vm->nativeret);
+		vm->native = NULL;
+	}
 }
 
 static void pop_frame(SpnVMachine *vm)
@@ -643,13 +786,19 @@ static void pop_frame(SpnVMachine *vm)
 	 * (e. g. concatenation, function calls, etc.) cleans up its
 	 * destination register, but not the source(s) (if any).
 	 */
-	TFrame *hdr = &vm->sp[IDX_FRMHDR].h;
+	TFrame *hdr = FRMHDR(vm->sp);
 	int nregs = hdr->size;
 
-	/* release registers */
+	/* release registers. Most of them usually don't hold objects,
+	 * so the type check is inlined instead of calling spn_value_release().
+	 */
 	int i;
 	for (i = -nregs; i < -EXTRA_SLOTS; i++) {
-		spn_value_release(&vm->sp[i].v);
+		SpnValue *reg = &vm->sp[i].v;
+
+		if (isobject(reg)) {
+			spn_object_release(objvalue(reg));
+		}
 	}
 
 	/* release argv, if any */
@@ -657,8 +806,20 @@ static void pop_frame(SpnVMachine *vm)
 		spn_object_release(hdr->argv);
 	}
 
+	/* frames pushed by tail calls own their callee */
+	if (hdr->owncallee) {
+		spn_object_release(hdr->callee);
+	}
+
+	/* if this was the first frame in its segment, then the
+	 * caller's frame (if any) is in the previous segment
+	 */
+	if (vm->sp - nregs == vm->seg->base && vm->seg->prev != NULL) {
+		vm->seg = vm->seg->prev;
+	}
+
 	/* adjust stack pointer */
-	vm->sp -= nregs;
+	vm->sp = hdr->prevsp;
 }
 
 /* retrieve a pointer to the register denoted by the 'idx'th octet
@@ -666,7 +827,7 @@ static void pop_frame(SpnVMachine *vm)
  */
 static SpnValue *nth_call_arg(TSlot *sp, spn_uword *ip, int idx)
 {
-	int regidx = nth_arg_idx(ip, idx);
+	int regidx = NTH_ARG_IDX(ip, idx);
 	return VALPTR(sp, regidx);
 }
 
@@ -676,7 +837,7 @@ static SpnValue *nth_call_arg(TSlot *sp, spn_uword *ip, int idx)
  */
 static SpnValue *nth_vararg(TSlot *sp, int idx)
 {
-	TFrame *hdr = &sp[IDX_FRMHDR].h;
+	TFrame *hdr = FRMHDR(sp);
 	int vararg_off = hdr->size - EXTRA_SLOTS - hdr->extra_argc;
 
 	assert(idx >= 0 && idx < hdr->extra_argc);
@@ -725,7 +886,7 @@ static void push_and_copy_args(
 	assert(decl_argc <= nregs);
 
 	/* push a new stack frame - after that,
-	 * '&vm->sp[IDX_FRMHDR].h' is a pointer to
+	 * 'FRMHDR(vm->sp)' is a pointer to
 	 * the stack frame of the *called* function.
 	 */
 	push_frame(
@@ -735,7 +896,7 @@ static void push_and_copy_args(
 		extra_argc,
 		argc,
 		desc->caller_is_native ? NULL : desc->env.script_env.retaddr,
-		desc->caller_is_native ?   -1 : desc->env.script_env.retidx,
+		desc->caller_is_native ? NULL : desc->env.script_env.retptr,
 		fn
 	);
 
@@ -761,12 +922,12 @@ static void push_and_copy_args(
 			SpnValue *argv = desc->env.native_env.argv;
 			src = &argv[i];
 		} else {
-			TSlot *caller = vm->stack + desc->env.script_env.calleroff;
+			TSlot *caller = desc->env.script_env.caller;
 			spn_uword *ip = desc->env.script_env.ip;
 			src = nth_call_arg(caller, ip, i);
 		}
 
-		spn_value_retain(src);
+		REG_RETAIN(src);
 		*dst = *src;
 	}
 
@@ -780,37 +941,227 @@ static void push_and_copy_args(
 			SpnValue *argv = desc->env.native_env.argv;
 			src = &argv[i];
 		} else {
-			TSlot *caller = vm->stack + desc->env.script_env.calleroff;
+			TSlot *caller = desc->env.script_env.caller;
 			spn_uword *ip = desc->env.script_env.ip;
 			src = nth_call_arg(caller, ip, i);
 		}
 
-		spn_value_retain(src);
+		REG_RETAIN(src);
 		*dst = *src;
 	}
 }
 
+/* helper for tail calls. The arguments are taken out of the registers
+ * of the caller (and retained) before its frame is popped, then moved
+ * into the new frame, which is pushed in place of the old one, and
+ * which inherits its return address and return value register.
+ * The callee is retained by the new frame, because it may have been
+ * referenced only by a register of the popped frame.
+ */
+static void replace_frame(SpnVMachine *vm, SpnFunction *fn, spn_uword *ip, int argc)
+{
+	TFrame *hdr = FRMHDR(vm->sp);
+	spn_uword *retaddr = hdr->retaddr;
+	SpnValue *retptr = hdr->retptr;
+	spn_uword *fnhdr = fn->repr.bc;
+	int decl_argc = fnhdr[SPN_FUNCHDR_IDX_ARGC];
+	int nregs = fnhdr[SPN_FUNCHDR_IDX_NREGS];
+	int extra_argc = argc > decl_argc ? argc - decl_argc : 0;
+	SpnValue *argv;
+	int i;
+
+	#define MAX_AUTO_ARGC 16
+	SpnValue auto_argv[MAX_AUTO_ARGC];
+
+	if (argc > MAX_AUTO_ARGC) {
+		argv = spn_malloc(argc * sizeof argv[0]);
+	} else {
+		argv = auto_argv;
+	}
+
+	for (i = 0; i < argc; i++) {
+		argv[i] = *nth_call_arg(vm->sp, ip, i);
+		REG_RETAIN(&argv[i]);
+	}
+
+	spn_object_retain(fn);
+	pop_frame(vm);
+
+	push_frame(vm, nregs, decl_argc, extra_argc, argc, retaddr, retptr, fn);
+	FRMHDR(vm->sp)->owncallee = 1;
+
+	/* transfer ownership of the arguments (no retain) */
+	for (i = 0; i < decl_argc && i < argc; i++) {
+		*VALPTR(vm->sp, i) = argv[i];
+	}
+
+	for (i = decl_argc; i < argc; i++) {
+		*nth_vararg(vm->sp, i - decl_argc) = argv[i];
+	}
+
+	if (argc > MAX_AUTO_ARGC) {
+		free(argv);
+	}
+
+	#undef MAX_AUTO_ARGC
+}
+
+/* If the register already refers to the object being stored into it
+ * (e. g. a loop that loads the same global function, upvalue or array
+ * element over and over again), the retain and the release would cancel
+ * out, so neither of them is performed and the reference count of the
+ * object isn't touched at all.
+ */
+static void store_reg(SpnValue *dst, const SpnValue *src)
+{
+	if (isobject(src)) {
+		if (isobject(dst) && objvalue(dst) == objvalue(src)) {
+			return;
+		}
+
+		((SpnObject *)objvalue(src))->refcnt++;
+	}
+
+	REG_RELEASE(dst);
+	*dst = *src;
+}
+
+/* Instruction dispatch. By default, every instruction goes through the
+ * 'switch' in dispatch_loop(), which is portable C89, but it compiles to one
+ * single indirect branch shared by all opcodes, and that is very hard for
+ * the CPU to predict.
+ *
+ * If USE_THREADED_DISPATCH is nonzero and the compiler speaks GNU C
+ * (GCC and Clang do), the switch is only used for decoding the very first
+ * instruction. After that, each instruction handler fetches the next opcode
+ * itself and jumps straight to its handler through a table of label
+ * addresses ("labels as values"). This replicates the indirect branch at
+ * the end of every handler, so the branch predictor can learn which
+ * opcode usually follows which.
+ *
+ * DISPATCH_CASE() and DISPATCH_DEFAULT mark the handlers,
+ * DISPATCH_NEXT() ends them (it's a plain 'break' in switch mode).
+ */
+#if USE_THREADED_DISPATCH && defined(__GNUC__)
+#define SPN_THREADED_DISPATCH 1
+#else
+#define SPN_THREADED_DISPATCH 0
+#endif
+
+#if SPN_THREADED_DISPATCH
+
+#define DISPATCH_CASE(op)	case op: lbl_##op
+#define DISPATCH_DEFAULT	default: lbl_default
+#define DISPATCH_NEXT()                       \
+	do {                                      \
+		ins = *ip++;                          \
+		opcode = OPCODE(ins);                 \
+		goto *(opcode < COUNT(dispatch_table) \
+			? dispatch_table[opcode]          \
+			: &&lbl_default);                 \
+	} while (0)
+
+/* taking the address of a label and 'goto *' are GNU extensions */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+#else /* SPN_THREADED_DISPATCH */
+
+#define DISPATCH_CASE(op)	case op
+#define DISPATCH_DEFAULT	default
+#define DISPATCH_NEXT()		break
+
+#endif /* SPN_THREADED_DISPATCH */
+
 static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 {
+	spn_uword ins;
+	enum spn_vm_ins opcode;
+
+#if SPN_THREADED_DISPATCH
+	/* must be kept in sync with the order of 'enum spn_vm_ins' */
+	static const void *const dispatch_table[] = {
+		&&lbl_SPN_INS_CALL,
+		&&lbl_SPN_INS_RET,
+		&&lbl_SPN_INS_JMP,
+		&&lbl_SPN_INS_JZE,
+		&&lbl_SPN_INS_JNZ,
+		&&lbl_SPN_INS_EQ,
+		&&lbl_SPN_INS_NE,
+		&&lbl_SPN_INS_LT,
+		&&lbl_SPN_INS_LE,
+		&&lbl_SPN_INS_GT,
+		&&lbl_SPN_INS_GE,
+		&&lbl_SPN_INS_ADD,
+		&&lbl_SPN_INS_SUB,
+		&&lbl_SPN_INS_MUL,
+		&&lbl_SPN_INS_DIV,
+		&&lbl_SPN_INS_MOD,
+		&&lbl_SPN_INS_NEG,
+		&&lbl_SPN_INS_INC,
+		&&lbl_SPN_INS_DEC,
+		&&lbl_SPN_INS_AND,
+		&&lbl_SPN_INS_OR,
+		&&lbl_SPN_INS_XOR,
+		&&lbl_SPN_INS_SHL,
+		&&lbl_SPN_INS_SHR,
+		&&lbl_SPN_INS_BITNOT,
+		&&lbl_SPN_INS_LOGNOT,
+		&&lbl_SPN_INS_TYPEOF,
+		&&lbl_SPN_INS_CONCAT,
+		&&lbl_SPN_INS_LDCONST,
+		&&lbl_SPN_INS_LDSYM,
+		&&lbl_SPN_INS_MOV,
+		&&lbl_SPN_INS_ARGV,
+		&&lbl_SPN_INS_NEWARR,
+		&&lbl_SPN_INS_NEWHASH,
+		&&lbl_SPN_INS_IDX_GET,
+		&&lbl_SPN_INS_IDX_SET,
+		&&lbl_SPN_INS_ARR_PUSH,
+		&&lbl_SPN_INS_FUNCTION,
+		&&lbl_SPN_INS_GLBVAL,
+		&&lbl_SPN_INS_CLOSURE,
+		&&lbl_SPN_INS_LDUPVAL,
+		&&lbl_SPN_INS_METHOD,
+		&&lbl_SPN_INS_PROPGET,
+		&&lbl_SPN_INS_PROPSET,
+		&&lbl_SPN_INS_JEQ,
+		&&lbl_SPN_INS_JNE,
+		&&lbl_SPN_INS_JLT,
+		&&lbl_SPN_INS_JLE,
+		&&lbl_SPN_INS_JGT,
+		&&lbl_SPN_INS_JGE,
+		&&lbl_SPN_INS_ADDI,
+		&&lbl_SPN_INS_SUBI,
+		&&lbl_SPN_INS_FORLT,
+		&&lbl_SPN_INS_FORLE,
+		&&lbl_SPN_INS_FORGT,
+		&&lbl_SPN_INS_FORGE,
+		&&lbl_SPN_INS_LENGTH,
+		&&lbl_SPN_INS_CONCATN,
+		&&lbl_SPN_INS_TAILCALL
+	};
+
+	/* fails to compile (negative array size) if an opcode is missing */
+	typedef char dispatch_table_is_complete[
+		COUNT(dispatch_table) == SPN_INS_COUNT ? 1 : -1
+	] __attribute__((__unused__));
+#endif /* SPN_THREADED_DISPATCH */
+
 	while (1) {
-		spn_uword ins = *ip++;
-		enum spn_vm_ins opcode = OPCODE(ins);
+		ins = *ip++;
+		opcode = OPCODE(ins);
 
 		switch (opcode) {
-		case SPN_INS_CALL: {
+		DISPATCH_CASE(SPN_INS_TAILCALL):
+		DISPATCH_CASE(SPN_INS_CALL): {
 			/* XXX: the return value of a call to a Sparkling
-			 * function is stored in stack[header->retidx] and has
+			 * function is stored in *header->retptr and has
 			 * a reference count of one. Here, it MUST NOT be
 			 * retained, only its contents should be copied to the
 			 * destination register.
-			 *
-			 * offsets insetad of pointers are used here because
-			 * a function call (in particular, push_frame()) may
-			 * 'realloc()' the stack, thus rendering saved pointers
-			 * invalid.
 			 */
-			TSlot *retslot = SLOTPTR(vm->sp, OPA(ins));
-			ptrdiff_t retidx = retslot - vm->stack;
+			SpnValue *retptr = VALPTR(vm->sp, OPA(ins));
 
 			TSlot *funcslot = SLOTPTR(vm->sp, OPB(ins));
 			SpnValue func = funcslot->v; /* copy the value struct */
@@ -827,7 +1178,7 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			/* check if value is really a function */
 			if (!isfunc(&func)) {
 				const void *args[1];
-				args[0] = spn_type_name(func.type);
+				args[0] = spn_type_name(valtype(&func));
 				runtime_error(
 					vm,
 					ip - 1,
@@ -844,6 +1195,7 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 				spn_uword *retaddr = ip + narggroups;
 				SpnValue tmpret = spn_nilval;
 				SpnValue *argv;
+				TSlot *caller_sp = vm->sp;
 
 				#define MAX_AUTO_ARGC 16
 				SpnValue auto_argv[MAX_AUTO_ARGC];
@@ -855,20 +1207,35 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 					argv = auto_argv;
 				}
 
-				/* copy the arguments into the argument array */
+				/* copy the arguments into the argument array.
+				 * Native code may read the characters of a
+				 * string directly, so ropes are flattened.
+				 */
 				for (i = 0; i < argc; i++) {
 					SpnValue *val = nth_call_arg(vm->sp, ip, i);
+
+					if (isstring(val)) {
+						spn_string_flatten(objvalue(val));
+					}
+
 					argv[i] = *val;
 				}
 
-				/* push pseudo-frame for stack trace's sake
-				 * this should be done *after* having copied
-				 * the arguments, since those arguments are
-				 * taken from the topmost stack frame.
+				/* The pseudo-frame of the native function is
+				 * only needed for the stack trace, so it is not
+				 * pushed right away: most native functions
+				 * neither fail nor call back into the VM. Only
+				 * the callee is recorded, and the frame is
+				 * pushed on demand, by spn_vm_callfunc() and
+				 * spn_vm_stacktrace(), or below if the call
+				 * fails. If the frame has been pushed, then the
+				 * stack pointer differs from 'caller_sp' after
+				 * the call.
+				 *
 				 * XXX: here, 'retaddr' is not NULL (since the
 				 * function will return to Sparkling code),
 				 * but 'push_native_pseudoframe()' sets the
-				 * return register index to -1. That simply
+				 * return value pointer to NULL. That simply
 				 * means that the return value is not placed
 				 * _directly_ into the VM's stack (for safety
 				 * and correctness reasons). This would be an
@@ -877,7 +1244,8 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 				 * case, we have complete control over the
 				 * return mechanism, this is just fine.
 				 */
-				push_native_pseudoframe(vm, fnobj, retaddr);
+				vm->native = fnobj;
+				vm->nativeret = retaddr;
 
 				/* then call the native function. its return
 				 * value must have a reference count of one.
@@ -900,9 +1268,14 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 					args[0] = fnobj->name;
 					args[1] = &err;
 					spn_vm_seterrmsg(vm, "error in function '%s' (code: %i)", args);
+
+					/* the stack trace must show the failed function */
+					push_pending_native_frame(vm);
 					return err;
 				}
 
+				vm->native = NULL;
+
 				/* should not return success after an error */
 				assert(vm->haserror == 0);
 
@@ -921,11 +1294,13 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 				 * 'clean_vm_if_needed()' before the next function call)
 				 * would then attempt to double-free it.
 				 */
-				spn_value_release(&vm->stack[retidx].v);
-				vm->stack[retidx].v = tmpret;
+				REG_RELEASE(retptr);
+				*retptr = tmpret;
 
-				/* pop pseudo-frame */
-				pop_frame(vm);
+				/* pop pseudo-frame, if it has been pushed */
+				if (vm->sp != caller_sp) {
+					pop_frame(vm);
+				}
 
 				/* advance IP past the argument indices (round
 				 * up to nearest number of 'spn_uword's that
@@ -941,22 +1316,30 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 				spn_uword *retaddr = ip + narggroups;
 				spn_uword *fnhdr = fnobj->repr.bc;
 				spn_uword *entry = fnhdr + SPN_FUNCHDR_LEN;
-				ptrdiff_t calleroff = vm->sp - vm->stack;
 				struct args_copy_descriptor desc;
 
 				/* if function designates top-level program,
 				 * then parse its local symbol table
 				 */
 				if (fnobj->topprg) {
-					read_local_symtab(fnobj);
+					read_local_symtab(vm, fnobj);
+				}
+
+				/* a tail call reuses the frame of the caller,
+				 * and the callee returns directly to our caller
+				 */
+				if (opcode == SPN_INS_TAILCALL) {
+					replace_frame(vm, fnobj, ip, argc);
+					ip = entry;
+					DISPATCH_NEXT();
 				}
 
 				/* set up environment for push_and_copy_args */
 				desc.caller_is_native = 0; /* we, the caller, are a Sparkling function */
 				desc.env.script_env.ip = ip;
 				desc.env.script_env.retaddr = retaddr;
-				desc.env.script_env.calleroff = calleroff;
-				desc.env.script_env.retidx = retidx;
+				desc.env.script_env.caller = vm->sp;
+				desc.env.script_env.retptr = retptr;
 
 				/* push the frame of the callee, and
 				 * copy over its arguments
@@ -970,10 +1353,10 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 				ip = entry;
 			}
 
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_RET: {
-			TFrame *callee = &vm->sp[IDX_FRMHDR].h;
+		DISPATCH_CASE(SPN_INS_RET): {
+			TFrame *callee = FRMHDR(vm->sp);
 
 			/* storing the return value is done in two steps
 			 * because we need to ensure that if the return
@@ -988,21 +1371,22 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			SpnValue *res = VALPTR(vm->sp, OPA(ins));
 
 			/* check return info consistency */
-			assert(callee->retidx <  0 && callee->retaddr == NULL
-			    || callee->retidx >= 0 && callee->retaddr != NULL);
+			assert(callee->retptr == NULL && callee->retaddr == NULL
+			    || callee->retptr != NULL && callee->retaddr != NULL);
 
-			if (callee->retidx < 0) {
-				/* return to C-land */
+			if (callee->retptr == NULL) {
+				/* return to C-land (flattening ropes, see above) */
 				if (retvalptr != NULL) {
+					if (isstring(res)) {
+						spn_string_flatten(objvalue(res));
+					}
+
 					spn_value_retain(res);
 					*retvalptr = *res;
 				}
 			} else {
 				/* return to Sparkling-land */
-				SpnValue *retptr = &vm->stack[callee->retidx].v;
-				spn_value_retain(res);
-				spn_value_release(retptr);
-				*retptr = *res;
+				store_reg(callee->retptr, res);
 			}
 
 			/* pop the callee's frame (the current one) */
@@ -1020,9 +1404,9 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 				ip = callee->retaddr;
 			}
 
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_JMP: {
+		DISPATCH_CASE(SPN_INS_JMP): {
 			/* ip has already passed by the opcode, it now
 			 * points to the beginning of the jump offset, so
 			 * store the offset and skip it
@@ -1033,10 +1417,10 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			 */
 			spn_sword offset = *ip++;
 			ip += offset;
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_JZE:
-		case SPN_INS_JNZ: {
+		DISPATCH_CASE(SPN_INS_JZE):
+		DISPATCH_CASE(SPN_INS_JNZ): {
 			SpnValue *reg = VALPTR(vm->sp, OPA(ins));
 
 			/* XXX: if offset is supposed to be negative, the
@@ -1061,11 +1445,11 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 				ip += offset;
 			}
 
-			break;
+			DISPATCH_NEXT();
 
 		}
-		case SPN_INS_EQ:
-		case SPN_INS_NE: {
+		DISPATCH_CASE(SPN_INS_EQ):
+		DISPATCH_CASE(SPN_INS_NE): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
@@ -1080,15 +1464,15 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			        : spn_value_noteq(b, c);
 
 			/* clean and update destination register */
-			spn_value_release(a);
+			REG_RELEASE(a);
 			*a = makebool(res);
 
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_LT:
-		case SPN_INS_LE:
-		case SPN_INS_GT:
-		case SPN_INS_GE: {
+		DISPATCH_CASE(SPN_INS_LT):
+		DISPATCH_CASE(SPN_INS_LE):
+		DISPATCH_CASE(SPN_INS_GT):
+		DISPATCH_CASE(SPN_INS_GE): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
@@ -1097,8 +1481,8 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 
 			if (!spn_values_comparable(b, c)) {
 				const void *args[2];
-				args[0] = spn_type_name(b->type);
-				args[1] = spn_type_name(c->type);
+				args[0] = spn_type_name(valtype(b));
+				args[1] = spn_type_name(valtype(c));
 
 				runtime_error(
 					vm,
@@ -1112,15 +1496,15 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			}
 
 			cmpres = spn_value_compare(b, c);
-			spn_value_release(a);
+			REG_RELEASE(a);
 			*a = makebool(cmp2bool(cmpres, opcode));
 
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_ADD:
-		case SPN_INS_SUB:
-		case SPN_INS_MUL:
-		case SPN_INS_DIV: {
+		DISPATCH_CASE(SPN_INS_ADD):
+		DISPATCH_CASE(SPN_INS_SUB):
+		DISPATCH_CASE(SPN_INS_MUL):
+		DISPATCH_CASE(SPN_INS_DIV): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
@@ -1142,12 +1526,12 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			res = arith_op(b, c, opcode);
 
 			/* clean and update destination register */
-			spn_value_release(a);
+			REG_RELEASE(a);
 			*a = res;
 
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_MOD: {
+		DISPATCH_CASE(SPN_INS_MOD): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
@@ -1165,12 +1549,12 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 
 			res = intvalue(b) % intvalue(c);
 
-			spn_value_release(a);
+			REG_RELEASE(a);
 			*a = makeint(res);
 
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_NEG: {
+		DISPATCH_CASE(SPN_INS_NEG): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 
@@ -1181,18 +1565,18 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 
 			if (isfloat(b)) {
 				double res = -floatvalue(b);
-				spn_value_release(a);
+				REG_RELEASE(a);
 				*a = makefloat(res);
 			} else {
 				long res = -intvalue(b);
-				spn_value_release(a);
+				REG_RELEASE(a);
 				*a = makeint(res);
 			}
 
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_INC:
-		case SPN_INS_DEC: {
+		DISPATCH_CASE(SPN_INS_INC):
+		DISPATCH_CASE(SPN_INS_DEC): {
 			SpnValue *val = VALPTR(vm->sp, OPA(ins));
 
 			if (!isnum(val)) {
@@ -1201,26 +1585,20 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			}
 
 			if (isfloat(val)) {
-				if (opcode == SPN_INS_INC) {
-					val->v.f++;
-				} else {
-					val->v.f--;
-				}
+				double f = floatvalue(val);
+				*val = makefloat(opcode == SPN_INS_INC ? f + 1 : f - 1);
 			} else {
-				if (opcode == SPN_INS_INC) {
-					val->v.i++;
-				} else {
-					val->v.i--;
-				}
+				long i = intvalue(val);
+				*val = makeint(opcode == SPN_INS_INC ? i + 1 : i - 1);
 			}
 
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_AND:
-		case SPN_INS_OR:
-		case SPN_INS_XOR:
-		case SPN_INS_SHL:
-		case SPN_INS_SHR: {
+		DISPATCH_CASE(SPN_INS_AND):
+		DISPATCH_CASE(SPN_INS_OR):
+		DISPATCH_CASE(SPN_INS_XOR):
+		DISPATCH_CASE(SPN_INS_SHL):
+		DISPATCH_CASE(SPN_INS_SHR): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
@@ -1232,12 +1610,12 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			}
 
 			res = bitwise_op(b, c, opcode);
-			spn_value_release(a);
+			REG_RELEASE(a);
 			*a = makeint(res);
 
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_BITNOT: {
+		DISPATCH_CASE(SPN_INS_BITNOT): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			long res;
@@ -1248,12 +1626,12 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			}
 
 			res = ~intvalue(b);
-			spn_value_release(a);
+			REG_RELEASE(a);
 			*a = makeint(res);
 
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_LOGNOT: {
+		DISPATCH_CASE(SPN_INS_LOGNOT): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			int res;
@@ -1264,41 +1642,70 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			}
 
 			res = !boolvalue(b);
-			spn_value_release(a);
+			REG_RELEASE(a);
 			*a = makebool(res);
 
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_TYPEOF: {
+		DISPATCH_CASE(SPN_INS_TYPEOF): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 
 			SpnValue res = typeof_value(b);
-			spn_value_release(a);
+			REG_RELEASE(a);
 			*a = res;
 
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_CONCAT: {
+		DISPATCH_CASE(SPN_INS_CONCAT): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
-			SpnString *res;
+			SpnString *parts[2], *res;
 
 			if (!isstring(b) || !isstring(c)) {
 				runtime_error(vm, ip - 1, "concatenation of non-string values", NULL);
 				return -1;
 			}
 
-			res = spn_string_concat(stringvalue(b), stringvalue(c));
+			/* not 'stringvalue()', since ropes need not be flattened */
+			parts[0] = objvalue(b);
+			parts[1] = objvalue(c);
+			res = spn_string_concat_n(parts, 2);
 
-			spn_value_release(a);
-			a->type = SPN_TYPE_STRING;
-			a->v.o = res;
+			REG_RELEASE(a);
+			*a = spn_makeobject(SPN_TYPE_STRING, res);
 
-			break;
+			DISPATCH_NEXT();
+		}
+		DISPATCH_CASE(SPN_INS_CONCATN): {
+			SpnValue *a = VALPTR(vm->sp, OPA(ins));
+			int n = OPB(ins);
+			SpnString *parts[256], *res;
+			int i;
+
+			for (i = 0; i < n; i++) {
+				SpnValue *part = nth_call_arg(vm->sp, ip, i);
+
+				if (!isstring(part)) {
+					runtime_error(vm, ip - 1, "concatenation of non-string values", NULL);
+					return -1;
+				}
+
+				parts[i] = objvalue(part);
+			}
+
+			res = spn_string_concat_n(parts, n);
+
+			REG_RELEASE(a);
+			*a = spn_makeobject(SPN_TYPE_STRING, res);
+
+			/* skip operand register indices */
+			ip += ROUNDUP(n, SPN_WORD_OCTETS);
+
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_LDCONST: {
+		DISPATCH_CASE(SPN_INS_LDCONST): {
 			/* the first argument is the destination register */
 			SpnValue *dst = VALPTR(vm->sp, OPA(ins));
 
@@ -1308,7 +1715,7 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			enum spn_const_kind type = OPB(ins);
 
 			/* clear previous value */
-			spn_value_release(dst);
+			REG_RELEASE(dst);
 
 			switch (type) {
 			case SPN_CONST_NIL:
@@ -1338,16 +1745,16 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 				SHANT_BE_REACHED();
 			}
 
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_LDSYM: {
+		DISPATCH_CASE(SPN_INS_LDSYM): {
 			/* operand A is the destination; operand B (16 bits)
 			 * is the index of the symbol in the local symbol table
 			 */
 			SpnValue *dst = VALPTR(vm->sp, OPA(ins));
 			unsigned symidx = OPMID(ins); /* just if it's 16 bits */
 
-			TFrame *frmhdr = &vm->sp[IDX_FRMHDR].h;
+			TFrame *frmhdr = FRMHDR(vm->sp);
 			SpnArray *symtab = frmhdr->callee->symtab;
 			SpnValue sym = spn_array_get(symtab, symidx);
 			assert(notnil(&sym)); /* must not be nil */
@@ -1366,13 +1773,11 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			}
 
 			/* set the new - now surely resolved - value */
-			spn_value_retain(&sym);
-			spn_value_release(dst);
-			*dst = sym;
+			store_reg(dst, &sym);
 
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_MOV: {
+		DISPATCH_CASE(SPN_INS_MOV): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 
@@ -1383,14 +1788,12 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			 * or value), but MOV won't be emitted anyway to
 			 * move a value onto itself, because that's silly.
 			 */
-			spn_value_retain(b);
-			spn_value_release(a);
-			*a = *b;
+			store_reg(a, b);
 
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_ARGV: {
-			TFrame *hdr = &vm->sp[IDX_FRMHDR].h;
+		DISPATCH_CASE(SPN_INS_ARGV): {
+			TFrame *hdr = FRMHDR(vm->sp);
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 
 			/* construct argument vector lazily, on-demand */
@@ -1417,46 +1820,53 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			 * because the SpnArray backing argv is always referred to
 			 * by the strong 'hdr->argv' pointer.
 			 */
-			spn_value_release(a);
-			a->type = SPN_TYPE_ARRAY;
-			a->v.o = hdr->argv;
-			spn_value_retain(a);
+			REG_RELEASE(a);
+			*a = spn_makeobject(SPN_TYPE_ARRAY, hdr->argv);
+			REG_RETAIN(a);
 
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_NEWARR: {
+		DISPATCH_CASE(SPN_INS_NEWARR): {
 			SpnValue *dst = VALPTR(vm->sp, OPA(ins));
-			spn_value_release(dst);
-			*dst = makearray();
-			break;
+			SpnValue arr = makearray();
+			spn_array_reserve(arrayvalue(&arr), OPMID(ins));
+			REG_RELEASE(dst);
+			*dst = arr;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_NEWHASH: {
+		DISPATCH_CASE(SPN_INS_NEWHASH): {
 			SpnValue *dst = VALPTR(vm->sp, OPA(ins));
-			spn_value_release(dst);
-			*dst = makehashmap();
-			break;
+			SpnValue hm = spn_makeobject(SPN_TYPE_HASHMAP, spn_hashmap_new_shaped(vm->shapes));
+			spn_hashmap_reserve(hashmapvalue(&hm), OPMID(ins));
+			REG_RELEASE(dst);
+			*dst = hm;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_IDX_GET: {
+		DISPATCH_CASE(SPN_INS_IDX_GET): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
 
 			if (ishashmap(b)) {
 				SpnValue val = spn_hashmap_get(hashmapvalue(b), c);
-				spn_value_retain(&val);
-				spn_value_release(a);
-				*a = val;
+				store_reg(a, &val);
 			} else if (isarray(b)) {
+				SpnArray *arr = arrayvalue(b);
 				SpnValue val;
 
 				if (indexing_array_check(vm, ip - 1, b, c) != 0) {
 					return -1;
 				}
 
-				val = spn_array_get(arrayvalue(b), intvalue(c));
-				spn_value_retain(&val);
-				spn_value_release(a);
-				*a = val;
+				/* elements of packed arrays are boxed right here */
+				switch (arr->kind) {
+				case SPN_ARRAY_INTS:   val = makeint(arr->vector.ints[intvalue(c)]);     break;
+				case SPN_ARRAY_FLOATS: val = makefloat(arr->vector.floats[intvalue(c)]); break;
+				case SPN_ARRAY_BYTES:  val = makeint(arr->vector.bytes[intvalue(c)]);    break;
+				default:               val = arr->vector.values[intvalue(c)];            break;
+				}
+
+				store_reg(a, &val);
 			} else if (isstring(b)) {
 				unsigned char ch;
 				long index;
@@ -1470,18 +1880,18 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 				index = intvalue(c);
 				ch = str->cstr[index];
 
-				spn_value_release(a);
+				REG_RELEASE(a);
 				*a = makeint(ch);
 			} else {
 				const void *args[1];
-				args[0] = spn_type_name(b->type);
+				args[0] = spn_type_name(valtype(b));
 				runtime_error(vm, ip - 1, "cannot subscript value of type %s", args);
 				return -1;
 			}
 
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_IDX_SET: {
+		DISPATCH_CASE(SPN_INS_IDX_SET): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
@@ -1493,21 +1903,37 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 
 				spn_hashmap_set(hashmapvalue(a), b, c);
 			} else if (isarray(a)) {
+				SpnArray *arr = arrayvalue(a);
+
 				if (indexing_array_check(vm, ip - 1, a, b) != 0) {
 					return -1;
 				}
 
-				spn_array_set(arrayvalue(a), intvalue(b), c);
+				/* the common cases of packed arrays are unboxed right
+				 * here, unless the elements are shared with a slice
+				 */
+				if (arr->owner == NULL && arr->kind == SPN_ARRAY_FLOATS && isfloat(c)) {
+					arr->vector.floats[intvalue(b)] = floatvalue(c);
+				} else if (arr->owner == NULL && arr->kind == SPN_ARRAY_INTS && isint(c)) {
+					arr->vector.ints[intvalue(b)] = intvalue(c);
+				} else if (spn_array_accepts(arr, c)) {
+					spn_array_set(arr, intvalue(b), c);
+				} else {
+					const void *args[1];
+					args[0] = spn_type_name(valtype(c));
+					runtime_error(vm, ip - 1, "value of type %s cannot be stored in a packed array", args);
+					return -1;
+				}
 			} else {
 				const void *args[1];
-				args[0] = spn_type_name(a->type);
+				args[0] = spn_type_name(valtype(a));
 				runtime_error(vm, ip - 1, "cannot index value of type %s", args);
 				return -1;
 			}
 
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_ARR_PUSH: {
+		DISPATCH_CASE(SPN_INS_ARR_PUSH): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 
@@ -1515,9 +1941,9 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 
 			spn_array_push(arrayvalue(a), b);
 
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_FUNCTION: {
+		DISPATCH_CASE(SPN_INS_FUNCTION): {
 			/* pointer to the symbol header, see the SPN_FUNCHDR_*
 			 * macros in vm.h.
 			 * save header position, fill in properties
@@ -1533,9 +1959,9 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			/* skip the function header and function body */
 			ip += SPN_FUNCHDR_LEN + bodylen;
 
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_GLBVAL: {
+		DISPATCH_CASE(SPN_INS_GLBVAL): {
 			/* instruction format is "mid": 8 bit operand A for the
 			 * register number from which to read the expression,
 			 * 16-bit operand B to store the length of the name
@@ -1573,9 +1999,9 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			}
 
 			spn_hashmap_set_strkey(vm->glbsymtab, symname, src);
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_CLOSURE: {
+		DISPATCH_CASE(SPN_INS_CLOSURE): {
 			int reg_index = OPA(ins);
 			int n_upvals = OPB(ins);
 			int i;
@@ -1586,7 +2012,7 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			/* We need a reference to the environment of the closure
 			 * to be created. It is the currently executing function.
 			 */
-			SpnFunction *enclosing_fn = vm->sp[IDX_FRMHDR].h.callee;
+			SpnFunction *enclosing_fn = FRMHDR(vm->sp)->callee;
 
 			/* create a closure function object by appropriately
 			 * "copying" the prototype in the reg_index-th register
@@ -1603,13 +2029,11 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			 * itself (i. e. the closure object) as an upvalue,
 			 * as opposed to its prototype (which is not a closure).
 			 *
-			 * We can re-use the pointer since this instruction
-			 * does not push to the stack, so the stack is not
-			 * realloc()'ed, and consequently, pointers into the
-			 * stack frame are not invalidated.
+			 * We can re-use the pointer since the stack is never
+			 * reallocated, so pointers into the stack frame are
+			 * not invalidated.
 			 */
-			prototype_val->type = SPN_TYPE_FUNC; /* redundant */
-			prototype_val->v.o = closure;
+			*prototype_val = spn_makeobject(SPN_TYPE_FUNC, closure);
 
 			for (i = 0; i < n_upvals; i++) {
 				spn_uword upval_desc = *ip++;
@@ -1641,26 +2065,23 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			 */
 			spn_object_release(prototype);
 
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_LDUPVAL: {
+		DISPATCH_CASE(SPN_INS_LDUPVAL): {
 			int reg_index   = OPA(ins);
 			int upval_index = OPB(ins);
 
 			/* grab a reference to the currently executing function */
-			SpnFunction *current_fn = vm->sp[IDX_FRMHDR].h.callee;
-
-			/* release previous content of 'reg_index'-th register */
-			SpnValue *reg = VALPTR(vm->sp, reg_index);
-			spn_value_release(reg);
+			SpnFunction *current_fn = FRMHDR(vm->sp)->callee;
 
 			/* store upvalue into register and retain it */
-			*reg = spn_array_get(current_fn->upvalues, upval_index);
-			spn_value_retain(reg);
+			SpnValue *reg = VALPTR(vm->sp, reg_index);
+			SpnValue upval = spn_array_get(current_fn->upvalues, upval_index);
+			store_reg(reg, &upval);
 
-			break;
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_METHOD: {
+		DISPATCH_CASE(SPN_INS_METHOD): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins)); /* result         */
 			SpnValue *b = VALPTR(vm->sp, OPB(ins)); /* object, 'self' */
 			SpnValue *c = VALPTR(vm->sp, OPC(ins)); /* method name    */
@@ -1672,80 +2093,67 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			 * the value for 'name'. (it may not be a function, in
 			 * which case, INS_CALL will throw an error anyway.
 			 */
-			if (lookup_member(vm, &tmp, b, c)) {
-				spn_value_retain(&tmp);
-				spn_value_release(a);
-				*a = tmp;
-				break;
+			if (lookup_member_cached(vm, ip - 1, &tmp, b, c)) {
+				store_reg(a, &tmp);
+				DISPATCH_NEXT();
 			}
 
-			args[0] = spn_type_name(b->type);
+			args[0] = spn_type_name(valtype(b));
 			runtime_error(vm, ip - 1, "object of type %s has no class", args);
 			return -1;
 		}
-		case SPN_INS_PROPGET: {
+		DISPATCH_CASE(SPN_INS_PROPGET): {
 			SpnValue *result = VALPTR(vm->sp, OPA(ins));
 			SpnValue *pself  = VALPTR(vm->sp, OPB(ins));
 			SpnValue *prname = VALPTR(vm->sp, OPC(ins));
 
-			SpnValue accval, gval, tmp; /* accessors; getter; and temporary */
-			const void *args[2]; /* for error reporting */
-
 			assert(isstring(prname));
 
-			/* if this is a special property, treat it as such */
+			/* if this is a special property, treat it as such
+			 * (the compiler emits SPN_INS_LENGTH for '.length',
+			 * but hand-written or older bytecode may not)
+			 */
 			if (get_builtin_property(result, pself, prname)) {
-				break;
+				DISPATCH_NEXT();
 			}
 
-			if (lookup_member(vm, &accval, pself, prname)) {
-				if (ishashmap(&accval)) {
-					SpnHashMap *accessors = hashmapvalue(&accval);
-					gval = spn_hashmap_get(accessors, &vm->getname);
-
-					if (isfunc(&gval)) {
-						/* copy the arguments because calling the getter may
-						 * reallocate the stack, invalidating all pointers
-						 */
-						SpnFunction *getter = funcvalue(&gval);
-						SpnValue gargv[2], grv;
-						gargv[0] = *pself;
-						gargv[1] = *prname;
-
-						if (spn_vm_callfunc(vm, getter, &grv, COUNT(gargv), gargv) != 0) {
-							return -1;
-						}
+			if (get_property(vm, ip, OPA(ins), pself, prname) != 0) {
+				return -1;
+			}
 
-						result = VALPTR(vm->sp, OPA(ins));
-						spn_value_release(result);
-						*result = grv;
+			DISPATCH_NEXT();
+		}
+		DISPATCH_CASE(SPN_INS_LENGTH): {
+			SpnValue *a = VALPTR(vm->sp, OPA(ins));
+			SpnValue *b = VALPTR(vm->sp, OPB(ins));
+			size_t length;
 
-						break; /* break out if getter was called! */
-					}
+			switch (valtype(b)) {
+			case SPN_TTAG_STRING:
+				/* not 'stringvalue()': a rope knows its length */
+				length = ((SpnString *)objvalue(b))->len;
+				break;
+			case SPN_TTAG_ARRAY:
+				length = spn_array_count(arrayvalue(b));
+				break;
+			case SPN_TTAG_HASHMAP:
+				length = spn_hashmap_count(hashmapvalue(b));
+				break;
+			default:
+				/* no built-in length, look for a getter */
+				if (get_property(vm, ip, OPA(ins), b, &vm->lengthname) != 0) {
+					return -1;
 				}
-			}
 
-			/* else if self is a hashmap, fall back to raw indexing getter.
-			 * We can use the original pointers here, since if control
-			 * flow reached this point, that means that no getter has
-			 * been found, consequently no function could be called.
-			 */
-			if (ishashmap(pself) && lookup_member(vm, &tmp, pself, prname)) {
-				spn_value_retain(&tmp);
-				spn_value_release(result);
-				*result = tmp;
-				break;
+				DISPATCH_NEXT();
 			}
 
-			/* at this point, the value had neither a class nor an
-			 * appropriate getter function, and it's not a hashmap
-			 */
-			args[0] = spn_type_name(pself->type);
-			args[1] = stringvalue(prname)->cstr;
-			runtime_error(vm, ip - 1, "value of type %s has no getter for property '%s'", args);
-			return -1;
+			REG_RELEASE(a);
+			*a = makeint(length);
+
+			DISPATCH_NEXT();
 		}
-		case SPN_INS_PROPSET: {
+		DISPATCH_CASE(SPN_INS_PROPSET): {
 			SpnValue *pself  = VALPTR(vm->sp, OPA(ins)); /* object, 'self' */
 			SpnValue *prname = VALPTR(vm->sp, OPB(ins)); /* property name  */
 			SpnValue *newval = VALPTR(vm->sp, OPC(ins)); /* new value      */
@@ -1755,7 +2163,7 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 
 			assert(isstring(prname));
 
-			if (lookup_member(vm, &accval, pself, prname)) {
+			if (lookup_member_cached(vm, ip - 1, &accval, pself, prname)) {
 				if (ishashmap(&accval)) {
 					SpnHashMap *accessors = hashmapvalue(&accval);
 					sval = spn_hashmap_get(accessors, &vm->setname);
@@ -1763,7 +2171,7 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 					if (isfunc(&sval)) {
 						SpnFunction *setter = funcvalue(&sval);
 						SpnValue sargv[3];
-						/* again, copy arguments */
+						/* again, arguments must be contiguous */
 						sargv[0] = *pself;
 						sargv[1] = *newval; /* reverse order! value first, */
 						sargv[2] = *prname; /* and only then comes the key */
@@ -1773,7 +2181,7 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 							return -1;
 						}
 
-						break; /* nothing to do if setter was called successfully */
+						DISPATCH_NEXT(); /* nothing to do if setter was called successfully */
 					}
 				}
 			}
@@ -1784,16 +2192,159 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 				 * since the key is always a string (so not NaN or 'nil')
 				 */
 				spn_hashmap_set(hashmapvalue(pself), prname, newval);
-				break;
+				DISPATCH_NEXT();
 			}
 
 			/* if 'self' is not a hashmap, though, there's no more hope */
-			args[0] = spn_type_name(pself->type);
+			args[0] = spn_type_name(valtype(pself));
 			args[1] = stringvalue(prname)->cstr;
 			runtime_error(vm, ip - 1, "value of type %s has no setter for property '%s'", args);
 			return -1;
 		}
-		default: /* I am sorry for the indentation here. */
+		DISPATCH_CASE(SPN_INS_JEQ):
+		DISPATCH_CASE(SPN_INS_JNE): {
+			SpnValue *a = VALPTR(vm->sp, OPA(ins));
+			SpnValue *b = VALPTR(vm->sp, OPB(ins));
+			spn_sword offset = *ip++;
+
+			int res = spn_value_equal(a, b);
+
+			if (opcode == SPN_INS_JEQ ? res : !res) {
+				ip += offset;
+			}
+
+			DISPATCH_NEXT();
+		}
+		DISPATCH_CASE(SPN_INS_JLT):
+		DISPATCH_CASE(SPN_INS_JLE):
+		DISPATCH_CASE(SPN_INS_JGT):
+		DISPATCH_CASE(SPN_INS_JGE): {
+			SpnValue *a = VALPTR(vm->sp, OPA(ins));
+			SpnValue *b = VALPTR(vm->sp, OPB(ins));
+			spn_sword offset = *ip++;
+
+			int cmpres;
+
+			/* fast path for the most common case, integer loop
+			 * counters and indices; otherwise, do what the
+			 * ordinary comparison instructions do
+			 */
+			if (isint(a) && isint(b)) {
+				long x = intvalue(a), y = intvalue(b);
+				cmpres = x < y ? -1 : x > y ? +1 : 0;
+			} else if (spn_values_comparable(a, b)) {
+				cmpres = spn_value_compare(a, b);
+			} else {
+				const void *args[2];
+				args[0] = spn_type_name(valtype(a));
+				args[1] = spn_type_name(valtype(b));
+
+				runtime_error(
+					vm,
+					ip - 2,
+					"ordered comparison of uncomparable values"
+					" of type %s and %s",
+					args
+				);
+
+				return -1;
+			}
+
+			if (cmp2bool(cmpres, opcode)) {
+				ip += offset;
+			}
+
+			DISPATCH_NEXT();
+		}
+		DISPATCH_CASE(SPN_INS_ADDI):
+		DISPATCH_CASE(SPN_INS_SUBI): {
+			SpnValue *a = VALPTR(vm->sp, OPA(ins));
+			SpnValue *b = VALPTR(vm->sp, OPB(ins));
+			long c = OPC(ins); /* immediate, not a register */
+			SpnValue res;
+
+			if (opcode == SPN_INS_SUBI) {
+				c = -c;
+			}
+
+			if (isint(b)) {
+				res = makeint(intvalue(b) + c);
+			} else if (isfloat(b)) {
+				res = makefloat(floatvalue(b) + c);
+			} else {
+				runtime_error(vm, ip - 1, "arithmetic on non-numbers", NULL);
+				return -1;
+			}
+
+			/* clean and update destination register */
+			REG_RELEASE(a);
+			*a = res;
+
+			DISPATCH_NEXT();
+		}
+		DISPATCH_CASE(SPN_INS_FORLT):
+		DISPATCH_CASE(SPN_INS_FORLE):
+		DISPATCH_CASE(SPN_INS_FORGT):
+		DISPATCH_CASE(SPN_INS_FORGE): {
+			SpnValue *a = VALPTR(vm->sp, OPA(ins)); /* counter */
+			SpnValue *b = VALPTR(vm->sp, OPB(ins)); /* limit   */
+			int c = OPC(ins);
+			spn_sword offset = *ip++;
+
+			/* operand C is an 8-bit two's complement integer */
+			long step = c < 0x80 ? c : c - 0x100;
+			int cmpres;
+
+			/* integer counter and limit: no type dispatch needed
+			 * (it's OK to modify the counter in place: numbers are
+			 * not reference counted)
+			 */
+			if (isint(a) && isint(b)) {
+				long x, y;
+
+				*a = makeint(intvalue(a) + step);
+				x = intvalue(a);
+				y = intvalue(b);
+				cmpres = x < y ? -1 : x > y ? +1 : 0;
+			} else {
+				/* otherwise, do what INC/DEC and LT...GE would do */
+				if (!isnum(a)) {
+					runtime_error(vm, ip - 2, "incrementing or decrementing non-number", NULL);
+					return -1;
+				}
+
+				if (isfloat(a)) {
+					*a = makefloat(floatvalue(a) + step);
+				} else {
+					*a = makeint(intvalue(a) + step);
+				}
+
+				if (!spn_values_comparable(a, b)) {
+					const void *args[2];
+					args[0] = spn_type_name(valtype(a));
+					args[1] = spn_type_name(valtype(b));
+
+					runtime_error(
+						vm,
+						ip - 2,
+						"ordered comparison of uncomparable values"
+						" of type %s and %s",
+						args
+					);
+
+					return -1;
+				}
+
+				cmpres = spn_value_compare(a, b);
+			}
+
+			if (cmp2bool(cmpres, opcode)) {
+				ip += offset;
+			}
+
+			DISPATCH_NEXT();
+		}
+		DISPATCH_DEFAULT: /* I am sorry for the indentation here. */
 			{
 				unsigned long lopcode = opcode;
 				const void *args[1];
@@ -1805,7 +2356,66 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 	}
 }
 
-static void read_local_symtab(SpnFunction *program)
+#if SPN_THREADED_DISPATCH
+#pragma GCC diagnostic pop
+#endif
+
+/* The interning table doesn't keep strings alive on its own. Whenever the
+ * number of strings in it has doubled since it was last purged, the ones
+ * which are only referenced by the table (which holds two references to
+ * each string: one as the key and one as the value) are removed from it.
+ * So a REPL or any other compile-and-run loop doesn't accumulate the
+ * constants of all the programs it has ever freed.
+ */
+static void purge_strings(SpnVMachine *vm)
+{
+	size_t cursor = 0;
+	SpnValue key, val;
+
+	while ((cursor = spn_hashmap_next(vm->strings, cursor, &key, &val)) != 0) {
+		SpnObject *obj = objvalue(&key);
+
+		if (obj->refcnt == 2) {
+			spn_hashmap_delete(vm->strings, &key);
+		}
+	}
+
+	vm->strlimit = 2 * spn_hashmap_count(vm->strings);
+
+	if (vm->strlimit < MIN_INTERN_LIMIT) {
+		vm->strlimit = MIN_INTERN_LIMIT;
+	}
+}
+
+/* Returns the (retained) interned string with the given contents.
+ * All string constants in programs run by the same virtual machine are
+ * interned, so equal constants (member names, most importantly) are
+ * represented by the very same string object, with its hash computed in
+ * advance. Comparing them thus only takes a pointer comparison. The
+ * characters are copied, since the bytecode may not outlive the string.
+ */
+static SpnValue intern_string(SpnVMachine *vm, const char *cstr, size_t len)
+{
+	SpnValue str = makestring_len(cstr, len);
+	SpnValue interned = spn_hashmap_get(vm->strings, &str);
+
+	if (notnil(&interned)) {
+		spn_value_release(&str);
+		spn_value_retain(&interned);
+		return interned;
+	}
+
+	if (spn_hashmap_count(vm->strings) >= vm->strlimit) {
+		purge_strings(vm);
+	}
+
+	spn_hash_value(&str);
+	spn_hashmap_set(vm->strings, &str, &str);
+
+	return str;
+}
+
+static void read_local_symtab(SpnVMachine *vm, SpnFunction *program)
 {
 	spn_uword *bc = program->repr.bc;
 
@@ -1854,7 +2464,7 @@ static void read_local_symtab(SpnFunction *program)
 			assert(len == reallen);
 #endif
 
-			strval = makestring_nocopy_len(cstr, len, 0);
+			strval = intern_string(vm, cstr, len);
 			spn_array_push(program->symtab, &strval);
 			spn_value_release(&strval);
 
@@ -1933,10 +2543,10 @@ static void read_local_symtab(SpnFunction *program)
 static int cmp2bool(int res, int op)
 {
 	switch (op) {
-	case SPN_INS_LT: return res <  0;
-	case SPN_INS_LE: return res <= 0;
-	case SPN_INS_GT: return res >  0;
-	case SPN_INS_GE: return res >= 0;
+	case SPN_INS_LT: case SPN_INS_JLT: case SPN_INS_FORLT: return res <  0;
+	case SPN_INS_LE: case SPN_INS_JLE: case SPN_INS_FORLE: return res <= 0;
+	case SPN_INS_GT: case SPN_INS_JGT: case SPN_INS_FORGT: return res >  0;
+	case SPN_INS_GE: case SPN_INS_JGE: case SPN_INS_FORGE: return res >= 0;
 	default: SHANT_BE_REACHED();
 	}
 
@@ -2041,7 +2651,7 @@ static int indexing_array_check(SpnVMachine *vm, spn_uword *ip, SpnValue *varr,
 
 	if (!isint(vidx)) {
 		const void *args[1];
-		args[0] = spn_type_name(vidx->type);
+		args[0] = spn_type_name(valtype(vidx));
 		runtime_error(vm, ip, "indexing array with non-integer value of type %s", args);
 		return -1;
 	}
@@ -2070,7 +2680,7 @@ static int indexing_string_check(SpnVMachine *vm, spn_uword *ip, SpnValue *vstr,
 
 	if (!isint(vidx)) {
 		const void *args[1];
-		args[0] = spn_type_name(vidx->type);
+		args[0] = spn_type_name(valtype(vidx));
 		runtime_error(vm, ip, "indexing string with non-integer value of type %s", args);
 		return -1;
 	}
@@ -2109,14 +2719,9 @@ static int indexing_hashmap_check(SpnVMachine *vm, spn_uword *ip, SpnValue *vidx
 	return 0;
 }
 
-/* XXX: this function *MUST NOT* use 'spn_vm_callfunc()' or
- * reallocate the call stack in any way, since it is passed
- * pointers pointing straight within the active stack frame!
- *
- * XXX: So, if we ever implement destructors, the calls to the
- * 'spn_value_release()' function will potentially call the
- * destructor of whatever originally was in 'dstreg', and
- * that can invalidate the stack, so this will no longer work.
+/* This function is passed pointers pointing straight within the active
+ * stack frame. That's fine, since the stack is never reallocated, so
+ * they remain valid even if the function calls back into the VM.
  */
 static int get_builtin_property(SpnValue *dstreg, SpnValue *pself, SpnValue *nameval)
 {
@@ -2125,8 +2730,8 @@ static int get_builtin_property(SpnValue *dstreg, SpnValue *pself, SpnValue *nam
 	switch (valtype(pself)) {
 	case SPN_TTAG_STRING: {
 		if (strcmp(name, "length") == 0) {
-			size_t length = stringvalue(pself)->len;
-			spn_value_release(dstreg);
+			size_t length = ((SpnString *)objvalue(pself))->len;
+			REG_RELEASE(dstreg);
 			*dstreg = makeint(length);
 			return 1;
 		}
@@ -2137,7 +2742,7 @@ static int get_builtin_property(SpnValue *dstreg, SpnValue *pself, SpnValue *nam
 		if (strcmp(name, "length") == 0) {
 			SpnArray *arr = arrayvalue(pself);
 			size_t length = spn_array_count(arr);
-			spn_value_release(dstreg);
+			REG_RELEASE(dstreg);
 			*dstreg = makeint(length);
 			return 1;
 		}
@@ -2148,7 +2753,7 @@ static int get_builtin_property(SpnValue *dstreg, SpnValue *pself, SpnValue *nam
 		if (strcmp(name, "length") == 0) {
 			SpnHashMap *hm = hashmapvalue(pself);
 			size_t length = spn_hashmap_count(hm);
-			spn_value_release(dstreg);
+			REG_RELEASE(dstreg);
 			*dstreg = makeint(length);
 			return 1;
 		}
@@ -2241,8 +2846,236 @@ static int lookup_member(SpnVMachine *vm, SpnValue *result, SpnValue *pself, Spn
 	return 1;
 }
 
+/* Inline caches for member lookup.
+ * Each SPN_INS_METHOD, SPN_INS_PROPGET, SPN_INS_PROPSET and SPN_INS_LENGTH
+ * instruction gets its own cache entry in the top-level program in which
+ * it resides. Entries are indexed by the bytecode offset of the instruction,
+ * and they remember the result of the last lookup performed there, along
+ * with what the result depended on: the type of the receiver, the class
+ * descriptor the search started at, and the name of the member.
+ *
+ * Every hashmap visited during a cached lookup is marked as a class (see
+ * spn_hashmap_mark_class()), so if any of them is modified afterwards, the
+ * global class version number changes, and the entry is not used anymore.
+ * That's also why it's safe for an entry not to own the member it caches.
+ *
+ * Hashmaps themselves are not cached, because objects are usually modified
+ * much more frequently than their classes are. So for hashmaps, the object
+ * itself is always searched, and only the lookup starting at its 'super'
+ * is cached. However, if the hashmap has a shape (see hashmap.h), then
+ * the slot index of the member in that shape is remembered, so that the
+ * search in the object itself boils down to comparing the shape and loading
+ * the value from the slot. User info values have per-instance classes, so
+ * they are not cached at all.
+ */
+typedef struct MemberCache {
+	unsigned long version;   /* class version when the entry was filled */
+	int typetag;             /* type tag of the receiver                */
+	SpnHashMap *start;       /* 'super' of hashmap receiver, or NULL    */
+	SpnString *name;         /* name of the member (weak)               */
+	SpnValue member;         /* the member itself (weak)                */
+	const void *shape;       /* shape of the last hashmap receiver      */
+	long slot;               /* index of member in 'shape', or -1       */
+} MemberCache;
+
+/* returns the cache entry of the instruction at 'offset' in 'env',
+ * allocating the entry or the cache itself if necessary
+ */
+static MemberCache *member_cache_entry(SpnFunction *env, size_t offset, SpnValue *name)
+{
+	MemberCache *cache;
+
+	if (env->icache == NULL) {
+		env->icache = spn_calloc(env->nwords, sizeof env->icache[0]);
+	}
+
+	cache = env->icache[offset];
+
+	if (cache == NULL) {
+		cache = spn_malloc(sizeof *cache);
+		env->icache[offset] = cache;
+		cache->name = NULL;
+	}
+
+	/* a new or a reused entry is invalid until it's filled in */
+	if (cache->name != objvalue(name)) {
+		cache->name = objvalue(name);
+		cache->typetag = -1;
+		cache->shape = NULL;
+	}
+
+	return cache;
+}
+
+/* like lookup_member_chained(), but it also marks the hashmaps it visits */
+static int lookup_member_chained_marking(SpnVMachine *vm, SpnValue *result, SpnHashMap *root, SpnValue *name)
+{
+	while (1) {
+		SpnValue tmp = spn_hashmap_get(root, name);
+		SpnValue super;
+
+		spn_hashmap_mark_class(root);
+
+		if (notnil(&tmp)) {
+			*result = tmp;
+			return 1;
+		}
+
+		super = spn_hashmap_get(root, &vm->supername);
+
+		if (!ishashmap(&super)) {
+			return 0;
+		}
+
+		root = hashmapvalue(&super);
+	}
+}
+
+static int lookup_member_cached(SpnVMachine *vm, spn_uword *insptr, SpnValue *result, SpnValue *pself, SpnValue *name)
+{
+	SpnFunction *env = FRMHDR(vm->sp)->callee->env;
+	size_t offset = insptr - env->repr.bc;
+	int typetag = valtype(pself);
+	SpnValue tagval = makeint(typetag);
+	SpnHashMap *start = NULL;
+	MemberCache *cache;
+	SpnValue root;
+
+	assert(isstring(name));
+	assert(offset < env->nwords);
+
+	switch (typetag) {
+	case SPN_TTAG_USERINFO:
+		return lookup_member(vm, result, pself, name);
+	case SPN_TTAG_HASHMAP: {
+		SpnHashMap *hm = hashmapvalue(pself);
+		const void *shape = spn_hashmap_shape(hm);
+		SpnValue tmp;
+
+		if (shape == NULL) {
+			/* plain hash table, no shortcut */
+			tmp = spn_hashmap_get(hm, name);
+		} else {
+			cache = member_cache_entry(env, offset, name);
+
+			if (cache->shape != shape) {
+				cache->shape = shape;
+				cache->slot = spn_hashmap_slot_index(hm, name);
+			}
+
+			tmp = cache->slot >= 0 ? spn_hashmap_slot_get(hm, cache->slot) : spn_nilval;
+		}
+
+		if (notnil(&tmp)) {
+			*result = tmp;
+			return 1;
+		}
+
+		tmp = spn_hashmap_get(hm, &vm->supername);
+		start = ishashmap(&tmp) ? hashmapvalue(&tmp) : NULL;
+		break;
+	}
+	default:
+		break;
+	}
+
+	/* cache hit? */
+	cache = env->icache != NULL ? env->icache[offset] : NULL;
+
+	if (cache != NULL
+	 && cache->name == objvalue(name)
+	 && cache->version == spn_hashmap_class_version()
+	 && cache->typetag == typetag
+	 && cache->start == start) {
+		*result = cache->member;
+		return 1;
+	}
+
+	/* cache miss: perform the lookup, exactly as lookup_member() would */
+	if (typetag == SPN_TTAG_HASHMAP) {
+		if (start == NULL || !lookup_member_chained_marking(vm, result, start, name)) {
+			root = spn_hashmap_get(vm->classes, &tagval);
+
+			if (!ishashmap(&root) || !lookup_member_chained_marking(vm, result, hashmapvalue(&root), name)) {
+				*result = spn_nilval;
+			}
+		}
+	} else {
+		root = spn_hashmap_get(vm->classes, &tagval);
+
+		/* primitive type has no class: not cached, this is an error */
+		if (!ishashmap(&root)) {
+			return 0;
+		}
+
+		if (!lookup_member_chained_marking(vm, result, hashmapvalue(&root), name)) {
+			*result = spn_nilval;
+		}
+	}
+
+	/* fill in the cache entry */
+	cache = member_cache_entry(env, offset, name);
+	cache->version = spn_hashmap_class_version();
+	cache->typetag = typetag;
+	cache->start = start;
+	cache->member = *result;
+
+	return 1;
+}
+
+static int get_property(SpnVMachine *vm, spn_uword *ip, int dstidx, SpnValue *pself, SpnValue *prname)
+{
+	SpnValue *result = VALPTR(vm->sp, dstidx);
+	SpnValue accval, gval; /* accessors and getter */
+	const void *args[2]; /* for error reporting */
+
+	if (lookup_member_cached(vm, ip - 1, &accval, pself, prname)) {
+		if (ishashmap(&accval)) {
+			SpnHashMap *accessors = hashmapvalue(&accval);
+			gval = spn_hashmap_get(accessors, &vm->getname);
+
+			if (isfunc(&gval)) {
+				/* the getter takes its arguments as a contiguous array */
+				SpnFunction *getter = funcvalue(&gval);
+				SpnValue gargv[2], grv;
+				gargv[0] = *pself;
+				gargv[1] = *prname;
+
+				if (spn_vm_callfunc(vm, getter, &grv, COUNT(gargv), gargv) != 0) {
+					return -1;
+				}
+
+				spn_value_release(result);
+				*result = grv;
+
+				return 0;
+			}
+		}
+
+		/* else if self is a hashmap, fall back to raw indexing getter.
+		 * In this case, the value found by the lookup above is the
+		 * very same value indexing would yield. We can use the original
+		 * pointers here, since if control flow reached this point,
+		 * that means that no getter has been found, consequently
+		 * no function could be called.
+		 */
+		if (ishashmap(pself)) {
+			store_reg(result, &accval);
+			return 0;
+		}
+	}
+
+	/* at this point, the value had neither a class nor an
+	 * appropriate getter function, and it's not a hashmap
+	 */
+	args[0] = spn_type_name(valtype(pself));
+	args[1] = stringvalue(prname)->cstr;
+	runtime_error(vm, ip - 1, "value of type %s has no getter for property '%s'", args);
+	return -1;
+}
+
 static SpnValue typeof_value(SpnValue *val)
 {
-	const char *type = spn_type_name(val->type);
+	const char *type = spn_type_name(valtype(val));
 	return makestring_nocopy(type);
 }
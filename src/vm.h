@@ -289,8 +289,8 @@ enum spn_vm_ins {
 	SPN_INS_LDSYM,    /* a = local symtab[b] (V)              */
 	SPN_INS_MOV,      /* a = b                                */
 	SPN_INS_ARGV,     /* a = argv (contains all arguments)    */
-	SPN_INS_NEWARR,   /* a = new array                        */
-	SPN_INS_NEWHASH,  /* a = new hashmap                      */
+	SPN_INS_NEWARR,   /* a = new array (XVI)                  */
+	SPN_INS_NEWHASH,  /* a = new hashmap (XVI)                */
 	SPN_INS_IDX_GET,  /* a = b[c]                             */
 	SPN_INS_IDX_SET,  /* a[b] = c                             */
 	SPN_INS_ARR_PUSH, /* a.push(b); used for array literals   */
@@ -300,7 +300,23 @@ enum spn_vm_ins {
 	SPN_INS_LDUPVAL,  /* a = upvalues[b];                     */
 	SPN_INS_METHOD,   /* a = classes[b][c] (VIII)             */
 	SPN_INS_PROPGET,  /* a = classes[b].getter(b, c) (IX)     */
-	SPN_INS_PROPSET   /* classes[a].setter(a, b, c) (X)       */
+	SPN_INS_PROPSET,  /* classes[a].setter(a, b, c) (X)       */
+	SPN_INS_JEQ,      /* conditional jump if a == b (XI)      */
+	SPN_INS_JNE,      /* conditional jump if a != b           */
+	SPN_INS_JLT,      /* conditional jump if a < b            */
+	SPN_INS_JLE,      /* conditional jump if a <= b           */
+	SPN_INS_JGT,      /* conditional jump if a > b            */
+	SPN_INS_JGE,      /* conditional jump if a >= b           */
+	SPN_INS_ADDI,     /* a = b + c, immediate c (XII)         */
+	SPN_INS_SUBI,     /* a = b - c, immediate c               */
+	SPN_INS_FORLT,    /* a += c; jump if a < b (XIII)         */
+	SPN_INS_FORLE,    /* a += c; jump if a <= b               */
+	SPN_INS_FORGT,    /* a += c; jump if a > b                */
+	SPN_INS_FORGE,    /* a += c; jump if a >= b               */
+	SPN_INS_LENGTH,   /* a = b.length (XIV)                   */
+	SPN_INS_CONCATN,  /* a = b operands concatenated (XV)     */
+	SPN_INS_TAILCALL, /* return a = b(...) (XVII)             */
+	SPN_INS_COUNT     /* number of opcodes (not an opcode)    */
 };
 
 /* Remarks:
@@ -387,6 +403,55 @@ enum spn_vm_ins {
  *
  * (X): SPN_INS_PROPSET calls the property setter method of object 'a',
  * passing in the index/name 'b' and its new value 'c'.
+ *
+ * (XI): the fused compare-and-branch instructions SPN_INS_JEQ...SPN_INS_JGE
+ * compare registers 'a' and 'b' exactly like SPN_INS_EQ...SPN_INS_GE would,
+ * and jump if the result is true. Just like with SPN_INS_JZE and SPN_INS_JNZ,
+ * the jump offset is stored in the 'spn_uword' following the instruction.
+ * They spare the temporary register and the separate Boolean test and jump
+ * that the compiler would otherwise emit for conditions of 'if', 'while' and
+ * 'for' statements that are comparisons.
+ *
+ * (XII): SPN_INS_ADDI and SPN_INS_SUBI add an integer to or subtract an
+ * integer from register 'b', and store the result in register 'a'. Operand
+ * 'c' is not a register index but the (unsigned, 8-bit) integer itself.
+ *
+ * (XIII): SPN_INS_FORLT...SPN_INS_FORGE close counted loops, i. e. 'for'
+ * loops of the form 'for <init>; i < n; i++ { ... }', where the counter
+ * 'i' and the limit 'n' live in registers 'a' and 'b' (instead of '<', the
+ * condition may also use '<=', '>' or '>='; instead of '++', the increment
+ * can also be '--', 'i += k' or 'i -= k'). They add the step, operand 'c'
+ * (a signed, 8-bit two's complement integer), to the loop counter, compare
+ * the counter to the limit, and jump back to the loop body (the offset is
+ * in the next 'spn_uword' as usual) if the condition still holds. The test
+ * before the first iteration is done by one of the fused compare-and-branch
+ * instructions (XI), which thus serves as the loop preparation step.
+ *
+ * (XIV): SPN_INS_LENGTH is what the compiler emits for 'b.length'. The name
+ * of the property is resolved at compile time, so for strings, arrays and
+ * hashmaps, it yields the length without a property name comparison. For
+ * other types, it behaves exactly like SPN_INS_PROPGET with 'c' = "length".
+ *
+ * (XV): SPN_INS_CONCATN is emitted for chains of concatenations, such as
+ * 'a .. b .. c', which would otherwise create a temporary string for each
+ * '..' operator. 'b' is the number of operands; the following 'b' octets
+ * are the register indices of the operands, just like the arguments of
+ * SPN_INS_CALL (I).
+ *
+ * (XVI): SPN_INS_NEWARR and SPN_INS_NEWHASH are mid-format instructions: 'b'
+ * is a capacity hint, the number of elements in the array or hashmap literal
+ * (saturated at 0xffff), so that the new container is allocated at its final
+ * size up front instead of being grown while the literal is filled in. Zero
+ * means no hint.
+ *
+ * (XVII): SPN_INS_TAILCALL is emitted for 'return f(...);'. Its operands are
+ * the same as those of SPN_INS_CALL (I), and it is always followed by
+ * 'SPN_INS_RET a'. If the callee is a Sparkling function, the frame of the
+ * caller is popped and replaced by that of the callee, which returns
+ * directly to the caller's caller, so the RET is never reached, and tail
+ * recursion runs in constant stack space. (The replaced frame doesn't show
+ * up in stack traces.) If the callee is a native function, the instruction
+ * behaves exactly like SPN_INS_CALL, and the RET returns the result.
  */
 
 #endif /* SPN_VM_H */
@@ -0,0 +1,70 @@
+/*
+ * allocator.c
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * A custom object allocator can be installed before the first context is
+ * created and after the last one is freed, but not while objects are alive.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ctx.h"
+
+#include "check.h"
+
+typedef struct Counts {
+	size_t allocs;
+	size_t deallocs;
+} Counts;
+
+static void *counting_alloc(size_t size, void *ctx)
+{
+	Counts *counts = ctx;
+	counts->allocs++;
+	return malloc(size);
+}
+
+static void counting_dealloc(void *ptr, size_t size, void *ctx)
+{
+	Counts *counts = ctx;
+	counts->deallocs++;
+	free(ptr);
+}
+
+int main(void)
+{
+	Counts counts = { 0, 0 };
+	SpnAllocator allocator;
+	SpnObjectStats stats;
+	SpnContext ctx;
+	SpnValue ret;
+
+	allocator.alloc = counting_alloc;
+	allocator.dealloc = counting_dealloc;
+	allocator.ctx = &counts;
+
+	check(spn_object_set_allocator(&allocator) == 0, "allocator set before first context");
+
+	spn_ctx_init(&ctx);
+
+	if (spn_ctx_execstring(&ctx, "var s = \"\"; for var i = 0; i < 100; i++ { s = s .. \"ab\"; } return { \"s\": s };", &ret) != 0) {
+		fprintf(stderr, "%s\n", spn_ctx_geterrmsg(&ctx));
+		check(0, "program runs");
+	}
+
+	check(counts.allocs > 0, "objects are allocated by the custom allocator");
+	check(spn_object_set_allocator(NULL) != 0, "allocator can't be changed while objects are alive");
+
+	spn_value_release(&ret);
+	spn_ctx_free(&ctx);
+
+	spn_object_stats(&stats);
+	check(stats.live_objects == 0, "no objects are alive after the context is freed");
+	check(counts.allocs == counts.deallocs, "every object is deallocated by the allocator that created it");
+	check(spn_object_set_allocator(NULL) == 0, "allocator restored after last context");
+
+	return failed;
+}
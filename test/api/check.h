@@ -0,0 +1,26 @@
+/*
+ * check.h
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Assertions shared by the API tests. A failed check is reported, but
+ * the test keeps running; main() returns 'failed' as its exit status.
+ */
+
+#ifndef SPN_TEST_CHECK_H
+#define SPN_TEST_CHECK_H
+
+#include <stdio.h>
+
+static int failed = 0;
+
+static void check(int cond, const char *what)
+{
+	if (!cond) {
+		fprintf(stderr, "FAILED: %s\n", what);
+		failed = 1;
+	}
+}
+
+#endif /* SPN_TEST_CHECK_H */
@@ -0,0 +1,132 @@
+/*
+ * hashmap.c
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Basic operations of the open addressing hash table: keys of different
+ * types, removal (tombstones), reinsertion and iteration order.
+ */
+
+#include <stdio.h>
+
+#include "hashmap.h"
+#include "private.h"
+
+#include "check.h"
+
+#define NKEYS 1000
+
+static SpnValue strkey(int i)
+{
+	char buf[32];
+	sprintf(buf, "key #%d", i);
+	return makestring(buf);
+}
+
+static void set_int(SpnHashMap *hm, const SpnValue *key, long n)
+{
+	SpnValue val = makeint(n);
+	spn_hashmap_set(hm, key, &val);
+}
+
+/* returns -1 if the value isn't an integer (e. g. it's nil) */
+static long get_int(SpnHashMap *hm, const SpnValue *key)
+{
+	SpnValue val = spn_hashmap_get(hm, key);
+	return isint(&val) ? intvalue(&val) : -1;
+}
+
+int main(void)
+{
+	SpnHashMap *hm = spn_hashmap_new();
+	SpnValue key, val;
+	size_t cursor;
+	int i, ok;
+
+	/* integer, float and string keys, interleaved */
+	for (i = 0; i < NKEYS; i++) {
+		SpnValue ik = makeint(i);
+		SpnValue fk = makefloat(i + 0.5);
+		SpnValue sk = strkey(i);
+
+		set_int(hm, &ik, i);
+		set_int(hm, &fk, i + NKEYS);
+		set_int(hm, &sk, i + 2 * NKEYS);
+
+		spn_value_release(&sk);
+	}
+
+	check(spn_hashmap_count(hm) == 3 * NKEYS, "count after insertion");
+
+	ok = 1;
+	for (i = 0; i < NKEYS; i++) {
+		SpnValue ik = makeint(i);
+		SpnValue fk = makefloat(i + 0.5);
+		SpnValue sk = strkey(i);
+
+		ok = ok && get_int(hm, &ik) == i;
+		ok = ok && get_int(hm, &fk) == i + NKEYS;
+		ok = ok && get_int(hm, &sk) == i + 2 * NKEYS;
+
+		spn_value_release(&sk);
+	}
+	check(ok, "lookup of every key");
+
+	key = makeint(NKEYS);
+	val = spn_hashmap_get(hm, &key);
+	check(isnil(&val), "lookup of missing key");
+
+	/* remove the odd integer keys, then put every tenth one back */
+	for (i = 1; i < NKEYS; i += 2) {
+		key = makeint(i);
+		spn_hashmap_delete(hm, &key);
+	}
+
+	check(spn_hashmap_count(hm) == 3 * NKEYS - NKEYS / 2, "count after removal");
+
+	for (i = 1; i < NKEYS; i += 20) {
+		key = makeint(i);
+		set_int(hm, &key, -i);
+	}
+
+	ok = 1;
+	for (i = 0; i < NKEYS; i++) {
+		long expected = i % 2 == 0 ? i : i % 20 == 1 ? -i : -1;
+		key = makeint(i);
+		ok = ok && get_int(hm, &key) == expected;
+	}
+	check(ok, "lookup after removal and reinsertion");
+
+	/* Inserting and removing the same key over and over again
+	 * must reuse tombstones instead of filling up the table.
+	 */
+	key = makeint(-1);
+	for (i = 0; i < 100 * NKEYS; i++) {
+		set_int(hm, &key, i);
+		spn_hashmap_delete(hm, &key);
+	}
+	val = spn_hashmap_get(hm, &key);
+	check(isnil(&val), "churned key is removed");
+
+	/* iteration: insertion order, reinserted keys last */
+	ok = 1;
+	i = 0;
+	cursor = 0;
+	while ((cursor = spn_hashmap_next(hm, cursor, &key, &val)) != 0) {
+		if (i < 3 * NKEYS - NKEYS / 2) {
+			/* not a reinserted key */
+			ok = ok && !(isint(&key) && intvalue(&key) % 2 != 0);
+		} else {
+			ok = ok && isint(&key) && intvalue(&key) == -intvalue(&val);
+		}
+
+		i++;
+	}
+	check(ok, "iteration order");
+	check(i == (int)(spn_hashmap_count(hm)), "number of iterated keys");
+
+	spn_object_release(hm);
+
+	return failed;
+}
@@ -0,0 +1,106 @@
+/*
+ * hashmap_growth.c
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Tables of 4096 buckets or more are migrated incrementally when they grow.
+ * Keys must be found, replaced and removed correctly while the migration
+ * is in progress, i. e. while they may be in either the old or the new table.
+ */
+
+#include "hashmap.h"
+#include "private.h"
+
+#include "check.h"
+
+/* enough for the table to grow to 64k buckets */
+#define NKEYS 40000
+
+/* every DELETE_EVERY-th key is removed DELETE_LAG insertions later */
+#define DELETE_EVERY 50
+#define DELETE_LAG   25
+
+static int is_deleted(long i)
+{
+	return i % DELETE_EVERY == 0;
+}
+
+/* the value of key 'i' after 'n' keys have been inserted, or -1 if none */
+static long expected_value(long i, long n)
+{
+	if (i < 0 || i >= n || (is_deleted(i) && i + DELETE_LAG < n)) {
+		return -1;
+	}
+
+	/* odd keys are replaced right after their insertion */
+	return i % 2 ? -i : i;
+}
+
+static long get_int(SpnHashMap *hm, long i)
+{
+	SpnValue key = makeint(i);
+	SpnValue val = spn_hashmap_get(hm, &key);
+	return isint(&val) ? intvalue(&val) : -1;
+}
+
+static void set_int(SpnHashMap *hm, long i, long n)
+{
+	SpnValue key = makeint(i);
+	SpnValue val = makeint(n);
+	spn_hashmap_set(hm, &key, &val);
+}
+
+int main(void)
+{
+	SpnHashMap *hm = spn_hashmap_new();
+	SpnValue key, val;
+	size_t cursor;
+	long i, j, prev;
+	int ok = 1;
+
+	for (i = 0; i < NKEYS; i++) {
+		set_int(hm, i, i);
+
+		if (i % 2) {
+			set_int(hm, i, -i);
+		}
+
+		if (i >= DELETE_LAG && is_deleted(i - DELETE_LAG)) {
+			key = makeint(i - DELETE_LAG);
+			spn_hashmap_delete(hm, &key);
+		}
+
+		/* spot checks after every insertion... */
+		ok = ok && get_int(hm, i) == expected_value(i, i + 1);
+		ok = ok && get_int(hm, i / 2) == expected_value(i / 2, i + 1);
+		ok = ok && get_int(hm, i / 7) == expected_value(i / 7, i + 1);
+		ok = ok && get_int(hm, i - DELETE_LAG) == expected_value(i - DELETE_LAG, i + 1);
+		ok = ok && get_int(hm, i + 1) == -1;
+
+		/* ...and a full one every once in a while */
+		if (i % 4096 == 4095) {
+			for (j = 0; j < NKEYS; j++) {
+				ok = ok && get_int(hm, j) == expected_value(j, i + 1);
+			}
+		}
+	}
+
+	check(ok, "lookups during growth");
+	check(spn_hashmap_count(hm) == NKEYS - NKEYS / DELETE_EVERY, "count after growth");
+
+	/* the migration must not have changed the order of the keys */
+	ok = 1;
+	prev = -1;
+	cursor = 0;
+	while ((cursor = spn_hashmap_next(hm, cursor, &key, &val)) != 0) {
+		ok = ok && isint(&key) && intvalue(&key) > prev;
+		ok = ok && isint(&val) && intvalue(&val) == expected_value(intvalue(&key), NKEYS);
+		prev = intvalue(&key);
+	}
+	check(ok, "iteration order after growth");
+
+	spn_object_release(hm);
+
+	return failed;
+}
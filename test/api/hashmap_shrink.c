@@ -0,0 +1,154 @@
+/*
+ * hashmap_shrink.c
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Hashmaps shrink when keys are inserted after most of them have been
+ * removed, and when they are compacted explicitly. The remaining keys
+ * must survive that, in their original order. Reserving room after the
+ * removal must not be undone by such shrinking.
+ */
+
+#include "hashmap.h"
+#include "private.h"
+
+#include "check.h"
+
+/* every KEEP_EVERY-th key is kept, the others are removed */
+#define KEEP_EVERY 100
+
+static long get_int(SpnHashMap *hm, long i)
+{
+	SpnValue key = makeint(i);
+	SpnValue val = spn_hashmap_get(hm, &key);
+	return isint(&val) ? intvalue(&val) : -1;
+}
+
+static void set_int(SpnHashMap *hm, long i, long n)
+{
+	SpnValue key = makeint(i);
+	SpnValue val = makeint(n);
+	spn_hashmap_set(hm, &key, &val);
+}
+
+static void delete_int(SpnHashMap *hm, long i)
+{
+	SpnValue key = makeint(i);
+	spn_hashmap_delete(hm, &key);
+}
+
+/* Checks that exactly the keys 0, KEEP_EVERY, 2 * KEEP_EVERY, ... below
+ * 'n' are present, in this order, followed by the keys n, n + 1, ... below
+ * 'm', and that every key maps to its own value.
+ */
+static int check_keys(SpnHashMap *hm, long n, long m)
+{
+	SpnValue key, val;
+	size_t cursor = 0;
+	long i, expected = 0;
+	int ok = 1;
+
+	for (i = 0; i < m; i++) {
+		int present = i >= n || i % KEEP_EVERY == 0;
+		ok = ok && get_int(hm, i) == (present ? i : -1);
+	}
+
+	while ((cursor = spn_hashmap_next(hm, cursor, &key, &val)) != 0) {
+		ok = ok && isint(&key) && intvalue(&key) == expected;
+		ok = ok && isint(&val) && intvalue(&val) == expected;
+
+		if (expected < n && expected + KEEP_EVERY < n) {
+			expected += KEEP_EVERY;
+		} else {
+			expected = expected < n ? n : expected + 1;
+		}
+	}
+
+	ok = ok && expected == m;
+
+	return ok && spn_hashmap_count(hm) == (size_t)((n + KEEP_EVERY - 1) / KEEP_EVERY + (m - n));
+}
+
+/* fills a hashmap with 'n' keys, removes most of them, then adds 'extra' */
+static SpnHashMap *build(long n, long extra)
+{
+	SpnHashMap *hm = spn_hashmap_new();
+	long i;
+
+	for (i = 0; i < n; i++) {
+		set_int(hm, i, i);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (i % KEEP_EVERY != 0) {
+			delete_int(hm, i);
+		}
+	}
+
+	for (i = n; i < n + extra; i++) {
+		set_int(hm, i, i);
+	}
+
+	return hm;
+}
+
+int main(void)
+{
+	SpnHashMap *hm;
+	size_t cap;
+	long n;
+	int ok;
+
+	/* automatic shrinking upon insertion */
+	hm = build(10000, 10);
+	check(check_keys(hm, 10000, 10010), "keys after automatic shrinking");
+
+	/* explicit compaction, then growing again */
+	spn_hashmap_compact(hm);
+	check(check_keys(hm, 10000, 10010), "keys after compaction");
+
+	for (n = 10010; n < 12000; n++) {
+		set_int(hm, n, n);
+	}
+	check(check_keys(hm, 10000, 12000), "keys after growing again");
+
+	/* removing every key frees the storage, but the map stays usable */
+	for (n = 0; n < 12000; n++) {
+		delete_int(hm, n);
+	}
+	check(spn_hashmap_count(hm) == 0, "count after removing every key");
+
+	spn_hashmap_compact(hm);
+	set_int(hm, 42, 42);
+	check(get_int(hm, 42) == 42 && spn_hashmap_count(hm) == 1, "reuse of emptied map");
+	spn_object_release(hm);
+
+	/* reserving room after removals, then filling it without reallocation */
+	hm = build(4000, 0);
+	spn_hashmap_reserve(hm, 3000);
+	cap = spn_hashmap_capacity(hm);
+	check(cap >= 3000, "capacity after reserving room");
+
+	ok = 1;
+	for (n = 4000; spn_hashmap_count(hm) < 3000; n++) {
+		set_int(hm, n, n);
+		ok = ok && spn_hashmap_capacity(hm) == cap;
+	}
+	check(ok, "no reallocation while filling the reserved room");
+	check(check_keys(hm, 4000, n), "keys after filling the reserved room");
+	spn_object_release(hm);
+
+	/* shrinking while an incremental migration may be in progress */
+	ok = 1;
+	for (n = 2000; n < 9000; n += 97) {
+		hm = build(n, 3);
+		ok = ok && check_keys(hm, n, n + 3);
+		spn_hashmap_compact(hm);
+		ok = ok && check_keys(hm, n, n + 3);
+		spn_object_release(hm);
+	}
+	check(ok, "keys after shrinking during migration");
+
+	return failed;
+}
@@ -0,0 +1,29 @@
+/*
+ * hashseed.c
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * The hash seed can be set before anything is hashed, but not afterwards.
+ */
+
+#include "api.h"
+
+#include "check.h"
+
+int main(void)
+{
+	unsigned long h;
+
+	check(spn_hash_set_seed(42) == 0, "seed can be set before use");
+	check(spn_hash_set_seed(1337) == 0, "seed can be reset before use");
+
+	h = spn_hash_bytes("foo", 3);
+
+	check(spn_hash_seed() == 1337, "seed that was set is used");
+	check(spn_hash_set_seed(42) != 0, "seed can't be set after use");
+	check(spn_hash_seed() == 1337, "seed is unchanged after refused set");
+	check(spn_hash_bytes("foo", 3) == h, "hash values stay valid");
+
+	return failed;
+}
@@ -0,0 +1,62 @@
+/*
+ * interning.c
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * The table of interned strings of a virtual machine must not keep the
+ * constants of programs alive after the programs themselves are freed.
+ */
+
+#include <stdio.h>
+
+#include "ctx.h"
+#include "parser.h"
+#include "compiler.h"
+#include "vm.h"
+
+#include "check.h"
+
+#define NPROGRAMS 5000
+
+int main(void)
+{
+	SpnContext ctx;
+	size_t before, after;
+	int i;
+
+	spn_ctx_init(&ctx);
+
+	before = spn_object_class_stats(SPN_CLASS_UID_STRING, NULL);
+
+	/* compile, run and free lots of programs with distinct constants */
+	for (i = 0; i < NPROGRAMS; i++) {
+		char src[64];
+		SpnHashMap *ast;
+		SpnFunction *fn;
+		SpnValue ret;
+
+		sprintf(src, "return \"constant #%d\";", i);
+
+		ast = spn_parser_parse(&ctx.parser, src);
+		fn = spn_compiler_compile(ctx.cmp, ast, 0);
+		spn_object_release(ast);
+
+		if (spn_vm_callfunc(ctx.vm, fn, &ret, 0, NULL) != 0) {
+			fprintf(stderr, "%s\n", spn_vm_geterrmsg(ctx.vm));
+			check(0, "program runs");
+			break;
+		}
+
+		spn_value_release(&ret);
+		spn_object_release(fn);
+	}
+
+	after = spn_object_class_stats(SPN_CLASS_UID_STRING, NULL);
+
+	check(after - before <= NPROGRAMS / 10, "constants of freed programs are not kept alive");
+
+	spn_ctx_free(&ctx);
+
+	return failed;
+}
@@ -0,0 +1,72 @@
+/*
+ * ropes.c
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Long strings built by concatenation may be ropes internally, but strings
+ * passed to native functions or returned to C always have a valid 'cstr'.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ctx.h"
+#include "str.h"
+#include "private.h"
+
+#include "check.h"
+
+/* reads the characters of its argument directly */
+static int first_char(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnString *str = objvalue(&argv[0]);
+
+	check(argc == 1 && isstring(&argv[0]), "argument is a string");
+	check(str->cstr != NULL, "string argument of native function is flat");
+
+	*ret = makeint(str->cstr != NULL ? str->cstr[0] : -1);
+	return 0;
+}
+
+static const char src[] =
+	"var s = \"\";\n"
+	"for var i = 0; i < 200; i++ {\n"
+	"	s = s .. \"0123456789\" .. \"abcdefghij\";\n"
+	"}\n"
+	"assert(firstchar(s) == 48, \"first character\");\n"
+	"return s;\n";
+
+int main(void)
+{
+	static const SpnExtFunc fns[] = {
+		{ "firstchar", first_char }
+	};
+
+	SpnContext ctx;
+	SpnValue ret;
+
+	spn_ctx_init(&ctx);
+	spn_ctx_addlib_cfuncs(&ctx, NULL, fns, COUNT(fns));
+
+	if (spn_ctx_execstring(&ctx, src, &ret) != 0) {
+		fprintf(stderr, "%s\n", spn_ctx_geterrmsg(&ctx));
+		check(0, "program runs");
+		spn_ctx_free(&ctx);
+		return failed;
+	}
+
+	if (isstring(&ret)) {
+		SpnString *str = objvalue(&ret);
+		check(str->cstr != NULL, "string returned to C is flat");
+		check(str->len == 4000, "length of result");
+		check(str->cstr != NULL && memcmp(str->cstr + 3990, "abcdefghij", 10) == 0, "contents of result");
+	} else {
+		check(0, "result is a string");
+	}
+
+	spn_value_release(&ret);
+	spn_ctx_free(&ctx);
+
+	return failed;
+}
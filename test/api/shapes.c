@@ -0,0 +1,74 @@
+/*
+ * shapes.c
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Objects built by scripts must keep their shape, even in a context whose
+ * standard library has already created lots of hashmaps with string keys.
+ */
+
+#include <stdio.h>
+
+#include "ctx.h"
+#include "hashmap.h"
+#include "private.h"
+
+#include "check.h"
+
+/* runs 'src', which must return a hashmap, and returns its shape */
+static const void *shape_of(SpnContext *ctx, const char *src, SpnValue *ret)
+{
+	if (spn_ctx_execstring(ctx, src, ret) != 0) {
+		fprintf(stderr, "%s\n", spn_ctx_geterrmsg(ctx));
+		check(0, "program runs");
+		*ret = spn_nilval;
+		return NULL;
+	}
+
+	if (!ishashmap(ret)) {
+		check(0, "result is a hashmap");
+		return NULL;
+	}
+
+	return spn_hashmap_shape(hashmapvalue(ret));
+}
+
+int main(void)
+{
+	SpnContext ctx;
+	SpnValue a, b, c, key;
+	const void *sa, *sb, *sc;
+
+	spn_ctx_init(&ctx);
+
+	sa = shape_of(&ctx, "var o = {}; o.zork = 1; o.quux = 2; return o;", &a);
+	sb = shape_of(&ctx, "var o = {}; o.zork = 3; o.quux = 4; return o;", &b);
+	sc = shape_of(&ctx, "return { \"quux\": 1, \"zork\": 2 };", &c);
+
+#if USE_HASHMAP_SHAPES
+	check(sa != NULL, "object built key by key has a shape");
+	check(sc != NULL, "object literal has a shape");
+	check(sa == sb, "objects built the same way share their shape");
+	check(sa != sc, "keys added in a different order give another shape");
+
+	key = makestring("quux");
+	check(spn_hashmap_slot_index(hashmapvalue(&a), &key) == 1, "slot index of second key");
+	check(spn_hashmap_slot_index(hashmapvalue(&c), &key) == 0, "slot index of first key");
+	spn_value_release(&key);
+#else
+	check(sa == NULL && sb == NULL && sc == NULL, "no shapes without HASHMAP_SHAPES");
+	(void)(key);
+#endif /* USE_HASHMAP_SHAPES */
+
+	/* the library and the host don't get shapes */
+	check(spn_hashmap_shape(spn_ctx_getglobals(&ctx)) == NULL, "global table has no shape");
+
+	spn_value_release(&a);
+	spn_value_release(&b);
+	spn_value_release(&c);
+
+	spn_ctx_free(&ctx);
+
+	return failed;
+}
@@ -0,0 +1,106 @@
+/*
+ * tailcalls.c
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * 'return f(...);' replaces the frame of the caller, so tail recursion
+ * runs in constant stack space, however deep it goes.
+ */
+
+#include <stdio.h>
+
+#include "ctx.h"
+#include "private.h"
+
+#include "check.h"
+
+/* returns the number of frames on the call stack */
+static int stack_depth(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	size_t size;
+	SpnStackFrame *frames = spn_ctx_stacktrace(ctx, &size);
+
+	free(frames);
+	*ret = makeint(size);
+	return 0;
+}
+
+/* runs 'src' and returns the integer it returns, or -1 on error */
+static long run(SpnContext *ctx, const char *src)
+{
+	SpnValue ret;
+	long res;
+
+	if (spn_ctx_execstring(ctx, src, &ret) != 0) {
+		fprintf(stderr, "%s\n", spn_ctx_geterrmsg(ctx));
+		return -1;
+	}
+
+	res = isint(&ret) ? intvalue(&ret) : -1;
+	spn_value_release(&ret);
+
+	return res;
+}
+
+static const char self_recursion[] =
+	"let count = fn (n, acc) {\n"
+	"	if n == 0 {\n"
+	"		return acc + stackdepth();\n"
+	"	}\n"
+	"	return count(n - 1, acc + 1);\n"
+	"};\n"
+	"return count(100000, 0);\n";
+
+static const char mutual_recursion[] =
+	"let even = fn (n, even, odd) {\n"
+	"	if n == 0 {\n"
+	"		return -stackdepth();\n"
+	"	}\n"
+	"	return odd(n - 1, even, odd);\n"
+	"};\n"
+	"let odd = fn (n, even, odd) {\n"
+	"	if n == 0 {\n"
+	"		return stackdepth();\n"
+	"	}\n"
+	"	return even(n - 1, even, odd);\n"
+	"};\n"
+	"return even(100001, even, odd);\n";
+
+static const char plain_recursion[] =
+	"let count = fn (n) {\n"
+	"	if n == 0 {\n"
+	"		return stackdepth();\n"
+	"	}\n"
+	"	let depth = count(n - 1);\n"
+	"	return depth;\n"
+	"};\n"
+	"return count(1000);\n";
+
+int main(void)
+{
+	static const SpnExtFunc fns[] = {
+		{ "stackdepth", stack_depth }
+	};
+
+	SpnContext ctx;
+	long res;
+
+	spn_ctx_init(&ctx);
+	spn_ctx_addlib_cfuncs(&ctx, NULL, fns, COUNT(fns));
+
+	/* the program, 'count' and 'stackdepth' itself */
+	res = run(&ctx, self_recursion);
+	check(res >= 100000 && res - 100000 <= 3, "100000-deep tail recursion");
+
+	res = run(&ctx, mutual_recursion);
+	check(res > 0 && res <= 3, "100000-deep mutual tail recursion");
+
+	/* calls that aren't in tail position still build up the stack */
+	res = run(&ctx, plain_recursion);
+	check(res > 1000, "recursion without tail calls");
+
+	spn_ctx_free(&ctx);
+
+	return failed;
+}